@@ -1,6 +1,9 @@
 #ifndef IMAGINEPLUSPLUS_HPP_
 #define IMAGINEPLUSPLUS_HPP_
 
+#include <exception>
+#include <future>
+#include <memory>
 #include "imagine.h"
 
 #ifndef IMAGINEXX_NAMESPACE
@@ -33,6 +36,17 @@ struct im_output_buffer : public imagine_output_buffer {
 	}
 };
 
+struct im_file_format_info : public imagine_file_format_info {
+	im_file_format_info() : imagine_file_format_info()
+	{
+	}
+
+	bool is_constant_format() const
+	{
+		return plane_count != 0;
+	}
+};
+
 class FileFormat {
 	imagine_file_format *format;
 
@@ -133,15 +147,107 @@ public:
 		return ret;
 	}
 
-	static imagine_io_context *from_file_ro(const char *path)
+	static imagine_io_context *from_file_ro(const char *path, const imagine_file_options *options = 0)
+	{
+		imagine_io_context *io;
+
+		if (!(io = imagine_io_context_from_file_ro(path, options)))
+			throw im_error();
+
+		return io;
+	}
+
+	static imagine_io_context *from_file_mmap(const char *path)
+	{
+		imagine_io_context *io;
+
+		if (!(io = imagine_io_context_from_file_mmap(path)))
+			throw im_error();
+
+		return io;
+	}
+
+	static imagine_io_context *from_file_pread(const char *path)
 	{
 		imagine_io_context *io;
 
-		if (!(io = imagine_io_context_from_file_ro(path)))
+		if (!(io = imagine_io_context_from_file_pread(path)))
 			throw im_error();
 
 		return io;
 	}
+
+	static imagine_io_context *from_callbacks(const imagine_io_callbacks *callbacks, void *user, const char *path = 0)
+	{
+		imagine_io_context *io;
+
+		if (!(io = imagine_io_context_from_callbacks(callbacks, user, path)))
+			throw im_error();
+
+		return io;
+	}
+
+	static imagine_io_context *stats(imagine_io_context *io)
+	{
+		imagine_io_context *ret;
+
+		if (!(ret = imagine_io_context_stats(io)))
+			throw im_error();
+
+		return ret;
+	}
+
+	static imagine_io_context *readahead(imagine_io_context *io, size_t buffer_size = 0)
+	{
+		imagine_io_context *ret;
+
+		if (!(ret = imagine_io_context_readahead(io, buffer_size)))
+			throw im_error();
+
+		return ret;
+	}
+};
+
+class Allocator {
+	imagine_allocator *allocator;
+
+	Allocator(const Allocator &);
+
+	Allocator &operator=(const Allocator &);
+public:
+	explicit Allocator(imagine_allocator *allocator) : allocator(allocator)
+	{
+	}
+
+	~Allocator()
+	{
+		imagine_allocator_free(allocator);
+	}
+
+	operator imagine_allocator *()
+	{
+		return allocator;
+	}
+
+	static imagine_allocator *from_callbacks(const imagine_allocator_callbacks *callbacks, void *user)
+	{
+		imagine_allocator *allocator;
+
+		if (!(allocator = imagine_allocator_from_callbacks(callbacks, user)))
+			throw im_error();
+
+		return allocator;
+	}
+
+	static imagine_allocator *thread_arena()
+	{
+		imagine_allocator *allocator;
+
+		if (!(allocator = imagine_allocator_thread_arena()))
+			throw im_error();
+
+		return allocator;
+	}
 };
 
 class DecoderRegistry {
@@ -165,6 +271,11 @@ public:
 		imagine_decoder_registry_disable_provider(registry, name);
 	}
 
+	void set_allocator(imagine_allocator *allocator)
+	{
+		imagine_decoder_registry_set_allocator(registry, allocator);
+	}
+
 	imagine_decoder *create_decoder(const char *path, const imagine_file_format *format, imagine_io_context *io)
 	{
 		imagine_clear_last_error();
@@ -176,6 +287,24 @@ public:
 		return decoder;
 	}
 
+	void probe(const char *path, imagine_io_context *io, imagine_file_format *format) const
+	{
+		if (imagine_probe(registry, path, io, format))
+			throw im_error();
+	}
+
+	void probe_batch(size_t n, const char * const *paths, imagine_io_context * const *io, imagine_file_format * const *formats, imagine_error_code_e *errors, unsigned num_threads = 0) const
+	{
+		if (imagine_probe_batch(registry, n, paths, io, formats, errors, num_threads))
+			throw im_error();
+	}
+
+	void decode_batch(size_t n, const char * const *paths, imagine_io_context * const *io, const imagine_output_buffer *buffers, imagine_error_code_e *errors, unsigned num_threads = 0) const
+	{
+		if (imagine_decode_batch(registry, n, paths, io, buffers, errors, num_threads))
+			throw im_error();
+	}
+
 	static imagine_decoder_registry *create()
 	{
 		imagine_decoder_registry *registry = imagine_decoder_registry_alloc();
@@ -185,6 +314,16 @@ public:
 
 		return registry;
 	}
+
+	static const imagine_decoder_registry *get_default()
+	{
+		const imagine_decoder_registry *registry = imagine_decoder_registry_get_default();
+
+		if (!registry)
+			throw im_error();
+
+		return registry;
+	}
 };
 
 class Decoder {
@@ -199,6 +338,17 @@ class Decoder {
 		if (x)
 			throw im_error();
 	}
+
+	static void fulfil_promise(void *user, imagine_error_code_e code)
+	{
+		std::unique_ptr<std::promise<void> > promise(static_cast<std::promise<void> *>(user));
+
+		// The error of the worker thread is current within the callback.
+		if (code == IMAGINE_ERROR_SUCCESS)
+			promise->set_value();
+		else
+			promise->set_exception(std::make_exception_ptr(im_error()));
+	}
 public:
 	explicit Decoder(imagine_decoder *decoder) : decoder(decoder)
 	{
@@ -229,10 +379,77 @@ public:
 		check(imagine_decoder_next_frame_format(decoder, format));
 	}
 
+	void file_format(imagine_file_format_info *info)
+	{
+		check(imagine_decoder_file_format2(decoder, info));
+	}
+
+	void next_frame_format(imagine_file_format_info *info)
+	{
+		check(imagine_decoder_next_frame_format2(decoder, info));
+	}
+
+	size_t memory_estimate()
+	{
+		size_t bytes;
+		check(imagine_decoder_memory_estimate(decoder, &bytes));
+		return bytes;
+	}
+
 	void decode(const imagine_output_buffer &buf)
 	{
 		check(imagine_decoder_decode(decoder, &buf));
 	}
+
+	void decode_region(const imagine_output_buffer &buf, const imagine_rect &rect)
+	{
+		check(imagine_decoder_decode_region(decoder, &buf, &rect));
+	}
+
+	void decode_async(const imagine_output_buffer &buf, imagine_decode_callback callback, void *user)
+	{
+		check(imagine_decoder_decode_async(decoder, &buf, callback, user));
+	}
+
+	std::future<void> decode_async(const imagine_output_buffer &buf)
+	{
+		std::unique_ptr<std::promise<void> > promise(new std::promise<void>());
+		std::future<void> future = promise->get_future();
+
+		check(imagine_decoder_decode_async(decoder, &buf, &Decoder::fulfil_promise, promise.get()));
+		promise.release();
+		return future;
+	}
+
+	void decode_rows(imagine_row_callback callback, void *user)
+	{
+		check(imagine_decoder_decode_rows(decoder, callback, user));
+	}
+
+	void reset(imagine_io_context *io)
+	{
+		check(imagine_decoder_reset(decoder, io));
+	}
+
+	void set_allocator(imagine_allocator *allocator)
+	{
+		imagine_decoder_set_allocator(decoder, allocator);
+	}
+
+	void set_scale_denominator(unsigned denom)
+	{
+		check(imagine_decoder_set_scale_denominator(decoder, denom));
+	}
+
+	void set_output_layout(const imagine_output_layout &layout)
+	{
+		check(imagine_decoder_set_output_layout(decoder, &layout));
+	}
+
+	void set_sample_format(unsigned bit_depth, bool floating_point = false)
+	{
+		check(imagine_decoder_set_sample_format(decoder, bit_depth, floating_point));
+	}
 };
 
 } // namespace imaginexx
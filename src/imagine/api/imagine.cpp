@@ -1,15 +1,24 @@
 #include <cstring>
 #include <exception>
+#include <memory>
 #include <string>
 #include <type_traits>
+#include <vector>
+#include "common/allocator.h"
 #include "common/buffer.h"
+#include "common/callback_io.h"
+#include "common/direct_io.h"
 #include "common/decoder.h"
 #include "common/except.h"
+#include "common/fd_io.h"
 #include "common/file_io.h"
 #include "common/format.h"
 #include "common/im_assert.h"
 #include "common/io_context.h"
 #include "common/memory_io.h"
+#include "common/mmap_io.h"
+#include "common/readahead_io.h"
+#include "common/stats_io.h"
 #include "imagine.h"
 
 namespace {
@@ -45,6 +54,78 @@ const imagine::FileFormat *file_format_cast(const imagine_file_format *ptr)
 	return static_cast<const imagine::FileFormat *>(ptr);
 }
 
+imagine_color_family_e translate_color_family(imagine::ColorFamily color_family)
+{
+	switch (color_family) {
+	case imagine::ColorFamily::GRAY:
+		return IMAGINE_COLOR_FAMILY_GRAY;
+	case imagine::ColorFamily::YUV:
+		return IMAGINE_COLOR_FAMILY_YUV;
+	case imagine::ColorFamily::RGB:
+		return IMAGINE_COLOR_FAMILY_RGB;
+	case imagine::ColorFamily::GRAYALPHA:
+		return IMAGINE_COLOR_FAMILY_GRAYALPHA;
+	case imagine::ColorFamily::YUVA:
+		return IMAGINE_COLOR_FAMILY_YUVA;
+	case imagine::ColorFamily::RGBA:
+		return IMAGINE_COLOR_FAMILY_RGBA;
+	case imagine::ColorFamily::YCCK:
+		return IMAGINE_COLOR_FAMILY_YCCK;
+	case imagine::ColorFamily::CMYK:
+		return IMAGINE_COLOR_FAMILY_CMYK;
+	default:
+		return IMAGINE_COLOR_FAMILY_UNKNOWN;
+	}
+}
+
+imagine_image_type_e translate_image_type(imagine::ImageType type)
+{
+	switch (type) {
+	case imagine::ImageType::BMP:
+		return IMAGINE_IMAGE_BMP;
+	case imagine::ImageType::DPX:
+		return IMAGINE_IMAGE_DPX;
+	case imagine::ImageType::EXR:
+		return IMAGINE_IMAGE_EXR;
+	case imagine::ImageType::JPEG:
+		return IMAGINE_IMAGE_JPEG;
+	case imagine::ImageType::JPEG2000:
+		return IMAGINE_IMAGE_JPEG2000;
+	case imagine::ImageType::PNG:
+		return IMAGINE_IMAGE_PNG;
+	case imagine::ImageType::TIFF:
+		return IMAGINE_IMAGE_TIFF;
+	default:
+		return IMAGINE_IMAGE_UNKNOWN;
+	}
+}
+
+void translate_frame_format(const imagine::FrameFormat &format, imagine_file_format_info *info)
+{
+	for (unsigned p = 0; p < imagine::MAX_PLANE_COUNT; ++p) {
+		info->plane[p].width = format.plane[p].width;
+		info->plane[p].height = format.plane[p].height;
+		info->plane[p].bit_depth = format.plane[p].bit_depth;
+		info->plane[p].is_floating_point = format.plane[p].floating_point;
+	}
+	info->plane_count = format.plane_count;
+	info->color_family = translate_color_family(format.color_family);
+	info->type = IMAGINE_IMAGE_UNKNOWN;
+	info->frame_count = 0;
+}
+
+void translate_file_format(const imagine::FileFormat &format, imagine_file_format_info *info)
+{
+	translate_frame_format(format, info);
+	info->type = translate_image_type(format.type);
+	info->frame_count = format.frame_count;
+}
+
+imagine::Allocator *allocator_cast(imagine_allocator *ptr)
+{
+	return ptr ? assert_dynamic_type<imagine::Allocator>(ptr) : nullptr;
+}
+
 imagine::ImageDecoderRegistry *registry_cast(imagine_decoder_registry *ptr)
 {
 	return static_cast<imagine::ImageDecoderRegistry *>(ptr);
@@ -55,6 +136,26 @@ const imagine::ImageDecoderRegistry *registry_cast(const imagine_decoder_registr
 	return static_cast<const imagine::ImageDecoderRegistry *>(ptr);
 }
 
+class CallbackRowSink : public imagine::RowSink {
+	imagine_row_callback m_callback;
+	void *m_user;
+public:
+	CallbackRowSink(imagine_row_callback callback, void *user) : m_callback{ callback }, m_user{ user }
+	{
+	}
+
+	bool write_rows(const imagine::InputBuffer &buffer, unsigned top, unsigned height) override
+	{
+		imagine_output_buffer buf;
+
+		for (unsigned p = 0; p < imagine::MAX_PLANE_COUNT; ++p) {
+			buf.data[p] = const_cast<void *>(buffer.data[p]);
+			buf.stride[p] = buffer.stride[p];
+		}
+		return !m_callback(m_user, &buf, top, height);
+	}
+};
+
 void record_exception_message(const imagine::error::Exception &e)
 {
 	try {
@@ -263,26 +364,7 @@ imagine_color_family_e imagine_file_format_color_family_get(const imagine_file_f
 {
 	im_assert_d(ptr, "null pointer");
 
-	switch (file_format_cast(ptr)->color_family) {
-	case imagine::ColorFamily::GRAY:
-		return IMAGINE_COLOR_FAMILY_GRAY;
-	case imagine::ColorFamily::YUV:
-		return IMAGINE_COLOR_FAMILY_YUV;
-	case imagine::ColorFamily::RGB:
-		return IMAGINE_COLOR_FAMILY_RGB;
-	case imagine::ColorFamily::GRAYALPHA:
-		return IMAGINE_COLOR_FAMILY_GRAYALPHA;
-	case imagine::ColorFamily::YUVA:
-		return IMAGINE_COLOR_FAMILY_YUVA;
-	case imagine::ColorFamily::RGBA:
-		return IMAGINE_COLOR_FAMILY_RGBA;
-	case imagine::ColorFamily::YCCK:
-		return IMAGINE_COLOR_FAMILY_YCCK;
-	case imagine::ColorFamily::CMYK:
-		return IMAGINE_COLOR_FAMILY_CMYK;
-	default:
-		return IMAGINE_COLOR_FAMILY_UNKNOWN;
-	}
+	return translate_color_family(file_format_cast(ptr)->color_family);
 }
 
 void imagine_file_format_color_family_set(imagine_file_format *ptr, imagine_color_family_e color_family)
@@ -325,24 +407,7 @@ imagine_image_type_e imagine_file_format_type_get(const imagine_file_format *ptr
 {
 	im_assert_d(ptr, "null pointer");
 
-	switch (file_format_cast(ptr)->type) {
-	case imagine::ImageType::BMP:
-		return IMAGINE_IMAGE_BMP;
-	case imagine::ImageType::DPX:
-		return IMAGINE_IMAGE_DPX;
-	case imagine::ImageType::EXR:
-		return IMAGINE_IMAGE_EXR;
-	case imagine::ImageType::JPEG:
-		return IMAGINE_IMAGE_JPEG;
-	case imagine::ImageType::JPEG2000:
-		return IMAGINE_IMAGE_JPEG2000;
-	case imagine::ImageType::PNG:
-		return IMAGINE_IMAGE_PNG;
-	case imagine::ImageType::TIFF:
-		return IMAGINE_IMAGE_TIFF;
-	default:
-		return IMAGINE_IMAGE_UNKNOWN;
-	}
+	return translate_image_type(file_format_cast(ptr)->type);
 }
 
 void imagine_file_format_type_set(imagine_file_format *ptr, imagine_image_type_e type)
@@ -378,16 +443,100 @@ void imagine_file_format_type_set(imagine_file_format *ptr, imagine_image_type_e
 	}
 }
 
+unsigned imagine_file_format_frame_count_get(const imagine_file_format *ptr)
+{
+	im_assert_d(ptr, "null pointer");
+	return file_format_cast(ptr)->frame_count;
+}
+
+void imagine_file_format_frame_count_set(imagine_file_format *ptr, unsigned frame_count)
+{
+	im_assert_d(ptr, "null pointer");
+	file_format_cast(ptr)->frame_count = frame_count;
+}
+
 int imagine_is_constant_format(const imagine_file_format *format)
 {
 	im_assert_d(format, "null pointer");
 	return imagine::is_constant_format(*file_format_cast(format));
 }
 
-imagine_io_context *imagine_io_context_from_file_ro(const char *path)
+void imagine_file_options_default(imagine_file_options *options)
+{
+	im_assert_d(options, "null pointer");
+
+	options->buffer_size = 0;
+	options->access_hint = IMAGINE_ACCESS_NORMAL;
+	options->direct = 0;
+}
+
+imagine_io_context *imagine_io_context_from_file_ro(const char *path, const imagine_file_options *options)
+{
+	imagine::FileIOOptions file_options;
+
+	if (options && options->direct) {
+		try {
+			// Unbuffered reads use their own block buffer and bypass the cache.
+			if (options->buffer_size || options->access_hint != IMAGINE_ACCESS_NORMAL)
+				throw imagine::error::IllegalArgument{ "buffer size and access hint not supported with direct I/O" };
+
+			return new imagine::DirectIOContext{ path };
+		} catch (const imagine::error::Exception &) {
+			handle_exception(std::current_exception());
+			return nullptr;
+		} catch (const std::bad_alloc &) {
+			handle_bad_alloc();
+			return nullptr;
+		}
+	}
+
+	if (options) {
+		file_options.buffer_size = options->buffer_size;
+
+		switch (options->access_hint) {
+		case IMAGINE_ACCESS_SEQUENTIAL:
+			file_options.access_hint = imagine::AccessHint::SEQUENTIAL;
+			break;
+		case IMAGINE_ACCESS_WILLNEED:
+			file_options.access_hint = imagine::AccessHint::WILLNEED;
+			break;
+		case IMAGINE_ACCESS_RANDOM:
+			file_options.access_hint = imagine::AccessHint::RANDOM;
+			break;
+		default:
+			file_options.access_hint = imagine::AccessHint::NORMAL;
+			break;
+		}
+	}
+
+	try {
+		return new imagine::FileIOContext{ path, imagine::FileIOContext::read_tag, file_options };
+	} catch (const imagine::error::Exception &) {
+		handle_exception(std::current_exception());
+		return nullptr;
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_io_context *imagine_io_context_from_file_mmap(const char *path)
 {
 	try {
-		return new imagine::FileIOContext{ path, imagine::FileIOContext::read_tag };
+		return new imagine::MmapIOContext{ path };
+	} catch (const imagine::error::Exception &) {
+		handle_exception(std::current_exception());
+		return nullptr;
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_io_context *imagine_io_context_from_file_pread(const char *path)
+{
+	try {
+		return new imagine::FdIOContext{ path };
 	} catch (const imagine::error::Exception &) {
 		handle_exception(std::current_exception());
 		return nullptr;
@@ -412,11 +561,125 @@ imagine_io_context *imagine_io_context_from_memory(const void *buf, size_t n, co
 	}
 }
 
+imagine_io_context *imagine_io_context_from_callbacks(const imagine_io_callbacks *callbacks, void *user, const char *path)
+{
+	im_assert_d(callbacks && callbacks->read, "null pointer");
+
+	imagine::IOCallbacks io_callbacks;
+	io_callbacks.read = callbacks->read;
+	io_callbacks.seek = callbacks->seek;
+	io_callbacks.tell = callbacks->tell;
+	io_callbacks.size = callbacks->size;
+	io_callbacks.close = callbacks->close;
+
+	try {
+		return new imagine::CallbackIOContext{ io_callbacks, user, path ? path : "" };
+	} catch (const imagine::error::Exception &) {
+		handle_exception(std::current_exception());
+		return nullptr;
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_io_context *imagine_io_context_readahead(imagine_io_context *io, size_t buffer_size)
+{
+	im_assert_d(io, "null pointer");
+
+	std::unique_ptr<imagine::IOContext> io_uptr{ assert_dynamic_type<imagine::IOContext>(io) };
+
+	if (!buffer_size)
+		buffer_size = imagine::ReadaheadIOContext::DEFAULT_BUFFER_SIZE;
+
+	try {
+		return new imagine::ReadaheadIOContext{ std::move(io_uptr), buffer_size };
+	} catch (const imagine::error::Exception &) {
+		handle_exception(std::current_exception());
+		return nullptr;
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_io_context *imagine_io_context_stats(imagine_io_context *io)
+{
+	im_assert_d(io, "null pointer");
+
+	std::unique_ptr<imagine::IOContext> io_uptr{ assert_dynamic_type<imagine::IOContext>(io) };
+
+	try {
+		return new imagine::StatsIOContext{ std::move(io_uptr) };
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_error_code_e imagine_io_context_get_stats(const imagine_io_context *io, imagine_io_stats *stats)
+{
+	im_assert_d(io, "null pointer");
+	im_assert_d(stats, "null pointer");
+
+	try {
+		const imagine::StatsIOContext *stats_io = dynamic_cast<const imagine::StatsIOContext *>(io);
+		if (!stats_io)
+			throw imagine::error::IllegalArgument{ "context does not record statistics" };
+
+		const imagine::IOStats &io_stats = stats_io->stats();
+		stats->read_calls = io_stats.read_calls;
+		stats->bytes_read = io_stats.bytes_read;
+		stats->seek_calls = io_stats.seek_calls;
+		stats->bytes_discarded = io_stats.bytes_discarded;
+		stats->io_time_ns = io_stats.io_time;
+	} catch (const imagine::error::Exception &) {
+		return handle_exception(std::current_exception());
+	}
+	return IMAGINE_ERROR_SUCCESS;
+}
+
 void imagine_io_context_free(imagine_io_context *ptr)
 {
 	delete ptr;
 }
 
+imagine_allocator *imagine_allocator_from_callbacks(const imagine_allocator_callbacks *callbacks, void *user)
+{
+	im_assert_d(callbacks && callbacks->allocate && callbacks->deallocate, "null pointer");
+
+	imagine::AllocatorCallbacks allocator_callbacks;
+	allocator_callbacks.allocate = callbacks->allocate;
+	allocator_callbacks.deallocate = callbacks->deallocate;
+
+	try {
+		return new imagine::CallbackAllocator{ allocator_callbacks, user };
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+imagine_allocator *imagine_allocator_thread_arena(void)
+{
+	try {
+		return new imagine::ThreadArenaAllocator{};
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
+void imagine_allocator_free(imagine_allocator *ptr)
+{
+	delete ptr;
+}
+
+void imagine_set_allocator(imagine_allocator *ptr)
+{
+	imagine::Allocator::set_default(allocator_cast(ptr));
+}
+
 imagine_decoder_registry *imagine_decoder_registry_alloc(void)
 {
 	try {
@@ -432,6 +695,19 @@ imagine_decoder_registry *imagine_decoder_registry_alloc(void)
 	}
 }
 
+const imagine_decoder_registry *imagine_decoder_registry_get_default(void)
+{
+	try {
+		return &imagine::ImageDecoderRegistry::default_registry();
+	} catch (const imagine::error::Exception &) {
+		handle_exception(std::current_exception());
+		return nullptr;
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return nullptr;
+	}
+}
+
 void imagine_decoder_registry_free(imagine_decoder_registry *ptr)
 {
 	delete static_cast<imagine::ImageDecoderRegistry *>(ptr);
@@ -445,6 +721,12 @@ void imagine_decoder_registry_disable_provider(imagine_decoder_registry *ptr, co
 	registry_cast(ptr)->disable_provider(name);
 }
 
+void imagine_decoder_registry_set_allocator(imagine_decoder_registry *ptr, imagine_allocator *allocator)
+{
+	im_assert_d(ptr, "null pointer");
+	registry_cast(ptr)->set_allocator(allocator_cast(allocator));
+}
+
 imagine_decoder *imagine_decoder_registry_create_decoder(const imagine_decoder_registry *ptr, const char *path, const imagine_file_format *format, imagine_io_context *io)
 {
 	im_assert_d(ptr, "null pointer");
@@ -460,6 +742,128 @@ imagine_decoder *imagine_decoder_registry_create_decoder(const imagine_decoder_r
 	}
 }
 
+imagine_error_code_e imagine_probe(const imagine_decoder_registry *ptr, const char *path, imagine_io_context *io, imagine_file_format *format)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(io, "null pointer");
+	im_assert_d(format, "null pointer");
+
+	std::unique_ptr<imagine::IOContext> io_uptr{ assert_dynamic_type<imagine::IOContext>(io) };
+	imagine_file_format_clear(format);
+
+	try {
+		registry_cast(ptr)->probe_format(path, std::move(io_uptr), file_format_cast(format));
+		return IMAGINE_ERROR_SUCCESS;
+	} catch (...) {
+		return handle_exception(std::current_exception());
+	}
+}
+
+imagine_error_code_e imagine_probe_batch(const imagine_decoder_registry *ptr, size_t n, const char * const *paths, imagine_io_context * const *io, imagine_file_format * const *formats, imagine_error_code_e *errors, unsigned num_threads)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(paths || io, "null pointer");
+	im_assert_d(formats, "null pointer");
+	im_assert_d(errors, "null pointer");
+
+	if (!n)
+		return IMAGINE_ERROR_SUCCESS;
+
+	std::vector<std::unique_ptr<imagine::IOContext>> io_uptr;
+
+	try {
+		io_uptr.resize(n);
+	} catch (const std::bad_alloc &) {
+		for (size_t i = 0; io && i < n; ++i) {
+			delete io[i];
+		}
+		handle_bad_alloc();
+		return IMAGINE_ERROR_OUT_OF_MEMORY;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		im_assert_d((io && io[i]) || (paths && paths[i]), "null pointer");
+		if (io && io[i])
+			io_uptr[i].reset(assert_dynamic_type<imagine::IOContext>(io[i]));
+	}
+
+	try {
+		std::vector<imagine::FileFormat *> format_ptr(n);
+		std::vector<std::exception_ptr> eptr(n);
+
+		for (size_t i = 0; i < n; ++i) {
+			format_ptr[i] = file_format_cast(formats[i]);
+		}
+
+		registry_cast(ptr)->probe_format_batch(n, paths, io_uptr.data(), format_ptr.data(), eptr.data(), num_threads);
+
+		for (size_t i = 0; i < n; ++i) {
+			errors[i] = eptr[i] ? handle_exception(eptr[i]) : IMAGINE_ERROR_SUCCESS;
+		}
+		return IMAGINE_ERROR_SUCCESS;
+	} catch (const imagine::error::Exception &) {
+		return handle_exception(std::current_exception());
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return IMAGINE_ERROR_OUT_OF_MEMORY;
+	}
+}
+
+imagine_error_code_e imagine_decode_batch(const imagine_decoder_registry *ptr, size_t n, const char * const *paths, imagine_io_context * const *io, const imagine_output_buffer *buffers, imagine_error_code_e *errors, unsigned num_threads)
+{
+	static_assert(imagine::MAX_PLANE_COUNT == IMAGINE_MAX_PLANE_COUNT, "plane counts mismatch");
+
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(paths || io, "null pointer");
+	im_assert_d(buffers, "null pointer");
+	im_assert_d(errors, "null pointer");
+
+	if (!n)
+		return IMAGINE_ERROR_SUCCESS;
+
+	std::vector<std::unique_ptr<imagine::IOContext>> io_uptr;
+
+	try {
+		io_uptr.resize(n);
+	} catch (const std::bad_alloc &) {
+		for (size_t i = 0; io && i < n; ++i) {
+			delete io[i];
+		}
+		handle_bad_alloc();
+		return IMAGINE_ERROR_OUT_OF_MEMORY;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		im_assert_d((io && io[i]) || (paths && paths[i]), "null pointer");
+		if (io && io[i])
+			io_uptr[i].reset(assert_dynamic_type<imagine::IOContext>(io[i]));
+	}
+
+	try {
+		std::vector<imagine::OutputBuffer> buffer(n);
+		std::vector<std::exception_ptr> eptr(n);
+
+		for (size_t i = 0; i < n; ++i) {
+			for (unsigned p = 0; p < imagine::MAX_PLANE_COUNT; ++p) {
+				buffer[i].data[p] = buffers[i].data[p];
+				buffer[i].stride[p] = buffers[i].stride[p];
+			}
+		}
+
+		registry_cast(ptr)->decode_batch(n, paths, io_uptr.data(), buffer.data(), eptr.data(), num_threads);
+
+		for (size_t i = 0; i < n; ++i) {
+			errors[i] = eptr[i] ? handle_exception(eptr[i]) : IMAGINE_ERROR_SUCCESS;
+		}
+		return IMAGINE_ERROR_SUCCESS;
+	} catch (const imagine::error::Exception &) {
+		return handle_exception(std::current_exception());
+	} catch (const std::bad_alloc &) {
+		handle_bad_alloc();
+		return IMAGINE_ERROR_OUT_OF_MEMORY;
+	}
+}
+
 void imagine_decoder_free(imagine_decoder *ptr)
 {
 	delete ptr;
@@ -501,6 +905,37 @@ imagine_error_code_e imagine_decoder_next_frame_format(imagine_decoder *ptr, ima
 	EX_END
 }
 
+imagine_error_code_e imagine_decoder_file_format2(imagine_decoder *ptr, imagine_file_format_info *info)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(info, "null pointer");
+
+	EX_BEGIN
+	translate_file_format(assert_dynamic_type<imagine::ImageDecoder>(ptr)->file_format(), info);
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_next_frame_format2(imagine_decoder *ptr, imagine_file_format_info *info)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(info, "null pointer");
+
+	EX_BEGIN
+	translate_frame_format(assert_dynamic_type<imagine::ImageDecoder>(ptr)->next_frame_format(), info);
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_memory_estimate(imagine_decoder *ptr, size_t *bytes)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(bytes, "null pointer");
+
+	EX_BEGIN
+	*bytes = 0;
+	*bytes = assert_dynamic_type<imagine::ImageDecoder>(ptr)->scratch_bytes();
+	EX_END
+}
+
 imagine_error_code_e imagine_decoder_decode(imagine_decoder *ptr, const imagine_output_buffer *buf)
 {
 	static_assert(imagine::MAX_PLANE_COUNT == IMAGINE_MAX_PLANE_COUNT, "plane counts mismatch");
@@ -518,5 +953,108 @@ imagine_error_code_e imagine_decoder_decode(imagine_decoder *ptr, const imagine_
 	EX_END
 }
 
+imagine_error_code_e imagine_decoder_decode_region(imagine_decoder *ptr, const imagine_output_buffer *buf, const imagine_rect *rect)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(buf, "null pointer");
+	im_assert_d(rect, "null pointer");
+
+	EX_BEGIN
+	imagine::OutputBuffer buffer;
+	for (unsigned p = 0; p < imagine::MAX_PLANE_COUNT; ++p) {
+		buffer.data[p] = buf->data[p];
+		buffer.stride[p] = buf->stride[p];
+	}
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->decode_region(buffer, { rect->left, rect->top, rect->width, rect->height });
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_decode_async(imagine_decoder *ptr, const imagine_output_buffer *buf, imagine_decode_callback callback, void *user)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(buf, "null pointer");
+	im_assert_d(callback, "null pointer");
+
+	EX_BEGIN
+	imagine::OutputBuffer buffer;
+	for (unsigned p = 0; p < imagine::MAX_PLANE_COUNT; ++p) {
+		buffer.data[p] = buf->data[p];
+		buffer.stride[p] = buf->stride[p];
+	}
+
+	// The error state is thread-local, so it is recorded on the worker for
+	// retrieval from within the callback.
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->decode_async(buffer, [=](std::exception_ptr eptr)
+	{
+		imagine_error_code_e code = IMAGINE_ERROR_SUCCESS;
+
+		if (eptr)
+			code = handle_exception(eptr);
+		else
+			imagine_clear_last_error();
+
+		callback(user, code);
+	});
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_decode_rows(imagine_decoder *ptr, imagine_row_callback callback, void *user)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(callback, "null pointer");
+
+	EX_BEGIN
+	CallbackRowSink sink{ callback, user };
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->decode_rows(sink);
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_reset(imagine_decoder *ptr, imagine_io_context *io)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(io, "null pointer");
+
+	std::unique_ptr<imagine::IOContext> io_uptr{ assert_dynamic_type<imagine::IOContext>(io) };
+
+	EX_BEGIN
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->reset(std::move(io_uptr));
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_set_scale_denominator(imagine_decoder *ptr, unsigned denom)
+{
+	im_assert_d(ptr, "null pointer");
+
+	EX_BEGIN
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->set_scale_denominator(denom);
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_set_output_layout(imagine_decoder *ptr, const imagine_output_layout *layout)
+{
+	im_assert_d(ptr, "null pointer");
+	im_assert_d(layout, "null pointer");
+
+	EX_BEGIN
+	imagine::OutputLayout output_layout{ !!layout->interleaved, layout->order[0], layout->order[1], layout->order[2], layout->order[3] };
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->set_output_layout(output_layout);
+	EX_END
+}
+
+imagine_error_code_e imagine_decoder_set_sample_format(imagine_decoder *ptr, unsigned bit_depth, int floating_point)
+{
+	im_assert_d(ptr, "null pointer");
+
+	EX_BEGIN
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->set_sample_format({ bit_depth, !!floating_point });
+	EX_END
+}
+
 #undef EX_BEGIN
 #undef EX_END
+
+void imagine_decoder_set_allocator(imagine_decoder *ptr, imagine_allocator *allocator)
+{
+	im_assert_d(ptr, "null pointer");
+	assert_dynamic_type<imagine::ImageDecoder>(ptr)->set_allocator(allocator_cast(allocator));
+}
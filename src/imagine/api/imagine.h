@@ -63,6 +63,19 @@ typedef struct imagine_output_buffer {
 	ptrdiff_t stride[IMAGINE_MAX_PLANE_COUNT];
 } imagine_output_buffer;
 
+typedef struct imagine_rect {
+	unsigned left;
+	unsigned top;
+	unsigned width;
+	unsigned height;
+} imagine_rect;
+
+/* Interleaved output is written to buffer 0, with plane order[k] at position k. */
+typedef struct imagine_output_layout {
+	int interleaved;
+	unsigned char order[IMAGINE_MAX_PLANE_COUNT];
+} imagine_output_layout;
+
 
 typedef enum imagine_color_family_e {
 	IMAGINE_COLOR_FAMILY_UNKNOWN,
@@ -117,27 +130,111 @@ IMAGINE_FILE_FORMAT_GET_SET(unsigned, frame_count);
 
 int imagine_is_constant_format(const imagine_file_format *format);
 
+typedef struct imagine_plane_format_info {
+	unsigned width;
+	unsigned height;
+	unsigned bit_depth;
+	int is_floating_point;
+} imagine_plane_format_info;
+
+typedef struct imagine_file_format_info {
+	imagine_plane_format_info plane[IMAGINE_MAX_PLANE_COUNT];
+	unsigned plane_count;
+	imagine_color_family_e color_family;
+	imagine_image_type_e type;
+	unsigned frame_count;
+} imagine_file_format_info;
+
 
 typedef struct imagine_io_context imagine_io_context;
 
-imagine_io_context *imagine_io_context_from_file_ro(const char *path);
+typedef enum imagine_access_hint_e {
+	IMAGINE_ACCESS_NORMAL,
+	IMAGINE_ACCESS_SEQUENTIAL,
+	IMAGINE_ACCESS_WILLNEED,
+	IMAGINE_ACCESS_RANDOM,
+} imagine_access_hint_e;
+
+typedef struct imagine_file_options {
+	size_t buffer_size;
+	imagine_access_hint_e access_hint;
+	int direct;
+} imagine_file_options;
+
+void imagine_file_options_default(imagine_file_options *options);
+
+imagine_io_context *imagine_io_context_from_file_ro(const char *path, const imagine_file_options *options);
+
+imagine_io_context *imagine_io_context_from_file_mmap(const char *path);
+
+imagine_io_context *imagine_io_context_from_file_pread(const char *path);
 
 imagine_io_context *imagine_io_context_from_memory(const void *buf, size_t n, const char *path);
 
+typedef struct imagine_io_callbacks {
+	long long (*read)(void *user, void *buf, size_t count);
+	long long (*seek)(void *user, long long off, int whence);
+	long long (*tell)(void *user);
+	long long (*size)(void *user);
+	void (*close)(void *user);
+} imagine_io_callbacks;
+
+imagine_io_context *imagine_io_context_from_callbacks(const imagine_io_callbacks *callbacks, void *user, const char *path);
+
+imagine_io_context *imagine_io_context_readahead(imagine_io_context *io, size_t buffer_size);
+
+typedef struct imagine_io_stats {
+	unsigned long long read_calls;
+	unsigned long long bytes_read;
+	unsigned long long seek_calls;
+	unsigned long long bytes_discarded;
+	unsigned long long io_time_ns;
+} imagine_io_stats;
+
+imagine_io_context *imagine_io_context_stats(imagine_io_context *io);
+
+imagine_error_code_e imagine_io_context_get_stats(const imagine_io_context *io, imagine_io_stats *stats);
+
 void imagine_io_context_free(imagine_io_context *ptr);
 
 
+typedef struct imagine_allocator imagine_allocator;
+
+typedef struct imagine_allocator_callbacks {
+	void *(*allocate)(void *user, size_t size, size_t alignment);
+	void (*deallocate)(void *user, void *ptr, size_t size, size_t alignment);
+} imagine_allocator_callbacks;
+
+imagine_allocator *imagine_allocator_from_callbacks(const imagine_allocator_callbacks *callbacks, void *user);
+
+imagine_allocator *imagine_allocator_thread_arena(void);
+
+void imagine_allocator_free(imagine_allocator *ptr);
+
+void imagine_set_allocator(imagine_allocator *ptr);
+
+
 typedef struct imagine_decoder_registry imagine_decoder_registry;
 typedef struct imagine_decoder imagine_decoder;
 
 imagine_decoder_registry *imagine_decoder_registry_alloc(void);
 
+const imagine_decoder_registry *imagine_decoder_registry_get_default(void);
+
 void imagine_decoder_registry_free(imagine_decoder_registry *ptr);
 
 void imagine_decoder_registry_disable_provider(imagine_decoder_registry *ptr, const char *name);
 
+void imagine_decoder_registry_set_allocator(imagine_decoder_registry *ptr, imagine_allocator *allocator);
+
 imagine_decoder *imagine_decoder_registry_create_decoder(const imagine_decoder_registry *ptr, const char *path, const imagine_file_format *format, imagine_io_context *io);
 
+imagine_error_code_e imagine_probe(const imagine_decoder_registry *ptr, const char *path, imagine_io_context *io, imagine_file_format *format);
+
+imagine_error_code_e imagine_probe_batch(const imagine_decoder_registry *ptr, size_t n, const char * const *paths, imagine_io_context * const *io, imagine_file_format * const *formats, imagine_error_code_e *errors, unsigned num_threads);
+
+imagine_error_code_e imagine_decode_batch(const imagine_decoder_registry *ptr, size_t n, const char * const *paths, imagine_io_context * const *io, const imagine_output_buffer *buffers, imagine_error_code_e *errors, unsigned num_threads);
+
 
 void imagine_decoder_free(imagine_decoder *ptr);
 
@@ -147,8 +244,36 @@ imagine_error_code_e imagine_decoder_file_format(imagine_decoder *ptr, imagine_f
 
 imagine_error_code_e imagine_decoder_next_frame_format(imagine_decoder *ptr, imagine_file_format *format);
 
+imagine_error_code_e imagine_decoder_file_format2(imagine_decoder *ptr, imagine_file_format_info *info);
+
+imagine_error_code_e imagine_decoder_next_frame_format2(imagine_decoder *ptr, imagine_file_format_info *info);
+
+imagine_error_code_e imagine_decoder_memory_estimate(imagine_decoder *ptr, size_t *bytes);
+
 imagine_error_code_e imagine_decoder_decode(imagine_decoder *ptr, const imagine_output_buffer *buf);
 
+imagine_error_code_e imagine_decoder_decode_region(imagine_decoder *ptr, const imagine_output_buffer *buf, const imagine_rect *rect);
+
+typedef void (*imagine_decode_callback)(void *user, imagine_error_code_e code);
+
+imagine_error_code_e imagine_decoder_decode_async(imagine_decoder *ptr, const imagine_output_buffer *buf, imagine_decode_callback callback, void *user);
+
+/* Return non-zero to stop decoding. The rest of the frame is skipped and the call succeeds. */
+typedef int (*imagine_row_callback)(void *user, const imagine_output_buffer *buf, unsigned top, unsigned height);
+
+imagine_error_code_e imagine_decoder_decode_rows(imagine_decoder *ptr, imagine_row_callback callback, void *user);
+
+imagine_error_code_e imagine_decoder_reset(imagine_decoder *ptr, imagine_io_context *io);
+
+void imagine_decoder_set_allocator(imagine_decoder *ptr, imagine_allocator *allocator);
+
+imagine_error_code_e imagine_decoder_set_scale_denominator(imagine_decoder *ptr, unsigned denom);
+
+imagine_error_code_e imagine_decoder_set_output_layout(imagine_decoder *ptr, const imagine_output_layout *layout);
+
+/* A bit depth of 0 restores the samples of the file. */
+imagine_error_code_e imagine_decoder_set_sample_format(imagine_decoder *ptr, unsigned bit_depth, int floating_point);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,184 @@
+#ifdef _WIN32
+  #include <malloc.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include "allocator.h"
+#include "except.h"
+
+namespace imagine {
+namespace {
+
+// Blocks cached by the arena are sized in powers of two within these bounds.
+const unsigned ARENA_MIN_SHIFT = 12;
+const unsigned ARENA_MAX_SHIFT = 28;
+const size_t ARENA_ALIGNMENT = 64;
+
+// Upper bound on the memory held idle by the arena of each thread.
+const size_t ARENA_MAX_CACHED_BYTES = 64UL << 20;
+
+std::atomic<Allocator *> g_default_allocator{ nullptr };
+
+
+class SystemAllocator : public Allocator {
+public:
+	void *allocate(size_t size, size_t alignment) override
+	{
+		void *ptr;
+
+		alignment = std::max(alignment, sizeof(void *));
+		size = std::max(size, static_cast<size_t>(1));
+#ifdef _WIN32
+		ptr = _aligned_malloc(size, alignment);
+#else
+		if (posix_memalign(&ptr, alignment, size))
+			ptr = nullptr;
+#endif
+		if (!ptr)
+			throw error::OutOfMemory{};
+
+		return ptr;
+	}
+
+	void deallocate(void *ptr, size_t, size_t) noexcept override
+	{
+#ifdef _WIN32
+		_aligned_free(ptr);
+#else
+		free(ptr);
+#endif
+	}
+};
+
+unsigned arena_size_class(size_t size)
+{
+	unsigned shift = ARENA_MIN_SHIFT;
+
+	while (shift <= ARENA_MAX_SHIFT && (static_cast<size_t>(1) << shift) < size) {
+		++shift;
+	}
+	return shift;
+}
+
+bool is_arena_request(size_t size, size_t alignment)
+{
+	return alignment <= ARENA_ALIGNMENT && arena_size_class(size) <= ARENA_MAX_SHIFT;
+}
+
+struct ArenaCache {
+	std::vector<void *> blocks[ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1];
+	size_t cached_bytes;
+
+	ArenaCache() : cached_bytes{} {}
+
+	~ArenaCache();
+};
+
+// Set once the cache of a thread has been destroyed, after which thread_local
+// objects destroyed later fall back to the system allocator.
+thread_local bool t_arena_destroyed;
+thread_local ArenaCache t_arena;
+
+ArenaCache::~ArenaCache()
+{
+	for (std::vector<void *> &list : blocks) {
+		for (void *ptr : list) {
+			Allocator::system().deallocate(ptr, 0, ARENA_ALIGNMENT);
+		}
+	}
+	t_arena_destroyed = true;
+}
+
+} // namespace
+
+
+Allocator &Allocator::system()
+{
+	static SystemAllocator allocator;
+	return allocator;
+}
+
+Allocator *Allocator::get_default()
+{
+	Allocator *allocator = g_default_allocator.load(std::memory_order_acquire);
+	return allocator ? allocator : &system();
+}
+
+void Allocator::set_default(Allocator *allocator)
+{
+	g_default_allocator.store(allocator, std::memory_order_release);
+}
+
+Allocator::~Allocator() = default;
+
+
+void *ThreadArenaAllocator::allocate(size_t size, size_t alignment)
+{
+	if (t_arena_destroyed || !is_arena_request(size, alignment))
+		return system().allocate(size, alignment);
+
+	unsigned shift = arena_size_class(size);
+	std::vector<void *> &list = t_arena.blocks[shift - ARENA_MIN_SHIFT];
+
+	if (!list.empty()) {
+		void *ptr = list.back();
+		list.pop_back();
+		t_arena.cached_bytes -= static_cast<size_t>(1) << shift;
+		return ptr;
+	}
+
+	return system().allocate(static_cast<size_t>(1) << shift, ARENA_ALIGNMENT);
+}
+
+void ThreadArenaAllocator::deallocate(void *ptr, size_t size, size_t alignment) noexcept
+{
+	if (!ptr)
+		return;
+	if (t_arena_destroyed || !is_arena_request(size, alignment)) {
+		system().deallocate(ptr, size, alignment);
+		return;
+	}
+
+	unsigned shift = arena_size_class(size);
+	size_t block_size = static_cast<size_t>(1) << shift;
+
+	if (t_arena.cached_bytes + block_size > ARENA_MAX_CACHED_BYTES) {
+		system().deallocate(ptr, block_size, ARENA_ALIGNMENT);
+		return;
+	}
+
+	try {
+		t_arena.blocks[shift - ARENA_MIN_SHIFT].push_back(ptr);
+		t_arena.cached_bytes += block_size;
+	} catch (const std::bad_alloc &) {
+		system().deallocate(ptr, block_size, ARENA_ALIGNMENT);
+	}
+}
+
+
+CallbackAllocator::CallbackAllocator(const AllocatorCallbacks &callbacks, void *user) :
+	m_callbacks(callbacks),
+	m_user{ user }
+{
+}
+
+void *CallbackAllocator::allocate(size_t size, size_t alignment)
+{
+	void *ptr = m_callbacks.allocate(m_user, size, alignment);
+	if (!ptr)
+		throw error::OutOfMemory{};
+
+	return ptr;
+}
+
+void CallbackAllocator::deallocate(void *ptr, size_t size, size_t alignment) noexcept
+{
+	if (ptr)
+		m_callbacks.deallocate(m_user, ptr, size, alignment);
+}
+
+} // namespace imagine
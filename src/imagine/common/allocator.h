@@ -0,0 +1,129 @@
+#pragma once
+
+#ifndef IMAGINE_ALLOCATOR_H_
+#define IMAGINE_ALLOCATOR_H_
+
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+#include "align.h"
+
+struct imagine_allocator {
+	virtual ~imagine_allocator() = default;
+};
+
+namespace imagine {
+
+/**
+ * Source of scratch memory for decoders.
+ *
+ * Implementations must be safe to call from multiple threads. Failure to
+ * allocate is reported by throwing error::OutOfMemory.
+ */
+class Allocator : public imagine_allocator {
+public:
+	/**
+	 * Aligned allocator over the C runtime heap.
+	 */
+	static Allocator &system();
+
+	/**
+	 * Allocator used by decoders created afterwards. Returns the system
+	 * allocator unless overridden by set_default.
+	 */
+	static Allocator *get_default();
+
+	/**
+	 * Replace the default allocator, or restore the system allocator if null.
+	 * The allocator must outlive all decoders created with it.
+	 */
+	static void set_default(Allocator *allocator);
+
+	virtual ~Allocator() = 0;
+
+	virtual void *allocate(size_t size, size_t alignment) = 0;
+
+	virtual void deallocate(void *ptr, size_t size, size_t alignment) noexcept = 0;
+};
+
+/**
+ * Allocator that keeps freed blocks in a cache local to the calling thread,
+ * so that repeated decoding on a thread reuses the same memory. Blocks are
+ * interchangeable between all instances.
+ */
+class ThreadArenaAllocator : public Allocator {
+public:
+	void *allocate(size_t size, size_t alignment) override;
+
+	void deallocate(void *ptr, size_t size, size_t alignment) noexcept override;
+};
+
+/**
+ * User-supplied allocation functions. allocate returns null on failure.
+ */
+struct AllocatorCallbacks {
+	void *(*allocate)(void *user, size_t size, size_t alignment);
+	void (*deallocate)(void *user, void *ptr, size_t size, size_t alignment);
+};
+
+class CallbackAllocator : public Allocator {
+	AllocatorCallbacks m_callbacks;
+	void *m_user;
+public:
+	CallbackAllocator(const AllocatorCallbacks &callbacks, void *user);
+
+	void *allocate(size_t size, size_t alignment) override;
+
+	void deallocate(void *ptr, size_t size, size_t alignment) noexcept override;
+};
+
+/**
+ * Standard library allocator drawing from an Allocator. Memory is aligned
+ * for SIMD access.
+ */
+template <class T>
+class AllocatorAdapter {
+	template <class U>
+	friend class AllocatorAdapter;
+
+	Allocator *m_allocator;
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	AllocatorAdapter(Allocator *allocator) : m_allocator{ allocator }
+	{
+	}
+
+	template <class U>
+	AllocatorAdapter(const AllocatorAdapter<U> &other) : m_allocator{ other.m_allocator }
+	{
+	}
+
+	Allocator *allocator() const { return m_allocator; }
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(m_allocator->allocate(n * sizeof(T), ALIGNMENT));
+	}
+
+	void deallocate(T *ptr, size_t n) noexcept
+	{
+		m_allocator->deallocate(ptr, n * sizeof(T), ALIGNMENT);
+	}
+
+	template <class U>
+	bool operator==(const AllocatorAdapter<U> &other) const { return m_allocator == other.m_allocator; }
+
+	template <class U>
+	bool operator!=(const AllocatorAdapter<U> &other) const { return m_allocator != other.m_allocator; }
+};
+
+template <class T>
+using ScratchVector = std::vector<T, AllocatorAdapter<T>>;
+
+} // namespace imagine
+
+#endif // IMAGINE_ALLOCATOR_H_
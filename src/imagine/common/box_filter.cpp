@@ -0,0 +1,381 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "align.h"
+#include "box_filter.h"
+#include "except.h"
+
+namespace imagine {
+namespace {
+
+unsigned bytes_per_sample(const PlaneFormat &plane)
+{
+	return ceil_n(plane.bit_depth, 8) / 8;
+}
+
+size_t row_bytes(const PlaneFormat &plane)
+{
+	return ceil_n(static_cast<size_t>(plane.width) * bytes_per_sample(plane), ALIGNMENT);
+}
+
+size_t sum_count(const PlaneFormat &plane, unsigned factor)
+{
+	return (static_cast<size_t>(plane.width) + factor - 1) / factor;
+}
+
+bool needs_conversion(const FrameFormat &region, const SampleFormat &sample)
+{
+	if (!sample.bit_depth)
+		return false;
+
+	for (unsigned p = 0; p < region.plane_count; ++p) {
+		if (region.plane[p].bit_depth != sample.bit_depth || region.plane[p].floating_point != sample.floating_point)
+			return true;
+	}
+	return false;
+}
+
+uint8_t bswap(uint8_t x) { return x; }
+uint16_t bswap(uint16_t x) { return static_cast<uint16_t>((x >> 8) | (x << 8)); }
+uint32_t bswap(uint32_t x) { return (x >> 24) | ((x >> 8) & 0xFF00U) | ((x << 8) & 0xFF0000U) | (x << 24); }
+
+template <class T>
+void interleave(void *dst, const void *src, unsigned count, unsigned channels, const unsigned pos[], unsigned src_channels, bool swap)
+{
+	T *dst_p = static_cast<T *>(dst);
+	const T *src_p = static_cast<const T *>(src);
+
+	for (unsigned k = 0; k < count; ++k) {
+		for (unsigned c = 0; c < channels; ++c) {
+			T x = src_p[k * src_channels + pos[c]];
+			dst_p[k * channels + c] = swap ? bswap(x) : x;
+		}
+	}
+}
+
+// Copy samples of one plane to every step-th sample of an interleaved row.
+template <class T>
+void scatter(void *dst, const void *src, unsigned left, unsigned right, unsigned step)
+{
+	T *dst_p = static_cast<T *>(dst);
+	const T *src_p = static_cast<const T *>(src);
+
+	for (unsigned j = left; j < right; ++j) {
+		dst_p[j * step] = src_p[j];
+	}
+}
+
+template <class T>
+T round_sample(double x) { return static_cast<T>(x + 0.5); }
+
+template <>
+float round_sample<float>(double x) { return static_cast<float>(x); }
+
+template <class S, class D>
+void convert_samples(void *dst, unsigned dst_step, const void *src, unsigned src_step, unsigned count, double scale, bool swap)
+{
+	D *dst_p = static_cast<D *>(dst);
+	const S *src_p = static_cast<const S *>(src);
+
+	for (unsigned k = 0; k < count; ++k) {
+		S x = src_p[k * src_step];
+		dst_p[k * dst_step] = round_sample<D>((swap ? bswap(x) : x) * scale);
+	}
+}
+
+template <class S>
+void convert_samples(void *dst, unsigned dst_step, const void *src, unsigned src_step, unsigned count, const SampleFormat &sample, double scale, bool swap)
+{
+	if (sample.floating_point)
+		convert_samples<S, float>(dst, dst_step, src, src_step, count, scale, swap);
+	else if (sample.bit_depth > 8)
+		convert_samples<S, uint16_t>(dst, dst_step, src, src_step, count, scale, swap);
+	else
+		convert_samples<S, uint8_t>(dst, dst_step, src, src_step, count, scale, swap);
+}
+
+template <class T>
+void accumulate(uint32_t *sum, const void *src, unsigned left, unsigned right, unsigned factor)
+{
+	const T *src_p = static_cast<const T *>(src);
+
+	for (unsigned j = left, k = left / factor; j < right; ++k) {
+		unsigned end = std::min(j + factor, right);
+		uint32_t s = 0;
+
+		for (; j < end; ++j) {
+			s += src_p[j];
+		}
+		sum[k] += s;
+	}
+}
+
+template <class T>
+void average(void *dst, uint32_t *sum, unsigned left, unsigned right, unsigned width, unsigned rows, unsigned factor, unsigned step)
+{
+	T *dst_p = static_cast<T *>(dst);
+
+	for (unsigned k = left / factor; k < (right + factor - 1) / factor; ++k) {
+		uint32_t n = std::min(factor, width - k * factor) * rows;
+
+		dst_p[k * step] = static_cast<T>((sum[k] + n / 2) / n);
+		sum[k] = 0;
+	}
+}
+
+// Average and convert in one step, rounding only once.
+template <class T>
+void average_convert(void *dst, uint32_t *sum, unsigned left, unsigned right, unsigned width, unsigned rows, unsigned factor, unsigned step, double scale)
+{
+	T *dst_p = static_cast<T *>(dst);
+
+	for (unsigned k = left / factor; k < (right + factor - 1) / factor; ++k) {
+		uint32_t n = std::min(factor, width - k * factor) * rows;
+
+		dst_p[k * step] = round_sample<T>(sum[k] * (scale / n));
+		sum[k] = 0;
+	}
+}
+
+} // namespace
+
+
+void interleave_pixels(void *dst, const void *src, unsigned count, unsigned channels, const OutputLayout &layout,
+                       unsigned src_channels, const unsigned src_pos[], unsigned size, bool swap)
+{
+	unsigned pos[MAX_PLANE_COUNT];
+	bool identity = src_channels == channels && (!swap || size == 1);
+
+	for (unsigned c = 0; c < channels; ++c) {
+		pos[c] = src_pos[layout.order[c]];
+		identity = identity && pos[c] == c;
+	}
+
+	// Rows already in the requested order are copied whole.
+	if (identity) {
+		std::memcpy(dst, src, static_cast<size_t>(count) * channels * size);
+		return;
+	}
+
+	if (size == 1)
+		interleave<uint8_t>(dst, src, count, channels, pos, src_channels, swap);
+	else if (size == 2)
+		interleave<uint16_t>(dst, src, count, channels, pos, src_channels, swap);
+	else
+		interleave<uint32_t>(dst, src, count, channels, pos, src_channels, swap);
+}
+
+
+BoxFilter::BoxFilter(Allocator *allocator) :
+	m_rows(allocator),
+	m_sums(allocator),
+	m_row_offset{},
+	m_sum_offset{},
+	m_count{},
+	m_position{},
+	m_scale{},
+	m_channels{ 1 },
+	m_factor{ 1 },
+	m_convert{}
+{
+}
+
+unsigned BoxFilter::output_size(unsigned p) const
+{
+	if (!m_convert)
+		return bytes_per_sample(m_region.plane[p]);
+
+	return m_sample.floating_point ? sizeof(float) : ceil_n(m_sample.bit_depth, 8) / 8;
+}
+
+void *BoxFilter::output_row(unsigned p, unsigned i) const
+{
+	if (!m_layout.interleaved)
+		return static_cast<uint8_t *>(m_buffer.data[p]) + static_cast<ptrdiff_t>(i) * m_buffer.stride[p];
+
+	uint8_t *row = static_cast<uint8_t *>(m_buffer.data[0]) + static_cast<ptrdiff_t>(i) * m_buffer.stride[0];
+	return row + m_position[p] * output_size(p);
+}
+
+void BoxFilter::convert(unsigned p, void *dst, unsigned dst_step, const void *src, unsigned src_step, unsigned count, bool swap) const
+{
+	if (bytes_per_sample(m_region.plane[p]) == 2)
+		convert_samples<uint16_t>(dst, dst_step, src, src_step, count, m_sample, m_scale[p], swap);
+	else
+		convert_samples<uint8_t>(dst, dst_step, src, src_step, count, m_sample, m_scale[p], swap);
+}
+
+size_t BoxFilter::scratch_bytes(const FrameFormat &region, unsigned factor, const OutputLayout &layout, const SampleFormat &sample)
+{
+	if (factor == 1 && !layout.interleaved && !needs_conversion(region, sample))
+		return 0;
+
+	size_t bytes = 0;
+
+	for (unsigned p = 0; p < region.plane_count; ++p) {
+		bytes += row_bytes(region.plane[p]);
+
+		if (factor > 1)
+			bytes += sum_count(region.plane[p], factor) * sizeof(uint32_t);
+	}
+	return bytes;
+}
+
+void BoxFilter::reset(const OutputBuffer &buffer, const FrameFormat &region, unsigned factor, const OutputLayout &layout, const SampleFormat &sample) try
+{
+	m_buffer = buffer;
+	m_region = region;
+	m_layout = layout;
+	m_sample = sample;
+	m_channels = layout.interleaved ? region.plane_count : 1;
+	m_factor = factor;
+	m_convert = needs_conversion(region, sample);
+
+	for (unsigned k = 0; k < region.plane_count; ++k) {
+		m_position[layout.order[k]] = k;
+	}
+
+	if (is_direct())
+		return;
+
+	size_t row_size = 0;
+	size_t sum_size = 0;
+
+	for (unsigned p = 0; p < region.plane_count; ++p) {
+		if (factor > 1 && (region.plane[p].floating_point || region.plane[p].bit_depth > 16))
+			throw error::UnsupportedOperation{ "scaling not supported for sample type" };
+		if (m_convert && (region.plane[p].floating_point || region.plane[p].bit_depth > 16))
+			throw error::UnsupportedOperation{ "conversion not supported for sample type" };
+
+		// Integers are rescaled from the full range of the source.
+		double out_max = sample.floating_point ? 1.0 : std::ldexp(1.0, sample.bit_depth) - 1.0;
+		m_scale[p] = m_convert ? out_max / (std::ldexp(1.0, region.plane[p].bit_depth) - 1.0) : 1.0;
+
+		m_row_offset[p] = row_size;
+		m_sum_offset[p] = sum_size;
+		m_count[p] = 0;
+
+		row_size += row_bytes(region.plane[p]);
+		if (factor > 1)
+			sum_size += sum_count(region.plane[p], factor);
+	}
+
+	m_rows.resize(row_size);
+	m_sums.assign(sum_size, 0);
+} catch (const std::bad_alloc &) {
+	throw error::OutOfMemory{};
+}
+
+void BoxFilter::set_allocator(Allocator *allocator)
+{
+	m_rows = ScratchVector<uint8_t>(allocator);
+	m_sums = ScratchVector<uint32_t>(allocator);
+}
+
+void *BoxFilter::row(unsigned p, unsigned i)
+{
+	if (is_direct())
+		return output_row(p, i);
+
+	return m_rows.data() + m_row_offset[p];
+}
+
+void BoxFilter::commit(unsigned p, unsigned i, unsigned left, unsigned right)
+{
+	if (is_direct())
+		return;
+
+	commit(p, i, left, right, row(p, i));
+}
+
+void BoxFilter::commit(unsigned p, unsigned i, unsigned left, unsigned right, const void *src)
+{
+	const PlaneFormat &plane = m_region.plane[p];
+	unsigned size = bytes_per_sample(plane);
+
+	if (is_direct()) {
+		uint8_t *dst = static_cast<uint8_t *>(output_row(p, i));
+
+		if (src != dst)
+			std::memcpy(dst + static_cast<size_t>(left) * size, static_cast<const uint8_t *>(src) + static_cast<size_t>(left) * size, static_cast<size_t>(right - left) * size);
+		return;
+	}
+
+	if (m_factor == 1) {
+		void *dst = output_row(p, i);
+
+		if (m_convert)
+			convert(p, static_cast<uint8_t *>(dst) + static_cast<size_t>(left) * m_channels * output_size(p), m_channels,
+			        static_cast<const uint8_t *>(src) + static_cast<size_t>(left) * size, 1, right - left, false);
+		else if (size == 1)
+			scatter<uint8_t>(dst, src, left, right, m_channels);
+		else if (size == 2)
+			scatter<uint16_t>(dst, src, left, right, m_channels);
+		else
+			scatter<uint32_t>(dst, src, left, right, m_channels);
+		return;
+	}
+
+	uint32_t *sum = m_sums.data() + m_sum_offset[p];
+	bool high_depth = size == 2;
+
+	if (high_depth)
+		accumulate<uint16_t>(sum, src, left, right, m_factor);
+	else
+		accumulate<uint8_t>(sum, src, left, right, m_factor);
+
+	unsigned group = i / m_factor;
+	unsigned rows = std::min(m_factor, plane.height - group * m_factor);
+
+	if (++m_count[p] < rows)
+		return;
+
+	void *dst = output_row(p, group);
+
+	if (!m_convert && high_depth)
+		average<uint16_t>(dst, sum, left, right, plane.width, rows, m_factor, m_channels);
+	else if (!m_convert)
+		average<uint8_t>(dst, sum, left, right, plane.width, rows, m_factor, m_channels);
+	else if (m_sample.floating_point)
+		average_convert<float>(dst, sum, left, right, plane.width, rows, m_factor, m_channels, m_scale[p]);
+	else if (m_sample.bit_depth > 8)
+		average_convert<uint16_t>(dst, sum, left, right, plane.width, rows, m_factor, m_channels, m_scale[p]);
+	else
+		average_convert<uint8_t>(dst, sum, left, right, plane.width, rows, m_factor, m_channels, m_scale[p]);
+
+	m_count[p] = 0;
+}
+
+void *BoxFilter::packed_row(unsigned i) const
+{
+	if (!packed() || m_convert)
+		return nullptr;
+
+	return static_cast<uint8_t *>(m_buffer.data[0]) + static_cast<ptrdiff_t>(i) * m_buffer.stride[0];
+}
+
+bool BoxFilter::pack(unsigned i, unsigned left, unsigned right, const void *src, unsigned src_channels, const unsigned src_pos[], bool swap)
+{
+	if (!packed())
+		return false;
+
+	uint8_t *dst = static_cast<uint8_t *>(m_buffer.data[0]) + static_cast<ptrdiff_t>(i) * m_buffer.stride[0];
+	unsigned size = bytes_per_sample(m_region.plane[0]);
+
+	if (!m_convert) {
+		interleave_pixels(dst + static_cast<size_t>(left) * m_channels * size, src, right - left, m_channels, m_layout, src_channels, src_pos, size, swap);
+		return true;
+	}
+
+	// Each plane is converted straight from the packed source.
+	for (unsigned p = 0; p < m_region.plane_count; ++p) {
+		void *dst_p = dst + (static_cast<size_t>(left) * m_channels + m_position[p]) * output_size(p);
+		const void *src_p = static_cast<const uint8_t *>(src) + src_pos[p] * size;
+
+		convert(p, dst_p, m_channels, src_p, src_channels, right - left, swap);
+	}
+	return true;
+}
+
+} // namespace imagine
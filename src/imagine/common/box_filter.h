@@ -0,0 +1,134 @@
+#pragma once
+
+#ifndef IMAGINE_BOX_FILTER_H_
+#define IMAGINE_BOX_FILTER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "allocator.h"
+#include "buffer.h"
+#include "format.h"
+
+namespace imagine {
+
+/**
+ * Write pixels to an interleaved row in the order of layout, taking plane p
+ * from sample src_pos[p] of each source pixel. Samples are size bytes and
+ * are byte-swapped if swap is set.
+ */
+void interleave_pixels(void *dst, const void *src, unsigned count, unsigned channels, const OutputLayout &layout,
+                       unsigned src_channels, const unsigned src_pos[], unsigned size, bool swap = false);
+
+/**
+ * Writes planar rows to the output buffer as they are unpacked, reducing
+ * them by an integer factor with a box filter, interleaving the planes as
+ * the layout requires and converting samples to the output sample format,
+ * so that a full-size native frame is never stored. Decoders unpack each
+ * source row into the pointer returned by row and then commit it. With a
+ * factor of 1, planar output and native samples, rows are unpacked directly
+ * into the output buffer.
+ *
+ * Rows and columns are numbered from the top-left corner of the source
+ * region, which must be aligned to the factor. The rows of a group reduced
+ * to one output row may be committed in any order, but must be committed
+ * before those of the next group in the same plane and columns.
+ */
+class BoxFilter {
+	ScratchVector<uint8_t> m_rows;
+	ScratchVector<uint32_t> m_sums;
+	OutputBuffer m_buffer;
+	FrameFormat m_region;
+	OutputLayout m_layout;
+	SampleFormat m_sample;
+	size_t m_row_offset[MAX_PLANE_COUNT];
+	size_t m_sum_offset[MAX_PLANE_COUNT];
+	unsigned m_count[MAX_PLANE_COUNT];
+	unsigned m_position[MAX_PLANE_COUNT];
+	double m_scale[MAX_PLANE_COUNT];
+	unsigned m_channels;
+	unsigned m_factor;
+	bool m_convert;
+
+	bool is_direct() const { return m_factor == 1 && !m_layout.interleaved && !m_convert; }
+
+	unsigned output_size(unsigned p) const;
+
+	void *output_row(unsigned p, unsigned i) const;
+
+	// Convert count samples of plane p, src_step samples apart, to every
+	// dst_step-th sample of dst.
+	void convert(unsigned p, void *dst, unsigned dst_step, const void *src, unsigned src_step, unsigned count, bool swap) const;
+public:
+	explicit BoxFilter(Allocator *allocator);
+
+	/**
+	 * Scratch memory needed to reduce a source region.
+	 */
+	static size_t scratch_bytes(const FrameFormat &region, unsigned factor, const OutputLayout &layout = OutputLayout{},
+	                            const SampleFormat &sample = SampleFormat{});
+
+	/**
+	 * Start reducing a source region into buffer. Samples of up to 8 bits
+	 * occupy one byte, those of up to 16 bits two and those of up to 32 bits
+	 * four. Only integer samples of up to 16 bits can be reduced or
+	 * converted.
+	 */
+	void reset(const OutputBuffer &buffer, const FrameFormat &region, unsigned factor, const OutputLayout &layout = OutputLayout{},
+	           const SampleFormat &sample = SampleFormat{});
+
+	/**
+	 * Replace the allocator, releasing the scratch buffers.
+	 */
+	void set_allocator(Allocator *allocator);
+
+	unsigned factor() const { return m_factor; }
+
+	/**
+	 * Whether rows may be written straight to interleaved output with
+	 * packed_row or pack.
+	 */
+	bool packed() const { return m_factor == 1 && m_layout.interleaved; }
+
+	/**
+	 * Destination for column 0 of source row i in plane p.
+	 */
+	void *row(unsigned p, unsigned i);
+
+	/**
+	 * Accumulate columns [left, right) of source row i in plane p. The output
+	 * row is written once every row of its group has been committed.
+	 */
+	void commit(unsigned p, unsigned i, unsigned left, unsigned right);
+
+	void commit(unsigned p, unsigned i) { commit(p, i, 0, m_region.plane[p].width); }
+
+	/**
+	 * Commit columns [left, right) of source row i in plane p from src,
+	 * pointing to column 0, instead of the row returned by row.
+	 */
+	void commit(unsigned p, unsigned i, unsigned left, unsigned right, const void *src);
+
+	/**
+	 * Whether samples are converted on output.
+	 */
+	bool converting() const { return m_convert; }
+
+	/**
+	 * Interleaved output row for source row i, or null if the output is
+	 * planar, reduced or converted.
+	 */
+	void *packed_row(unsigned i) const;
+
+	/**
+	 * Write columns [left, right) of source row i straight to interleaved
+	 * output, converting the samples if required, given src pointing to the
+	 * pixel at column left. Source pixels have src_channels samples, with
+	 * plane p at sample src_pos[p]. Returns false unless packed, in which
+	 * case the row must be unpacked and committed instead.
+	 */
+	bool pack(unsigned i, unsigned left, unsigned right, const void *src, unsigned src_channels, const unsigned src_pos[], bool swap = false);
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_BOX_FILTER_H_
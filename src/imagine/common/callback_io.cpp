@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include "except.h"
+#include "callback_io.h"
+
+namespace imagine {
+namespace {
+
+// Largest transfer requested in a single callback.
+const size_t MAX_IO_SIZE = 1UL << 30;
+
+} // namespace
+
+
+CallbackIOContext::CallbackIOContext(const IOCallbacks &callbacks, void *user, const std::string &path) :
+	m_callbacks(callbacks),
+	m_user{ user },
+	m_path{ path },
+	m_offset{},
+	m_eof{}
+{
+}
+
+CallbackIOContext::~CallbackIOContext()
+{
+	if (m_callbacks.close)
+		m_callbacks.close(m_user);
+}
+
+void CallbackIOContext::check_seekable() const
+{
+	if (!m_callbacks.seek) {
+		errno = 0;
+		throw error::SeekFailed{ "file not seekable", path() };
+	}
+}
+
+auto CallbackIOContext::do_seek(difference_type off, int whence, const char *msg) -> difference_type
+{
+	check_seekable();
+
+	errno = 0;
+	difference_type pos = m_callbacks.seek(m_user, off, whence);
+	if (pos < 0)
+		throw error::SeekFailed{ msg, path(), off };
+
+	m_offset = pos;
+	m_eof = false;
+	return m_offset;
+}
+
+bool CallbackIOContext::eof()
+{
+	return m_eof;
+}
+
+bool CallbackIOContext::seekable()
+{
+	return !!m_callbacks.seek;
+}
+
+const char *CallbackIOContext::path() const
+{
+	return m_path.c_str();
+}
+
+auto CallbackIOContext::tell() -> difference_type
+{
+	if (!m_callbacks.tell)
+		return m_offset;
+
+	errno = 0;
+	difference_type pos = m_callbacks.tell(m_user);
+	if (pos < 0)
+		throw error::SeekFailed{ "error getting file position", path() };
+	return pos;
+}
+
+auto CallbackIOContext::size() -> size_type
+{
+	if (!m_callbacks.size) {
+		errno = 0;
+		throw error::SeekFailed{ "file size not known", path() };
+	}
+
+	errno = 0;
+	difference_type size = m_callbacks.size(m_user);
+	if (size < 0)
+		throw error::SeekFailed{ "unable to determine file size", path() };
+	return size;
+}
+
+auto CallbackIOContext::seek_set(difference_type off) -> difference_type
+{
+	return do_seek(off, SEEK_SET, "error seeking (from begin)");
+}
+
+auto CallbackIOContext::seek_end(difference_type off) -> difference_type
+{
+	return do_seek(off, SEEK_END, "error seeking (from end)");
+}
+
+auto CallbackIOContext::seek_rel(difference_type off) -> difference_type
+{
+	return do_seek(off, SEEK_CUR, "error seeking");
+}
+
+auto CallbackIOContext::read(void *buf, size_type count) -> size_type
+{
+	char *buf_p = static_cast<char *>(buf);
+	size_type n = 0;
+
+	while (n < count) {
+		size_t c = static_cast<size_t>(std::min(count - n, static_cast<size_type>(MAX_IO_SIZE)));
+
+		errno = 0;
+		long long ret = m_callbacks.read(m_user, buf_p + n, c);
+		if (ret < 0)
+			throw error::ReadFailed{ "error reading", path(), m_offset, count - n };
+		if (ret == 0) {
+			m_eof = true;
+			break;
+		}
+
+		n += ret;
+		m_offset += ret;
+	}
+	return n;
+}
+
+auto CallbackIOContext::write(const void *, size_type count) -> size_type
+{
+	errno = 0;
+	throw error::WriteFailed{ "file not writable", path(), m_offset, count };
+}
+
+void CallbackIOContext::flush()
+{
+}
+
+} // namespace imagine
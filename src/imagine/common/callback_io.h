@@ -0,0 +1,68 @@
+#pragma once
+
+#ifndef IMAGINE_CALLBACK_IO_H_
+#define IMAGINE_CALLBACK_IO_H_
+
+#include <cstddef>
+#include <string>
+#include "io_context.h"
+
+namespace imagine {
+
+/**
+ * User-supplied I/O functions. Only read is mandatory.
+ *
+ * Functions returning a count or position report failure with a negative
+ * value. Seek origins are as in stdio.
+ */
+struct IOCallbacks {
+	long long (*read)(void *user, void *buf, size_t count);
+	long long (*seek)(void *user, long long off, int whence);
+	long long (*tell)(void *user);
+	long long (*size)(void *user);
+	void (*close)(void *user);
+};
+
+/**
+ * Read-only context over application-defined storage.
+ */
+class CallbackIOContext : public IOContext {
+	IOCallbacks m_callbacks;
+	void *m_user;
+	std::string m_path;
+	difference_type m_offset;
+	bool m_eof;
+
+	void check_seekable() const;
+	difference_type do_seek(difference_type off, int whence, const char *msg);
+public:
+	CallbackIOContext(const IOCallbacks &callbacks, void *user, const std::string &path);
+
+	~CallbackIOContext();
+
+	bool eof() override;
+
+	bool seekable() override;
+
+	const char *path() const override;
+
+	difference_type tell() override;
+
+	size_type size() override;
+
+	difference_type seek_set(difference_type off) override;
+
+	difference_type seek_end(difference_type off) override;
+
+	difference_type seek_rel(difference_type off) override;
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type write(const void *buf, size_type count) override;
+
+	void flush() override;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_CALLBACK_IO_H_
@@ -1,20 +1,270 @@
+#include <algorithm>
 #include <cstring>
 #include <utility>
+#include <vector>
 #include "provider/bmp_decoder.h"
 #include "provider/jpeg_decoder.h"
 #include "provider/png_decoder.h"
 #include "provider/tiff_decoder.h"
+#include "align.h"
+#include "allocator.h"
+#include "buffer.h"
 #include "decoder.h"
 #include "except.h"
+#include "file_io.h"
 #include "io_context.h"
+#include "lookahead_io.h"
 #include "im_assert.h"
+#include "strip_buffer.h"
+#include "thread_pool.h"
 
 namespace imagine {
+namespace {
+
+// Enough to hold the signature of every supported format.
+const size_t PROBE_SIZE = 64;
+
+// Probing is bound by I/O latency rather than CPU, so oversubscribe the cores.
+const unsigned BATCH_PROBE_THREADS = 16;
+
+// Batch items at least this large are split into bands of rows decoded in parallel.
+const IOContext::size_type BATCH_SPLIT_BYTES = 16ULL << 20;
+const unsigned BATCH_BAND_ROWS = 512;
+
+// Unit of work in a batch decode: a band of rows, or the whole frame if height is 0.
+struct BatchJob {
+	size_t item;
+	unsigned top;
+	unsigned height;
+	IOContext::size_type cost;
+};
+
+// Whether the frame can be decoded in bands of rows by independent decoders.
+bool is_band_splittable(const FileFormat &format)
+{
+	if (format.type != ImageType::TIFF && format.type != ImageType::BMP)
+		return false;
+	if (!is_constant_format(format) || format.plane[0].height <= BATCH_BAND_ROWS)
+		return false;
+
+	// Planes must share rows, so that a band maps to the same rows in each.
+	for (unsigned p = 1; p < format.plane_count; ++p) {
+		if (format.plane[p].height != format.plane[0].height)
+			return false;
+	}
+	return true;
+}
+
+// Record the start of non-seekable streams, so that each factory can sniff the content.
+void make_rewindable(std::unique_ptr<IOContext> &io)
+{
+	if (io->rewindable())
+		return;
+
+	try {
+		io = std::unique_ptr<IOContext>{ new LookaheadIOContext{ std::move(io) } };
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+}
+
+// Call func on each factory accepting the header until it returns true.
+// Factories claiming the file extension are tried first.
+template <class Registry, class Func>
+bool for_each_candidate(const Registry &registry, const char *path, IOContext *io, Func func)
+{
+	// Read the header once and let each factory inspect it without further I/O.
+	unsigned char header[PROBE_SIZE];
+	IOContext::difference_type pos = io->tell();
+	size_t header_size = static_cast<size_t>(io->read(header, sizeof(header)));
+	io->seek_set(pos);
+
+	for (int pass = 0; pass < 2; ++pass) {
+		for (const auto &factory : registry) {
+			ImageDecoderFactory *f = factory.second.get();
+
+			if (f->matches_extension(path) != (pass == 0))
+				continue;
+			if (!f->probe(header, header_size))
+				continue;
+			if (func(f))
+				return true;
+		}
+	}
+	return false;
+}
+
+} // namespace
+
+
+ImageDecoder::ImageDecoder() : m_allocator{ Allocator::get_default() }, m_scale_denom{ 1 }
+{
+}
 
 ImageDecoder::~ImageDecoder() = default;
 
+void ImageDecoder::check_region(const FrameFormat &format, const ImageRect &rect, unsigned sw, unsigned sh)
+{
+	if (!is_rect_in_frame(format, rect))
+		throw error::IllegalArgument{ "region outside of frame" };
+	if (rect.left % sw || rect.top % sh)
+		throw error::IllegalArgument{ "region not aligned to chroma subsampling" };
+}
+
+void ImageDecoder::check_layout(const FrameFormat &format) const
+{
+	if (!m_layout.interleaved)
+		return;
+
+	bool used[MAX_PLANE_COUNT] = {};
+
+	for (unsigned k = 0; k < format.plane_count; ++k) {
+		unsigned p = m_layout.order[k];
+
+		if (p >= format.plane_count || used[p])
+			throw error::IllegalArgument{ "output order is not a permutation of the planes" };
+		used[p] = true;
+	}
+
+	for (unsigned p = 0; p < format.plane_count; ++p) {
+		const PlaneFormat &plane = format.plane[p];
+		unsigned bytes = ceil_n(plane.bit_depth, 8) / 8;
+
+		if (bytes != 1 && bytes != 2 && bytes != 4)
+			throw error::UnsupportedOperation{ "interleaved output not supported for sample type" };
+		if (plane.width != format.plane[0].width || plane.height != format.plane[0].height ||
+		    bytes != ceil_n(format.plane[0].bit_depth, 8) / 8 || plane.floating_point != format.plane[0].floating_point)
+			throw error::UnsupportedOperation{ "interleaved output requires planes of equal size" };
+	}
+}
+
+void ImageDecoder::decode_region(const OutputBuffer &, const ImageRect &)
+{
+	throw error::UnsupportedOperation{ "region decoding not supported by provider" };
+}
+
+size_t ImageDecoder::scratch_bytes()
+{
+	throw error::UnsupportedOperation{ "memory estimate not supported by provider" };
+}
+
+void ImageDecoder::reset(std::unique_ptr<IOContext>)
+{
+	throw error::UnsupportedOperation{ "reset not supported by provider" };
+}
+
+void ImageDecoder::set_allocator(Allocator *allocator)
+{
+	m_allocator = allocator ? allocator : Allocator::get_default();
+}
+
+void ImageDecoder::set_scale_denominator(unsigned denom)
+{
+	if (denom != 1 && denom != 2 && denom != 4 && denom != 8)
+		throw error::IllegalArgument{ "scale denominator must be 1, 2, 4 or 8" };
+
+	m_scale_denom = denom;
+}
+
+void ImageDecoder::set_output_layout(const OutputLayout &layout)
+{
+	m_layout = layout;
+}
+
+void ImageDecoder::set_sample_format(const SampleFormat &sample)
+{
+	if (sample.floating_point ? sample.bit_depth != 32 : sample.bit_depth > 16)
+		throw error::IllegalArgument{ "output samples must be integers of up to 16 bits or 32-bit floating point" };
+
+	m_sample = sample;
+}
+
+void ImageDecoder::decode_async(const OutputBuffer &buffer, std::function<void(std::exception_ptr)> callback) try
+{
+	ThreadPool::default_pool().submit([this, buffer, callback = std::move(callback)]()
+	{
+		std::exception_ptr eptr;
+
+		try {
+			decode(buffer);
+		} catch (...) {
+			eptr = std::current_exception();
+		}
+		callback(eptr);
+	});
+} catch (const std::bad_alloc &) {
+	throw error::OutOfMemory{};
+}
+
+std::future<void> ImageDecoder::decode_async(const OutputBuffer &buffer) try
+{
+	auto promise = std::make_shared<std::promise<void>>();
+	std::future<void> future = promise->get_future();
+
+	decode_async(buffer, [promise](std::exception_ptr eptr)
+	{
+		if (eptr)
+			promise->set_exception(eptr);
+		else
+			promise->set_value();
+	});
+	return future;
+} catch (const std::bad_alloc &) {
+	throw error::OutOfMemory{};
+}
+
+void ImageDecoder::decode_rows(RowSink &sink)
+{
+	FrameFormat format = next_frame_format();
+	if (!is_constant_format(format))
+		return;
+
+	check_layout(format);
+
+	StripBuffer strip{ m_allocator };
+	strip.reset(format, format.plane[0].height, m_layout);
+	decode(strip.buffer());
+	strip.flush(sink, 0, format.plane[0].height);
+}
+
 ImageDecoderFactory::~ImageDecoderFactory() = default;
 
+ImageType ImageDecoderFactory::type() const
+{
+	return ImageType::UNKNOWN;
+}
+
+bool ImageDecoderFactory::probe(const void *, size_t) const
+{
+	return true;
+}
+
+bool ImageDecoderFactory::matches_extension(const char *) const
+{
+	return false;
+}
+
+bool ImageDecoderFactory::probe_format(IOContext *, FileFormat *) const
+{
+	return false;
+}
+
+std::unique_ptr<ImageDecoder> ImageDecoderFactory::create_decoder_in(const ImageDecoderRegistry &, const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io)
+{
+	return create_decoder(path, format, std::move(io));
+}
+
+const ImageDecoderRegistry &ImageDecoderRegistry::default_registry()
+{
+	static const ImageDecoderRegistry registry = []()
+	{
+		ImageDecoderRegistry registry;
+		registry.register_default_providers();
+		return registry;
+	}();
+	return registry;
+}
+
 void ImageDecoderRegistry::register_default_providers() try
 {
 #ifdef IMAGINE_JPEG_ENABLED
@@ -48,19 +298,220 @@ void ImageDecoderRegistry::disable_provider(const char *name)
 	}
 }
 
+void ImageDecoderRegistry::set_allocator(Allocator *allocator)
+{
+	m_allocator = allocator;
+}
+
 std::unique_ptr<ImageDecoder> ImageDecoderRegistry::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> io) const
 {
+	make_rewindable(io);
 	IOContext::difference_type pos = io->tell();
-	for (const auto &factory : m_registry) {
-		std::unique_ptr<ImageDecoder> provider = factory.second->create_decoder(path, format, std::move(io));
+
+	if (format) {
+		for (const auto &factory : m_registry) {
+			std::unique_ptr<ImageDecoder> provider = factory.second->create_decoder_in(*this, path, format, std::move(io));
+			if (provider) {
+				if (m_allocator)
+					provider->set_allocator(m_allocator);
+				return provider;
+			}
+
+			im_assert_d(io, "factory must not move IOContext");
+			io->seek_set(pos);
+		}
+		return nullptr;
+	}
+
+	std::unique_ptr<ImageDecoder> provider;
+
+	for_each_candidate(m_registry, path, io.get(), [&](ImageDecoderFactory *f)
+	{
+		ImageType type = f->type();
+		FileFormat probed_format{ type };
+
+		provider = f->create_decoder_in(*this, path, type == ImageType::UNKNOWN ? nullptr : &probed_format, std::move(io));
 		if (provider)
-			return provider;
+			return true;
 
 		im_assert_d(io, "factory must not move IOContext");
-		if (io->seekable())
-			io->seek_set(pos);
+		io->seek_set(pos);
+		return false;
+	});
+
+	if (provider && m_allocator)
+		provider->set_allocator(m_allocator);
+	return provider;
+}
+
+bool ImageDecoderRegistry::probe_format(const char *path, std::unique_ptr<IOContext> io, FileFormat *format) const
+{
+	make_rewindable(io);
+	IOContext::difference_type pos = io->tell();
+
+	return for_each_candidate(m_registry, path, io.get(), [&](ImageDecoderFactory *f)
+	{
+		if (f->probe_format(io.get(), format))
+			return true;
+
+		// Fall back to querying a decoder.
+		io->seek_set(pos);
+
+		ImageType type = f->type();
+		FileFormat probed_format{ type };
+		std::unique_ptr<ImageDecoder> decoder = f->create_decoder_in(*this, path, type == ImageType::UNKNOWN ? nullptr : &probed_format, std::move(io));
+		if (decoder) {
+			*format = decoder->file_format();
+			return true;
+		}
+
+		im_assert_d(io, "factory must not move IOContext");
+		io->seek_set(pos);
+		return false;
+	});
+}
+
+void ImageDecoderRegistry::probe_format_batch(size_t n, const char * const *paths, std::unique_ptr<IOContext> *io, FileFormat * const *formats, std::exception_ptr *errors, unsigned num_threads) const
+{
+	if (!n)
+		return;
+	if (!num_threads)
+		num_threads = BATCH_PROBE_THREADS;
+
+	ThreadPool pool{ static_cast<unsigned>(std::min(static_cast<size_t>(num_threads), n)) };
+
+	pool.parallel_for(n, [&](size_t i)
+	{
+		const char *path = paths ? paths[i] : nullptr;
+
+		try {
+			std::unique_ptr<IOContext> item_io = io && io[i] ? std::move(io[i]) : nullptr;
+			if (!item_io)
+				item_io.reset(new FileIOContext{ path, FileIOContext::read_tag });
+
+			*formats[i] = FileFormat{};
+			probe_format(path, std::move(item_io), formats[i]);
+			errors[i] = nullptr;
+		} catch (const std::bad_alloc &) {
+			errors[i] = std::make_exception_ptr(error::OutOfMemory{});
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+	});
+}
+
+void ImageDecoderRegistry::decode_batch(size_t n, const char * const *paths, std::unique_ptr<IOContext> *io, const OutputBuffer *buffers, std::exception_ptr *errors, unsigned num_threads) const
+{
+	std::vector<IOContext::size_type> input_size;
+	std::vector<FileFormat> split_format;
+	std::vector<BatchJob> jobs;
+	std::vector<std::exception_ptr> job_errors;
+	std::unique_ptr<ThreadPool> own_pool;
+
+	if (!n)
+		return;
+
+	try {
+		input_size.resize(n);
+		split_format.resize(n);
+		if (num_threads)
+			own_pool.reset(new ThreadPool{ static_cast<unsigned>(std::min(static_cast<size_t>(num_threads), n)) });
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+
+	ThreadPool &pool = own_pool ? *own_pool : ThreadPool::default_pool();
+
+	// Size each item, and probe large files that can be reopened by path for splitting.
+	pool.parallel_for(n, [&](size_t i)
+	{
+		const char *path = paths ? paths[i] : nullptr;
+
+		try {
+			if (io && io[i]) {
+				if (io[i]->seekable())
+					input_size[i] = io[i]->size();
+				return;
+			}
+
+			std::unique_ptr<IOContext> item_io{ new FileIOContext{ path, FileIOContext::read_tag } };
+			input_size[i] = item_io->size();
+
+			if (input_size[i] >= BATCH_SPLIT_BYTES && !probe_format(path, std::move(item_io), &split_format[i]))
+				split_format[i] = FileFormat{};
+		} catch (...) {
+			// Unknown size sorts last, and errors are reported by the decode.
+			split_format[i] = FileFormat{};
+		}
+	});
+
+	try {
+		for (size_t i = 0; i < n; ++i) {
+			const FileFormat &format = split_format[i];
+
+			if (!is_band_splittable(format)) {
+				jobs.push_back({ i, 0, 0, input_size[i] });
+				continue;
+			}
+
+			unsigned height = format.plane[0].height;
+			IOContext::size_type band_cost = input_size[i] / ((height + BATCH_BAND_ROWS - 1) / BATCH_BAND_ROWS);
+
+			for (unsigned top = 0; top < height; top += BATCH_BAND_ROWS) {
+				jobs.push_back({ i, top, std::min(BATCH_BAND_ROWS, height - top), band_cost });
+			}
+		}
+		job_errors.resize(jobs.size());
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+	std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob &a, const BatchJob &b) { return a.cost > b.cost; });
+
+	pool.parallel_for(jobs.size(), [&](size_t k)
+	{
+		const BatchJob &job = jobs[k];
+		size_t i = job.item;
+		const char *path = paths ? paths[i] : nullptr;
+
+		try {
+			std::unique_ptr<IOContext> item_io = io && io[i] ? std::move(io[i]) : nullptr;
+			if (!item_io)
+				item_io.reset(new FileIOContext{ path, FileIOContext::read_tag });
+
+			const FileFormat *format = job.height ? &split_format[i] : nullptr;
+			std::unique_ptr<ImageDecoder> decoder = create_decoder(path, format, std::move(item_io));
+			if (!decoder)
+				throw error::CannotDecodeImage{ "no decoder for format" };
+
+			FrameFormat frame = decoder->next_frame_format();
+			if (!is_constant_format(frame))
+				throw error::CannotDecodeImage{ "no image in file" };
+
+			if (!job.height) {
+				decoder->decode(buffers[i]);
+				return;
+			}
+
+			// Bands of a split frame go to the corresponding rows of the item buffer.
+			OutputBuffer band = buffers[i];
+			for (unsigned p = 0; p < frame.plane_count; ++p) {
+				band.data[p] = static_cast<unsigned char *>(band.data[p]) + static_cast<ptrdiff_t>(job.top) * band.stride[p];
+			}
+			decoder->decode_region(band, { 0, job.top, frame.plane[0].width, job.height });
+		} catch (const std::bad_alloc &) {
+			job_errors[k] = std::make_exception_ptr(error::OutOfMemory{});
+		} catch (...) {
+			job_errors[k] = std::current_exception();
+		}
+	});
+
+	for (size_t i = 0; i < n; ++i) {
+		errors[i] = nullptr;
+	}
+	for (size_t k = 0; k < jobs.size(); ++k) {
+		if (job_errors[k] && !errors[jobs[k].item])
+			errors[jobs[k].item] = job_errors[k];
 	}
-	return nullptr;
 }
 
 } // namespace imagine
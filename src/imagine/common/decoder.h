@@ -3,6 +3,10 @@
 #ifndef IMAGINE_DECODER_H_
 #define IMAGINE_DECODER_H_
 
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
 #include <limits>
 #include <map>
 #include <memory>
@@ -19,14 +23,55 @@ protected:
 
 namespace imagine {
 
+struct InputBuffer;
 struct OutputBuffer;
+class Allocator;
 class IOContext;
+class ImageDecoderRegistry;
 
+/**
+ * Receiver for bands of rows produced by ImageDecoder::decode_rows.
+ */
+class RowSink {
+public:
+	virtual ~RowSink() = default;
+
+	/**
+	 * Receive rows [top, top + height) of the frame, in units of plane 0.
+	 * A plane subsampled vertically by sh holds rows [top / sh, (top + height
+	 * + sh - 1) / sh), clipped to the plane, with top a multiple of sh. Each
+	 * plane of buffer starts at the first row of the band and is only valid
+	 * during the call. Return false to stop, skipping the rest of the frame.
+	 */
+	virtual bool write_rows(const InputBuffer &buffer, unsigned top, unsigned height) = 0;
+};
+
+/**
+ * Decoder for a single file. A decoder must not be used from more than one
+ * thread at a time, but distinct decoders may be used concurrently.
+ */
 class ImageDecoder : public imagine_decoder {
 	ImageDecoder(const ImageDecoder &) = delete;
 	ImageDecoder &operator=(const ImageDecoder &) = delete;
 protected:
-	ImageDecoder() = default;
+	Allocator *m_allocator;
+	unsigned m_scale_denom;
+	OutputLayout m_layout;
+	SampleFormat m_sample;
+
+	ImageDecoder();
+
+	/**
+	 * Throw IllegalArgument unless the region lies within the frame and is
+	 * aligned to the subsampling factors sw x sh.
+	 */
+	static void check_region(const FrameFormat &format, const ImageRect &rect, unsigned sw = 1, unsigned sh = 1);
+
+	/**
+	 * Throw unless the output layout can hold the frame. Interleaving
+	 * requires planes of equal size and sample type.
+	 */
+	void check_layout(const FrameFormat &format) const;
 public:
 	virtual ~ImageDecoder() = 0;
 
@@ -37,6 +82,90 @@ public:
 	virtual FrameFormat next_frame_format() = 0;
 
 	virtual void decode(const OutputBuffer &buffer) = 0;
+
+	/**
+	 * Decode a rectangle of the next frame, given in units of plane 0. Each
+	 * plane of the buffer receives the corresponding subsampled rectangle,
+	 * starting at its first row and column. Only the data needed for the
+	 * region is read where the format allows. The frame is consumed. The
+	 * default implementation throws UnsupportedOperation.
+	 */
+	virtual void decode_region(const OutputBuffer &buffer, const ImageRect &rect);
+
+	/**
+	 * Upper bound on the scratch memory allocated while decoding the next
+	 * frame, in addition to the output buffer. Large buffers held by the codec
+	 * library are included where they can be predicted. Returns 0 if there
+	 * are no more frames. The default implementation throws
+	 * UnsupportedOperation.
+	 */
+	virtual size_t scratch_bytes();
+
+	/**
+	 * Queue a call to decode on the library worker pool. The callback is
+	 * invoked on a worker thread with the exception thrown by decode, if any,
+	 * and must not throw. The decoder and the buffer must not be accessed
+	 * until then.
+	 */
+	void decode_async(const OutputBuffer &buffer, std::function<void(std::exception_ptr)> callback);
+
+	std::future<void> decode_async(const OutputBuffer &buffer);
+
+	/**
+	 * Decode the next frame in bands of rows, passing each to sink as soon as
+	 * it is complete. Bands follow the order of the data in the file, so a
+	 * bottom-up image is delivered from the bottom. Providers size the bands
+	 * to the units of the file, such as strips or MCU rows, and allocate them
+	 * in addition to the scratch memory. If sink stops early, the frame is
+	 * abandoned and the decoder moves on as if it had been decoded. The
+	 * default implementation decodes the whole frame and passes it as a
+	 * single band.
+	 */
+	virtual void decode_rows(RowSink &sink);
+
+	/**
+	 * Restart the decoder on a new file of the same image type, retaining
+	 * codec state and buffers allocated for the previous file. If an
+	 * exception is thrown, the decoder returns no further frames. The default
+	 * implementation throws UnsupportedOperation.
+	 */
+	virtual void reset(std::unique_ptr<IOContext> io);
+
+	/**
+	 * Set the allocator for scratch buffers, or restore the default if null.
+	 * Buffers held by the decoder are released, so this should be called
+	 * between files. The allocator must outlive the decoder.
+	 */
+	virtual void set_allocator(Allocator *allocator);
+
+	/**
+	 * Decode subsequent frames at 1/denom of the full resolution in each
+	 * dimension, which must be 1, 2, 4 or 8. The reduced size is reported by
+	 * next_frame_format, and regions are given in units of it. Providers
+	 * reduce the resolution while decoding, without a full-size intermediate.
+	 */
+	virtual void set_scale_denominator(unsigned denom);
+
+	unsigned scale_denominator() const { return m_scale_denom; }
+
+	/**
+	 * Arrange the planes of subsequent frames in the output buffer, including
+	 * bands passed to a RowSink. Interleaved samples are written directly
+	 * where the file stores them packed, without a planar intermediate.
+	 */
+	virtual void set_output_layout(const OutputLayout &layout);
+
+	const OutputLayout &output_layout() const { return m_layout; }
+
+	/**
+	 * Convert the samples of subsequent frames as they are written to the
+	 * output buffer, as reported by next_frame_format. Integer samples of up
+	 * to 16 bits can be converted to integers of 1 to 16 bits or to 32-bit
+	 * floating point.
+	 */
+	virtual void set_sample_format(const SampleFormat &sample);
+
+	const SampleFormat &sample_format() const { return m_sample; }
 };
 
 class ImageDecoderFactory {
@@ -57,19 +186,97 @@ public:
 
 	virtual int priority() const = 0;
 
+	/**
+	 * Image type handled by the factory, or UNKNOWN if not fixed.
+	 */
+	virtual ImageType type() const;
+
+	/**
+	 * Check whether the start of a file may belong to the format. Must not
+	 * throw. The default implementation defers recognition to create_decoder.
+	 */
+	virtual bool probe(const void *buf, size_t size) const;
+
+	virtual bool matches_extension(const char *path) const;
+
+	/**
+	 * Read the file format from the header without creating a decoder. The
+	 * default implementation returns false, meaning that the format can only
+	 * be obtained from a decoder.
+	 */
+	virtual bool probe_format(IOContext *io, FileFormat *format) const;
+
 	virtual std::unique_ptr<ImageDecoder> create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) = 0;
+
+	/**
+	 * Create a decoder on behalf of a registry, which decoders use for images
+	 * nested in the file. The default implementation ignores the registry.
+	 */
+	virtual std::unique_ptr<ImageDecoder> create_decoder_in(const ImageDecoderRegistry &registry, const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io);
 };
 
+/**
+ * Ordered collection of decoder factories.
+ *
+ * Registration is not synchronized. Once populated, create_decoder may be
+ * called concurrently from multiple threads. Copies share the factories.
+ */
 class ImageDecoderRegistry : public imagine_decoder_registry {
-	std::multimap<int, std::unique_ptr<ImageDecoderFactory>> m_registry;
+	std::multimap<int, std::shared_ptr<ImageDecoderFactory>> m_registry;
+	Allocator *m_allocator;
 public:
+	/**
+	 * Shared registry holding the default providers. It is constructed on
+	 * first use and never modified afterwards.
+	 */
+	static const ImageDecoderRegistry &default_registry();
+
+	ImageDecoderRegistry() : m_allocator{}
+	{
+	}
+
 	void register_default_providers();
 
 	void register_provider(std::unique_ptr<ImageDecoderFactory> factory);
 
 	void disable_provider(const char *name);
 
+	/**
+	 * Set the allocator passed to decoders created by the registry, or use
+	 * the default allocator if null.
+	 */
+	void set_allocator(Allocator *allocator);
+
 	std::unique_ptr<ImageDecoder> create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> io) const;
+
+	/**
+	 * Determine the format of a file, preferring header parsing over decoder
+	 * construction. The image data is not validated.
+	 *
+	 * @return false if no provider recognized the file
+	 */
+	bool probe_format(const char *path, std::unique_ptr<IOContext> io, FileFormat *format) const;
+
+	/**
+	 * Probe a batch of files concurrently. Items are read from io, or opened
+	 * by path where io is null. The outcome of each item is stored in errors,
+	 * with an unrecognized file leaving the format type as UNKNOWN.
+	 *
+	 * @param num_threads number of threads, or 0 for a default suited to I/O
+	 */
+	void probe_format_batch(size_t n, const char * const *paths, std::unique_ptr<IOContext> *io, FileFormat * const *formats, std::exception_ptr *errors, unsigned num_threads = 0) const;
+
+	/**
+	 * Decode the first frame of a batch of files concurrently into buffers
+	 * laid out for the format returned by next_frame_format. Items are read
+	 * from io, or opened by path where io is null. Files of known size are
+	 * started largest first, so that small files fill in around large ones.
+	 * Large TIFF and BMP files opened by path are decoded in bands of rows
+	 * by separate decoders.
+	 *
+	 * @param num_threads number of threads, or 0 to use the library pool
+	 */
+	void decode_batch(size_t n, const char * const *paths, std::unique_ptr<IOContext> *io, const OutputBuffer *buffers, std::exception_ptr *errors, unsigned num_threads = 0) const;
 };
 
 } // namespace imagine
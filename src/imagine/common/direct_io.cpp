@@ -0,0 +1,303 @@
+#ifndef _WIN32
+  #define _FILE_OFFSET_BITS 64
+#endif // _WIN32
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include "align.h"
+#include "direct_io.h"
+#include "except.h"
+
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <io.h>
+  #include <malloc.h>
+  #include <Windows.h>
+#else
+  #include <unistd.h>
+#endif
+
+namespace imagine {
+namespace {
+
+// Largest transfer issued in a single system call.
+const size_t MAX_IO_SIZE = 1UL << 30;
+
+unsigned char *aligned_malloc(size_t size, size_t alignment)
+{
+#ifdef _WIN32
+	void *ptr = _aligned_malloc(size, alignment);
+#else
+	void *ptr;
+	if (posix_memalign(&ptr, alignment, size))
+		ptr = nullptr;
+#endif
+	if (!ptr)
+		throw error::OutOfMemory{};
+	return static_cast<unsigned char *>(ptr);
+}
+
+void aligned_free(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+// Keeps a few released buffers, so that sequences of files do not reallocate.
+class BufferPool {
+	std::mutex m_mutex;
+	std::array<unsigned char *, 4> m_free;
+	size_t m_count;
+public:
+	BufferPool() : m_free{}, m_count{}
+	{
+	}
+
+	~BufferPool()
+	{
+		for (size_t i = 0; i < m_count; ++i) {
+			aligned_free(m_free[i]);
+		}
+	}
+
+	unsigned char *acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			if (m_count)
+				return m_free[--m_count];
+		}
+		return aligned_malloc(DirectIOContext::BUFFER_SIZE, DirectIOContext::DIRECT_IO_ALIGNMENT);
+	}
+
+	void release(unsigned char *ptr)
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			if (m_count < m_free.size()) {
+				m_free[m_count++] = ptr;
+				return;
+			}
+		}
+		aligned_free(ptr);
+	}
+};
+
+BufferPool &buffer_pool()
+{
+	static BufferPool pool;
+	return pool;
+}
+
+FdIOHandle open_direct(const char *path)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file != INVALID_HANDLE_VALUE) {
+		FdIOHandle handle{ _open_osfhandle(reinterpret_cast<intptr_t>(file), _O_RDONLY) };
+		if (handle)
+			return handle;
+		CloseHandle(file);
+	}
+
+	FdIOHandle handle{ _open(path, _O_RDONLY | _O_BINARY) };
+#elif defined(O_DIRECT)
+	FdIOHandle handle{ open(path, O_RDONLY | O_CLOEXEC | O_DIRECT) };
+
+	// Not all file systems support O_DIRECT.
+	if (!handle && errno == EINVAL)
+		handle = FdIOHandle{ open(path, O_RDONLY | O_CLOEXEC) };
+#else
+	FdIOHandle handle{ open(path, O_RDONLY | O_CLOEXEC) };
+  #ifdef F_NOCACHE
+	if (handle)
+		fcntl(handle.get(), F_NOCACHE, 1);
+  #endif
+#endif
+	if (!handle)
+		throw error::CannotOpenFile{ "error opening file", path };
+	return handle;
+}
+
+bool is_aligned(IOContext::difference_type off, size_t alignment)
+{
+	return !(off % alignment);
+}
+
+bool is_aligned(const void *ptr, size_t alignment)
+{
+	return !(reinterpret_cast<uintptr_t>(ptr) % alignment);
+}
+
+} // namespace
+
+
+void DirectIOContext::release_buffer::operator()(unsigned char *ptr)
+{
+	buffer_pool().release(ptr);
+}
+
+DirectIOContext::DirectIOContext(const std::string &path) :
+	FdIOContext{ open_direct(path.c_str()), path },
+	m_buffer{ buffer_pool().acquire() },
+	m_buffer_offset{},
+	m_buffer_count{}
+{
+	if (!m_seekable) {
+		errno = 0;
+		throw error::CannotOpenFile{ "file not seekable", path.c_str() };
+	}
+}
+
+DirectIOContext::~DirectIOContext() = default;
+
+size_t DirectIOContext::read_aligned(difference_type off, void *buf, size_t count) const
+{
+	unsigned char *buf_p = static_cast<unsigned char *>(buf);
+	size_t n = 0;
+
+	while (n < count) {
+		size_t c = std::min(count - n, MAX_IO_SIZE);
+		size_t ret = pread_once(off + n, buf_p + n, c);
+
+		n += ret;
+
+		// A short read ends at eof, and leaves the next offset unaligned.
+		if (ret < c)
+			break;
+	}
+	return n;
+}
+
+size_t DirectIOContext::buffered() const
+{
+	if (m_offset < m_buffer_offset || m_offset >= m_buffer_offset + static_cast<difference_type>(m_buffer_count))
+		return 0;
+	return static_cast<size_t>(m_buffer_offset + m_buffer_count - m_offset);
+}
+
+size_t DirectIOContext::fill_buffer()
+{
+	difference_type off = floor_n(m_offset, static_cast<difference_type>(DIRECT_IO_ALIGNMENT));
+
+	// Invalidate the buffer in case the read fails.
+	m_buffer_count = 0;
+	m_buffer_count = read_aligned(off, m_buffer.get(), BUFFER_SIZE);
+	m_buffer_offset = off;
+	return buffered();
+}
+
+auto DirectIOContext::read(void *buf, size_type count) -> size_type
+{
+	unsigned char *buf_p = static_cast<unsigned char *>(buf);
+	size_type n = 0;
+
+	while (n < count) {
+		size_t avail = buffered();
+
+		if (avail) {
+			size_t c = static_cast<size_t>(std::min(count - n, static_cast<size_type>(avail)));
+			memcpy(buf_p + n, m_buffer.get() + (m_offset - m_buffer_offset), c);
+			m_offset += c;
+			n += c;
+		} else if (count - n >= DIRECT_IO_ALIGNMENT && is_aligned(m_offset, DIRECT_IO_ALIGNMENT) && is_aligned(buf_p + n, DIRECT_IO_ALIGNMENT)) {
+			// Read whole blocks straight into the destination.
+			size_t c = static_cast<size_t>(std::min(floor_n(count - n, DIRECT_IO_ALIGNMENT), static_cast<size_type>(MAX_IO_SIZE)));
+			size_t ret = read_aligned(m_offset, buf_p + n, c);
+
+			m_offset += ret;
+			n += ret;
+
+			if (ret < c)
+				break;
+		} else if (!fill_buffer()) {
+			break;
+		}
+	}
+
+	if (n != count)
+		m_eof = true;
+	return n;
+}
+
+auto DirectIOContext::read_at(difference_type off, void *buf, size_type count) const -> size_type
+{
+	check_seekable();
+
+	unsigned char *buf_p = static_cast<unsigned char *>(buf);
+	std::unique_ptr<unsigned char, release_buffer> bounce;
+	size_type n = 0;
+
+	// The shared buffer is not used, so that concurrent calls do not race.
+	while (n < count) {
+		difference_type pos = off + static_cast<difference_type>(n);
+
+		if (count - n >= DIRECT_IO_ALIGNMENT && is_aligned(pos, DIRECT_IO_ALIGNMENT) && is_aligned(buf_p + n, DIRECT_IO_ALIGNMENT)) {
+			size_t c = static_cast<size_t>(std::min(floor_n(count - n, DIRECT_IO_ALIGNMENT), static_cast<size_type>(MAX_IO_SIZE)));
+			size_t ret = read_aligned(pos, buf_p + n, c);
+
+			n += ret;
+
+			if (ret < c)
+				break;
+			continue;
+		}
+
+		// Read the enclosing blocks into a pool buffer and copy out the requested part.
+		if (!bounce)
+			bounce.reset(buffer_pool().acquire());
+
+		difference_type base = floor_n(pos, static_cast<difference_type>(DIRECT_IO_ALIGNMENT));
+		size_t skip = static_cast<size_t>(pos - base);
+		size_t c = static_cast<size_t>(std::min(ceil_n(count - n + skip, DIRECT_IO_ALIGNMENT), static_cast<size_type>(BUFFER_SIZE)));
+		size_t ret = read_aligned(base, bounce.get(), c);
+
+		if (ret <= skip)
+			break;
+
+		size_t copy = static_cast<size_t>(std::min(count - n, static_cast<size_type>(ret - skip)));
+		memcpy(buf_p + n, bounce.get() + skip, copy);
+		n += copy;
+
+		if (ret < c)
+			break;
+	}
+	return n;
+}
+
+void DirectIOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	// Arbitrary ranges do not meet the alignment requirements of unbuffered I/O.
+	IOContext::read_ranges(ranges, n);
+}
+
+auto DirectIOContext::peek(const void **ptr, size_type count) -> size_type
+{
+	size_t avail = buffered();
+	if (!avail)
+		avail = fill_buffer();
+
+	*ptr = avail ? m_buffer.get() + (m_offset - m_buffer_offset) : nullptr;
+	return std::min(count, static_cast<size_type>(avail));
+}
+
+void DirectIOContext::consume(size_type count)
+{
+	if (count > buffered()) {
+		errno = 0;
+		throw error::EndOfFile{ "insufficient data in buffer", path(), tell(), count };
+	}
+	m_offset += count;
+}
+
+} // namespace imagine
@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef IMAGINE_DIRECT_IO_H_
+#define IMAGINE_DIRECT_IO_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "fd_io.h"
+
+namespace imagine {
+
+/**
+ * Read-only file context that bypasses the operating system page cache.
+ *
+ * Reads are issued in aligned blocks into a buffer taken from a shared pool,
+ * or directly into the destination when it is suitably aligned. Falls back
+ * to buffered reads if the file system does not support unbuffered I/O.
+ */
+class DirectIOContext : public FdIOContext {
+public:
+	// Alignment of offsets, sizes, and addresses for unbuffered I/O.
+	static const size_t DIRECT_IO_ALIGNMENT = 4096;
+	static const size_t BUFFER_SIZE = 1UL << 20;
+private:
+	struct release_buffer {
+		void operator()(unsigned char *ptr);
+	};
+
+	std::unique_ptr<unsigned char, release_buffer> m_buffer;
+	difference_type m_buffer_offset;
+	size_t m_buffer_count;
+
+	size_t read_aligned(difference_type off, void *buf, size_t count) const;
+	size_t buffered() const;
+	size_t fill_buffer();
+public:
+	explicit DirectIOContext(const std::string &path);
+
+	~DirectIOContext();
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type read_at(difference_type off, void *buf, size_type count) const override;
+
+	void read_ranges(const ReadRange *ranges, size_t n) override;
+
+	size_type peek(const void **ptr, size_type count) override;
+
+	void consume(size_type count) override;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_DIRECT_IO_H_
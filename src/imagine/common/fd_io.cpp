@@ -0,0 +1,414 @@
+#ifndef _WIN32
+  #define _FILE_OFFSET_BITS 64
+#endif // _WIN32
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <utility>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "except.h"
+#include "fd_io.h"
+
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <io.h>
+  #include <Windows.h>
+  #define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+  #define close _close
+  #define fstat64 _fstat64
+  #define isatty _isatty
+  #define struct_stat64 __stat64
+#else
+  #include <climits>
+  #include <sys/uio.h>
+  #include <unistd.h>
+  #define struct_stat64 stat64
+#endif
+
+namespace imagine {
+namespace {
+
+// Largest transfer issued in a single system call.
+const size_t MAX_IO_SIZE = 1UL << 30;
+
+#ifndef _WIN32
+// Vectored reads merge ranges separated by at most this many bytes.
+const size_t MAX_RANGE_GAP = 4096;
+
+#if defined(IOV_MAX) && IOV_MAX < 64
+const size_t MAX_IOV = IOV_MAX;
+#else
+const size_t MAX_IOV = 64;
+#endif
+#endif // _WIN32
+
+FdIOHandle open_file(const char *path)
+{
+#ifdef _WIN32
+	FdIOHandle handle{ _open(path, _O_RDONLY | _O_BINARY) };
+#else
+	FdIOHandle handle{ open(path, O_RDONLY | O_CLOEXEC) };
+#endif
+	if (!handle)
+		throw error::CannotOpenFile{ "error opening file", path };
+	return handle;
+}
+
+bool is_seekable(int fd)
+{
+	struct struct_stat64 st;
+
+	if (isatty(fd))
+		return false;
+	if (fstat64(fd, &st))
+		return false;
+
+	return S_ISREG(st.st_mode);
+}
+
+long long pread_fd(int fd, void *buf, size_t count, long long off)
+{
+#ifdef _WIN32
+	HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+	OVERLAPPED overlapped{};
+	DWORD n;
+
+	overlapped.Offset = static_cast<DWORD>(off);
+	overlapped.OffsetHigh = static_cast<DWORD>(off >> 32);
+
+	if (!ReadFile(handle, buf, static_cast<DWORD>(count), &n, &overlapped)) {
+		if (GetLastError() == ERROR_HANDLE_EOF)
+			return 0;
+		errno = EIO;
+		return -1;
+	}
+	return n;
+#else
+	return pread(fd, buf, count, off);
+#endif
+}
+
+#ifdef _WIN32
+// Positional ReadFile on a synchronous handle moves the file pointer, so save and restore it.
+class FilePointerGuard {
+	HANDLE m_handle;
+	LARGE_INTEGER m_pos;
+public:
+	FilePointerGuard(int fd, const char *path) :
+		m_handle{ reinterpret_cast<HANDLE>(_get_osfhandle(fd)) },
+		m_pos{}
+	{
+		LARGE_INTEGER zero{};
+
+		if (!SetFilePointerEx(m_handle, zero, &m_pos, FILE_CURRENT)) {
+			errno = EIO;
+			throw error::SeekFailed{ "error determining file position", path };
+		}
+	}
+
+	FilePointerGuard(const FilePointerGuard &) = delete;
+
+	~FilePointerGuard()
+	{
+		SetFilePointerEx(m_handle, m_pos, nullptr, FILE_BEGIN);
+	}
+
+	FilePointerGuard &operator=(const FilePointerGuard &) = delete;
+};
+#endif // _WIN32
+
+long long read_fd(int fd, void *buf, size_t count)
+{
+#ifdef _WIN32
+	return _read(fd, buf, static_cast<unsigned>(count));
+#else
+	return ::read(fd, buf, count);
+#endif
+}
+
+} // namespace
+
+
+FdIOHandle::~FdIOHandle()
+{
+	if (m_fd >= 0 && m_should_close)
+		close(m_fd);
+}
+
+FdIOHandle &FdIOHandle::operator=(FdIOHandle &&other)
+{
+	std::swap(m_fd, other.m_fd);
+	std::swap(m_should_close, other.m_should_close);
+	return *this;
+}
+
+int FdIOHandle::release()
+{
+	int fd = m_fd;
+	m_fd = -1;
+	return fd;
+}
+
+FdIOContext::FdIOContext(FdIOHandle fd, const std::string &path) :
+	m_fd{ std::move(fd) },
+	m_path{ path },
+	m_offset{},
+	m_seekable{ is_seekable(m_fd.get()) },
+	m_eof{}
+{
+}
+
+FdIOContext::FdIOContext(const std::string &path) :
+	FdIOContext{ open_file(path.c_str()), path }
+{
+}
+
+FdIOContext::~FdIOContext() = default;
+
+void FdIOContext::check_seekable() const
+{
+	if (!m_seekable) {
+		errno = 0;
+		throw error::SeekFailed{ "file not seekable", path() };
+	}
+}
+
+bool FdIOContext::eof()
+{
+	return m_eof;
+}
+
+bool FdIOContext::seekable()
+{
+	return m_seekable;
+}
+
+const char *FdIOContext::path() const
+{
+	return m_path.c_str();
+}
+
+auto FdIOContext::tell() -> difference_type
+{
+	return m_offset;
+}
+
+auto FdIOContext::size() -> size_type
+{
+	check_seekable();
+
+	struct struct_stat64 st;
+
+	if (fstat64(m_fd.get(), &st))
+		throw error::SeekFailed{ "unable to determine file size", path() };
+	return st.st_size;
+}
+
+auto FdIOContext::seek_set(difference_type off) -> difference_type
+{
+	check_seekable();
+
+	if (off < 0) {
+		errno = EINVAL;
+		throw error::SeekFailed{ "error seeking (from begin)", path(), off };
+	}
+
+	m_offset = off;
+	m_eof = false;
+	return m_offset;
+}
+
+auto FdIOContext::seek_end(difference_type off) -> difference_type
+{
+	check_seekable();
+
+	difference_type where = static_cast<difference_type>(size()) + off;
+	if (where < 0) {
+		errno = EINVAL;
+		throw error::SeekFailed{ "error seeking (from end)", path(), off };
+	}
+
+	m_offset = where;
+	m_eof = false;
+	return m_offset;
+}
+
+auto FdIOContext::seek_rel(difference_type off) -> difference_type
+{
+	check_seekable();
+
+	if (m_offset + off < 0) {
+		errno = EINVAL;
+		throw error::SeekFailed{ "error seeking", path(), m_offset + off };
+	}
+
+	m_offset += off;
+	m_eof = false;
+	return m_offset;
+}
+
+auto FdIOContext::read(void *buf, size_type count) -> size_type
+{
+	size_type n;
+
+	if (m_seekable) {
+		n = read_at(m_offset, buf, count);
+	} else {
+		char *buf_p = static_cast<char *>(buf);
+
+		// Pipes may return short reads before the end of the stream.
+		for (n = 0; n < count;) {
+			long long ret = read_fd(m_fd.get(), buf_p + n, static_cast<size_t>(std::min(count - n, static_cast<size_type>(MAX_IO_SIZE))));
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw error::ReadFailed{ "error reading", path(), static_cast<difference_type>(m_offset + n), count - n };
+			if (ret == 0)
+				break;
+
+			n += ret;
+		}
+	}
+
+	m_offset += n;
+	if (n != count)
+		m_eof = true;
+	return n;
+}
+
+auto FdIOContext::write(const void *, size_type count) -> size_type
+{
+	errno = 0;
+	throw error::WriteFailed{ "file not writable", path(), m_offset, count };
+}
+
+void FdIOContext::flush()
+{
+}
+
+size_t FdIOContext::pread_once(difference_type off, void *buf, size_t count) const
+{
+	long long ret;
+
+	do {
+		ret = pread_fd(m_fd.get(), buf, count, off);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		throw error::ReadFailed{ "error reading", path(), off, count };
+	return static_cast<size_t>(ret);
+}
+
+auto FdIOContext::read_at(difference_type off, void *buf, size_type count) const -> size_type
+{
+	check_seekable();
+
+	char *buf_p = static_cast<char *>(buf);
+	size_type n = 0;
+
+	while (n < count) {
+		size_t c = static_cast<size_t>(std::min(count - n, static_cast<size_type>(MAX_IO_SIZE)));
+		size_t ret = pread_once(off + n, buf_p + n, c);
+
+		if (ret == 0)
+			break;
+
+		n += ret;
+	}
+	return n;
+}
+
+void FdIOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	check_seekable();
+	read_ranges_fd(m_fd.get(), path(), ranges, n);
+}
+
+void read_ranges_fd(int fd, const char *path, const IOContext::ReadRange *ranges, size_t n)
+{
+#ifdef _WIN32
+	FilePointerGuard guard{ fd, path };
+
+	for (size_t i = 0; i < n; ++i) {
+		char *buf_p = static_cast<char *>(ranges[i].buf);
+		IOContext::size_type count = ranges[i].count;
+
+		for (IOContext::size_type k = 0; k < count;) {
+			IOContext::difference_type off = ranges[i].off + k;
+			long long ret = pread_fd(fd, buf_p + k, static_cast<size_t>(std::min(count - k, static_cast<IOContext::size_type>(MAX_IO_SIZE))), off);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw error::ReadFailed{ "error reading", path, off, count - k };
+			if (ret == 0) {
+				errno = 0;
+				throw error::EndOfFile{ "eof during read", path, off, count - k };
+			}
+
+			k += ret;
+		}
+	}
+#else
+	unsigned char gap[MAX_RANGE_GAP];
+	iovec iov[MAX_IOV];
+
+	for (size_t i = 0; i < n;) {
+		// Gather ranges in ascending order, reading short gaps between them into scratch space.
+		IOContext::difference_type off = ranges[i].off;
+		IOContext::difference_type end = off;
+		size_t iov_count = 0;
+
+		for (size_t first = i; i < n; ++i) {
+			const IOContext::ReadRange &range = ranges[i];
+
+			if (i != first) {
+				if (range.off < end || static_cast<IOContext::size_type>(range.off - end) > MAX_RANGE_GAP)
+					break;
+				if (iov_count + 2 > MAX_IOV)
+					break;
+				if (range.off > end)
+					iov[iov_count++] = { gap, static_cast<size_t>(range.off - end) };
+			}
+			if (range.count)
+				iov[iov_count++] = { range.buf, static_cast<size_t>(range.count) };
+
+			end = range.off + range.count;
+		}
+
+		for (size_t k = 0; k < iov_count;) {
+			ssize_t ret = preadv(fd, iov + k, static_cast<int>(iov_count - k), off);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw error::ReadFailed{ "error reading", path, off, static_cast<IOContext::size_type>(end - off) };
+			if (ret == 0) {
+				errno = 0;
+				throw error::EndOfFile{ "eof during read", path, off, static_cast<IOContext::size_type>(end - off) };
+			}
+
+			off += ret;
+
+			// Resume after a partial transfer.
+			size_t c = static_cast<size_t>(ret);
+
+			while (k < iov_count && c >= iov[k].iov_len) {
+				c -= iov[k].iov_len;
+				++k;
+			}
+			if (c) {
+				iov[k].iov_base = static_cast<unsigned char *>(iov[k].iov_base) + c;
+				iov[k].iov_len -= c;
+			}
+		}
+	}
+#endif // _WIN32
+}
+
+} // namespace imagine
@@ -0,0 +1,108 @@
+#pragma once
+
+#ifndef IMAGINE_FD_IO_H_
+#define IMAGINE_FD_IO_H_
+
+#include <string>
+#include <utility>
+#include "io_context.h"
+
+namespace imagine {
+
+class FdIOHandle {
+	int m_fd;
+	bool m_should_close;
+public:
+	FdIOHandle() : m_fd{ -1 }, m_should_close{}
+	{
+	}
+
+	explicit FdIOHandle(int fd, bool should_close = true) :
+		m_fd{ fd },
+		m_should_close{ should_close }
+	{
+	}
+
+	FdIOHandle(FdIOHandle &&other) : FdIOHandle{}
+	{
+		*this = std::move(other);
+	}
+
+	~FdIOHandle();
+
+	FdIOHandle &operator=(FdIOHandle &&other);
+
+	int get() const { return m_fd; }
+	int release();
+
+	explicit operator bool() { return m_fd >= 0; }
+};
+
+/**
+ * Read-only file context over a POSIX file descriptor.
+ *
+ * Reads on seekable files are positional and independent of the descriptor's
+ * file pointer, so the file position is tracked without lseek/ftell calls.
+ */
+class FdIOContext : public IOContext {
+protected:
+	FdIOHandle m_fd;
+	std::string m_path;
+	difference_type m_offset;
+	bool m_seekable;
+	bool m_eof;
+
+	void check_seekable() const;
+
+	// Single positional read. Returns fewer than count bytes at eof.
+	size_t pread_once(difference_type off, void *buf, size_t count) const;
+public:
+	FdIOContext(FdIOHandle fd, const std::string &path);
+
+	explicit FdIOContext(const std::string &path);
+
+	~FdIOContext();
+
+	bool eof() override;
+
+	bool seekable() override;
+
+	const char *path() const override;
+
+	difference_type tell() override;
+
+	size_type size() override;
+
+	difference_type seek_set(difference_type off) override;
+
+	difference_type seek_end(difference_type off) override;
+
+	difference_type seek_rel(difference_type off) override;
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type write(const void *buf, size_type count) override;
+
+	void flush() override;
+
+	/**
+	 * Read up to count bytes at an absolute offset, independent of the
+	 * current file position. Safe to call concurrently from multiple threads.
+	 *
+	 * @return number of bytes read, which is less than count only at eof
+	 */
+	virtual size_type read_at(difference_type off, void *buf, size_type count) const;
+
+	void read_ranges(const ReadRange *ranges, size_t n) override;
+};
+
+/**
+ * Read a batch of ranges from a seekable file descriptor with positional
+ * reads, combining nearby ranges into vectored requests. The descriptor's
+ * file pointer is unchanged afterwards.
+ */
+void read_ranges_fd(int fd, const char *path, const IOContext::ReadRange *ranges, size_t n);
+
+} // namespace imagine
+
+#endif // IMAGINE_FD_IO_H_
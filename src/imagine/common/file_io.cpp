@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include "except.h"
+#include "fd_io.h"
 #include "file_io.h"
 
 #ifdef _WIN32
@@ -20,6 +21,7 @@
   #define isatty _isatty
   #define struct_stat64 __stat64
 #else
+  #include <fcntl.h>
   #include <unistd.h>
   #define struct_stat64 stat64
 #endif
@@ -71,7 +73,8 @@ FileIOContext::FileIOContext(FileIOHandle file, const std::string &path) :
 	m_file{ std::move(file) },
 	m_path{ path },
 	m_offset{},
-	m_seekable{ is_seekable(file_cast(m_file)) }
+	m_seekable{ is_seekable(file_cast(m_file)) },
+	m_writable{}
 {
 }
 
@@ -80,19 +83,31 @@ FileIOContext::FileIOContext(const std::string &path, read_tag_type) :
 {
 }
 
+FileIOContext::FileIOContext(const std::string &path, read_tag_type, const FileIOOptions &options) :
+	FileIOContext{ open_file(path.c_str(), "rb"), std::move(path) }
+{
+	if (options.buffer_size)
+		set_buffer_size(options.buffer_size);
+	if (options.access_hint != AccessHint::NORMAL)
+		advise(options.access_hint);
+}
+
 FileIOContext::FileIOContext(const std::string &path, write_tag_type) :
 	FileIOContext{ open_file(path.c_str(), "wb"), std::move(path) }
 {
+	m_writable = true;
 }
 
 FileIOContext::FileIOContext(const std::string &path, append_tag_type) :
 	FileIOContext{ open_file(path.c_str(), "wb+"), std::move(path) }
 {
+	m_writable = true;
 }
 
 FileIOContext::FileIOContext(const std::string &path, rw_tag_type) :
 	FileIOContext{ open_file(path.c_str(), "rb+"), std::move(path) }
 {
+	m_writable = true;
 }
 
 FileIOContext::~FileIOContext() = default;
@@ -154,7 +169,9 @@ auto FileIOContext::seek_set(difference_type off) -> difference_type
 
 	if (fseeko(file_cast(m_file), off, SEEK_SET))
 		throw error::SeekFailed{ "error seeking (from begin)", path(), off };
-	return update_file_pointer();
+
+	m_offset = off;
+	return m_offset;
 }
 
 auto FileIOContext::seek_end(difference_type off) -> difference_type
@@ -173,7 +190,9 @@ auto FileIOContext::seek_rel(difference_type off) -> difference_type
 	difference_type where = tell();
 	if (fseeko(file_cast(m_file), off, SEEK_CUR))
 		throw error::SeekFailed{ "error seeking", path(), where + off };
-	return update_file_pointer();
+
+	m_offset = where + off;
+	return m_offset;
 }
 
 auto FileIOContext::read(void *buf, size_type count) -> size_type
@@ -204,6 +223,52 @@ void FileIOContext::flush()
 		throw error::WriteFailed{ "error flushing", path() };
 }
 
+void FileIOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	check_seekable();
+
+	// Positional reads bypass the stream buffer, so pending writes must reach the file first.
+	if (m_writable)
+		flush();
+	read_ranges_fd(fileno(file_cast(m_file)), path(), ranges, n);
+}
+
+void FileIOContext::set_buffer_size(size_t size) try
+{
+	std::unique_ptr<char[]> buffer{ new char[size] };
+
+	// Must precede any other operation on the stream.
+	if (std::setvbuf(file_cast(m_file), buffer.get(), _IOFBF, size))
+		throw error::IllegalArgument{ "error setting buffer size" };
+	m_buffer = std::move(buffer);
+} catch (const std::bad_alloc &) {
+	throw error::OutOfMemory{};
+}
+
+void FileIOContext::advise(AccessHint hint)
+{
+#ifdef POSIX_FADV_NORMAL
+	int fd = fileno(file_cast(m_file));
+
+	// Hints are advisory, so errors are ignored.
+	switch (hint) {
+	case AccessHint::NORMAL:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+		break;
+	case AccessHint::SEQUENTIAL:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		break;
+	case AccessHint::WILLNEED:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+		break;
+	case AccessHint::RANDOM:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+		break;
+	}
+#endif
+}
+
 const FileIOContext::read_tag_type FileIOContext::read_tag;
 const FileIOContext::write_tag_type FileIOContext::write_tag;
 const FileIOContext::append_tag_type FileIOContext::append_tag;
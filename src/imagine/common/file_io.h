@@ -3,12 +3,33 @@
 #ifndef IMAGINE_FILE_IO_H_
 #define IMAGINE_FILE_IO_H_
 
+#include <cstddef>
 #include <memory>
 #include <string>
 #include "io_context.h"
 
 namespace imagine {
 
+enum class AccessHint {
+	NORMAL,
+	// File will be read sequentially.
+	SEQUENTIAL,
+	// File will be read sequentially and in its entirety.
+	WILLNEED,
+	// File will be read in random order, e.g. tiled images.
+	RANDOM,
+};
+
+struct FileIOOptions {
+	// Size of the I/O buffer in bytes. Zero selects the stdio default.
+	size_t buffer_size;
+	AccessHint access_hint;
+
+	FileIOOptions() : buffer_size{}, access_hint{ AccessHint::NORMAL }
+	{
+	}
+};
+
 class FileIOHandle {
 	struct close_file {
 		void operator()(void *file);
@@ -41,10 +62,12 @@ public:
 	static const append_tag_type append_tag;
 	static const rw_tag_type rw_tag;
 protected:
+	std::unique_ptr<char[]> m_buffer;
 	FileIOHandle m_file;
 	std::string m_path;
 	difference_type m_offset;
 	bool m_seekable;
+	bool m_writable;
 
 	void check_seekable();
 	difference_type update_file_pointer();
@@ -52,6 +75,7 @@ public:
 	FileIOContext(FileIOHandle file, const std::string &path);
 
 	explicit FileIOContext(const std::string &path, read_tag_type = read_tag);
+	FileIOContext(const std::string &path, read_tag_type, const FileIOOptions &options);
 	FileIOContext(const std::string &path, write_tag_type);
 	FileIOContext(const std::string &path, append_tag_type);
 	FileIOContext(const std::string &path, rw_tag_type);
@@ -79,6 +103,13 @@ public:
 	size_type write(const void *buf, size_type count) override;
 
 	void flush() override;
+
+	void read_ranges(const ReadRange *ranges, size_t n) override;
+
+	// Must be called before any I/O on the context.
+	void set_buffer_size(size_t size);
+
+	void advise(AccessHint hint);
 };
 
 } // namespace imagine
@@ -87,11 +87,148 @@ struct FileFormat : public FrameFormat, public imagine_file_format {
 	}
 };
 
+/**
+ * Rectangle within a frame, in units of plane 0.
+ */
+struct ImageRect {
+	unsigned left;
+	unsigned top;
+	unsigned width;
+	unsigned height;
+
+	ImageRect() : left{}, top{}, width{}, height{}
+	{
+	}
+
+	ImageRect(unsigned left, unsigned top, unsigned width, unsigned height) :
+		left{ left },
+		top{ top },
+		width{ width },
+		height{ height }
+	{
+	}
+};
+
+/**
+ * Arrangement of planes in an output buffer. Interleaved output is stored in
+ * buffer 0, with the sample of plane order[k] at position k of each pixel.
+ */
+struct OutputLayout {
+	bool interleaved;
+	unsigned char order[MAX_PLANE_COUNT];
+
+	OutputLayout() : interleaved{}, order{ 0, 1, 2, 3 }
+	{
+	}
+
+	OutputLayout(bool interleaved, unsigned char order0 = 0, unsigned char order1 = 1, unsigned char order2 = 2, unsigned char order3 = 3) :
+		interleaved{ interleaved },
+		order{ order0, order1, order2, order3 }
+	{
+	}
+};
+
+/**
+ * Sample type of an output buffer. A bit depth of 0 keeps the samples of the
+ * frame. Otherwise integer samples are rescaled to the full range of the bit
+ * depth, or normalized to [0, 1] if floating point, which must be 32 bits.
+ */
+struct SampleFormat {
+	unsigned bit_depth;
+	bool floating_point;
+
+	SampleFormat() : bit_depth{}, floating_point{}
+	{
+	}
+
+	SampleFormat(unsigned bit_depth, bool floating_point = false) :
+		bit_depth{ bit_depth },
+		floating_point{ floating_point }
+	{
+	}
+};
+
 inline bool is_constant_format(const FrameFormat &format)
 {
 	return format.plane_count != 0;
 }
 
+inline ImageRect full_frame_rect(const FrameFormat &format)
+{
+	return{ 0, 0, format.plane[0].width, format.plane[0].height };
+}
+
+inline bool is_rect_in_frame(const FrameFormat &format, const ImageRect &rect)
+{
+	return rect.width && rect.height &&
+		rect.left < format.plane[0].width && rect.width <= format.plane[0].width - rect.left &&
+		rect.top < format.plane[0].height && rect.height <= format.plane[0].height - rect.top;
+}
+
+/**
+ * Map a rectangle to a plane subsampled by a factor of sw x sh, clipped to
+ * the plane dimensions.
+ */
+inline ImageRect subsample_rect(const ImageRect &rect, unsigned sw, unsigned sh, const PlaneFormat &plane)
+{
+	unsigned left = rect.left / sw;
+	unsigned top = rect.top / sh;
+	unsigned right = (rect.left + rect.width + sw - 1) / sw;
+	unsigned bottom = (rect.top + rect.height + sh - 1) / sh;
+
+	right = right < plane.width ? right : plane.width;
+	bottom = bottom < plane.height ? bottom : plane.height;
+
+	return{ left, top, right > left ? right - left : 0, bottom > top ? bottom - top : 0 };
+}
+
+/**
+ * Frame reduced by a factor in each dimension. Partial blocks at the right
+ * and bottom edges produce a sample.
+ */
+inline FrameFormat scale_frame_format(const FrameFormat &format, unsigned factor)
+{
+	FrameFormat scaled = format;
+
+	for (unsigned p = 0; p < format.plane_count; ++p) {
+		scaled.plane[p].width = (format.plane[p].width + factor - 1) / factor;
+		scaled.plane[p].height = (format.plane[p].height + factor - 1) / factor;
+	}
+	return scaled;
+}
+
+/**
+ * Frame with samples converted to a sample format, unless it keeps the
+ * samples of the frame.
+ */
+inline FrameFormat convert_frame_format(const FrameFormat &format, const SampleFormat &sample)
+{
+	FrameFormat converted = format;
+
+	for (unsigned p = 0; sample.bit_depth && p < format.plane_count; ++p) {
+		converted.plane[p].bit_depth = sample.bit_depth;
+		converted.plane[p].floating_point = sample.floating_point;
+	}
+	return converted;
+}
+
+/**
+ * Map a rectangle of a frame reduced by a factor to the full-size plane,
+ * clipped to the plane dimensions.
+ */
+inline ImageRect unscale_rect(const ImageRect &rect, unsigned factor, const PlaneFormat &plane)
+{
+	unsigned left = rect.left * factor;
+	unsigned top = rect.top * factor;
+	unsigned right = (rect.left + rect.width) * factor;
+	unsigned bottom = (rect.top + rect.height) * factor;
+
+	right = right < plane.width ? right : plane.width;
+	bottom = bottom < plane.height ? bottom : plane.height;
+
+	return{ left, top, right > left ? right - left : 0, bottom > top ? bottom - top : 0 };
+}
+
 inline bool is_chroma_plane(ColorFamily family, unsigned p)
 {
 	return (family == ColorFamily::YUV || family == ColorFamily::YCCK) && (p == 1 || p == 2);
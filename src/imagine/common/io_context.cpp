@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <cerrno>
+#include <memory>
+#include <new>
 #include "except.h"
 #include "io_context.h"
 
@@ -6,6 +9,11 @@ namespace imagine {
 
 IOContext::~IOContext() = default;
 
+bool IOContext::rewindable()
+{
+	return seekable();
+}
+
 void IOContext::read_all(void *buf, size_type count)
 {
 	difference_type where = tell();
@@ -44,4 +52,63 @@ void IOContext::write_all(const void *buf, size_type count)
 	}
 }
 
+void IOContext::discard(size_type count)
+{
+	const size_t buffer_size = 64UL * 1024;
+
+	if (!count)
+		return;
+	if (seekable()) {
+		seek_rel(count);
+		return;
+	}
+
+	const void *ptr;
+	size_type n;
+
+	while (count && (n = peek(&ptr, count))) {
+		consume(n);
+		count -= n;
+	}
+	if (!count)
+		return;
+
+	std::unique_ptr<char[]> buf;
+
+	try {
+		buf.reset(new char[static_cast<size_t>(std::min(count, static_cast<size_type>(buffer_size)))]);
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+
+	while (count) {
+		n = std::min(count, static_cast<size_type>(buffer_size));
+		read_all(buf.get(), n);
+		count -= n;
+	}
+}
+
+void IOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	difference_type pos = tell();
+
+	for (size_t i = 0; i < n; ++i) {
+		seek_set(ranges[i].off);
+		read_all(ranges[i].buf, ranges[i].count);
+	}
+	seek_set(pos);
+}
+
+auto IOContext::peek(const void **ptr, size_type) -> size_type
+{
+	*ptr = nullptr;
+	return 0;
+}
+
+void IOContext::consume(size_type count)
+{
+	if (count)
+		throw error::LogicError{ "consume without peek" };
+}
+
 } // namespace imagine
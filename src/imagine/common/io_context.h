@@ -3,6 +3,8 @@
 #ifndef IMAGINE_IO_CONTEXT_H_
 #define IMAGINE_IO_CONTEXT_H_
 
+#include <cstddef>
+
 struct imagine_io_context {
 	virtual ~imagine_io_context() = default;
 };
@@ -14,12 +16,25 @@ public:
 	typedef unsigned long long size_type;
 	typedef long long difference_type;
 
+	struct ReadRange {
+		difference_type off;
+		size_type count;
+		void *buf;
+	};
+
 	virtual ~IOContext() = 0;
 
 	virtual bool eof() = 0;
 
 	virtual bool seekable() = 0;
 
+	/**
+	 * Whether the stream can return to data already read, for sniffing the
+	 * content of a file. A non-seekable context may still be rewindable within
+	 * a bounded window.
+	 */
+	virtual bool rewindable();
+
 	virtual const char *path() const = 0;
 
 	virtual difference_type tell() = 0;
@@ -41,6 +56,34 @@ public:
 	virtual void read_all(void *buf, size_type count);
 
 	virtual void write_all(const void *buf, size_type count);
+
+	/**
+	 * Skip count bytes, seeking if possible and reading otherwise.
+	 */
+	virtual void discard(size_type count);
+
+	/**
+	 * Read a batch of byte ranges at absolute offsets.
+	 *
+	 * Each range is read in full, or EndOfFile is thrown. Adjacent ranges may
+	 * be combined into a single request. The file position is unchanged.
+	 */
+	virtual void read_ranges(const ReadRange *ranges, size_t n);
+
+	/**
+	 * Borrow up to count bytes from the backing store without copying.
+	 *
+	 * Returns the number of bytes available at *ptr, which is zero if the
+	 * context is not memory-backed. The pointer remains valid until the next
+	 * operation on the context other than consume. The file position is not
+	 * advanced.
+	 */
+	virtual size_type peek(const void **ptr, size_type count);
+
+	/**
+	 * Advance the file position past bytes obtained from peek.
+	 */
+	virtual void consume(size_type count);
 };
 
 } // namespace imagine
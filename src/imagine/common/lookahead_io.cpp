@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <utility>
+#include "except.h"
+#include "lookahead_io.h"
+
+namespace imagine {
+
+LookaheadIOContext::LookaheadIOContext(std::unique_ptr<IOContext> io, size_t window_size) :
+	m_io{ std::move(io) },
+	m_capacity{ window_size },
+	m_pos{},
+	m_stream_pos{},
+	m_eof{}
+{
+	try {
+		m_window.reserve(m_capacity);
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+}
+
+bool LookaheadIOContext::recording() const
+{
+	return static_cast<size_type>(m_stream_pos) == m_window.size();
+}
+
+size_t LookaheadIOContext::fill_window(size_type count)
+{
+	size_t size = m_window.size();
+	size_t n = static_cast<size_t>(std::min(count, static_cast<size_type>(m_capacity - size)));
+
+	try {
+		m_window.resize(size + n);
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+
+	try {
+		n = static_cast<size_t>(m_io->read(m_window.data() + size, n));
+	} catch (...) {
+		m_window.resize(size);
+		throw;
+	}
+
+	m_window.resize(size + n);
+	m_stream_pos += n;
+	return n;
+}
+
+void LookaheadIOContext::sync()
+{
+	// Carry out a pending forward seek, recording data while the window has room.
+	while (m_stream_pos < m_pos && recording() && m_window.size() < m_capacity) {
+		if (!fill_window(m_pos - m_stream_pos))
+			break;
+	}
+
+	if (m_stream_pos < m_pos) {
+		m_io->discard(m_pos - m_stream_pos);
+		m_stream_pos = m_pos;
+	}
+}
+
+bool LookaheadIOContext::eof()
+{
+	return m_eof;
+}
+
+bool LookaheadIOContext::seekable()
+{
+	return false;
+}
+
+bool LookaheadIOContext::rewindable()
+{
+	return recording();
+}
+
+const char *LookaheadIOContext::path() const
+{
+	return m_io->path();
+}
+
+auto LookaheadIOContext::tell() -> difference_type
+{
+	return m_pos;
+}
+
+auto LookaheadIOContext::size() -> size_type
+{
+	errno = 0;
+	throw error::SeekFailed{ "file size not known", path() };
+}
+
+auto LookaheadIOContext::seek_set(difference_type off) -> difference_type
+{
+	if (off < 0 || (off < m_stream_pos && !recording())) {
+		errno = 0;
+		throw error::SeekFailed{ "seek outside lookahead window", path(), off };
+	}
+
+	m_pos = off;
+	m_eof = false;
+	return m_pos;
+}
+
+auto LookaheadIOContext::seek_end(difference_type off) -> difference_type
+{
+	errno = 0;
+	throw error::SeekFailed{ "file size not known", path(), off };
+}
+
+auto LookaheadIOContext::seek_rel(difference_type off) -> difference_type
+{
+	return seek_set(m_pos + off);
+}
+
+auto LookaheadIOContext::read(void *buf, size_type count) -> size_type
+{
+	char *buf_p = static_cast<char *>(buf);
+	size_type total = 0;
+
+	sync();
+
+	while (total < count) {
+		difference_type window_end = static_cast<difference_type>(m_window.size());
+
+		if (m_pos < window_end) {
+			size_t n = static_cast<size_t>(std::min(count - total, static_cast<size_type>(window_end - m_pos)));
+			memcpy(buf_p + total, m_window.data() + m_pos, n);
+			m_pos += n;
+			total += n;
+		} else if (recording() && m_window.size() < m_capacity) {
+			if (!fill_window(count - total))
+				break;
+		} else {
+			size_type n = m_io->read(buf_p + total, count - total);
+			m_pos += n;
+			m_stream_pos += n;
+			total += n;
+			break;
+		}
+	}
+
+	if (total < count)
+		m_eof = true;
+
+	return total;
+}
+
+auto LookaheadIOContext::write(const void *, size_type count) -> size_type
+{
+	errno = 0;
+	throw error::WriteFailed{ "file not writable", path(), m_pos, count };
+}
+
+void LookaheadIOContext::flush()
+{
+}
+
+auto LookaheadIOContext::peek(const void **ptr, size_type count) -> size_type
+{
+	sync();
+
+	if (m_pos < static_cast<difference_type>(m_window.size())) {
+		*ptr = m_window.data() + m_pos;
+		return std::min(count, static_cast<size_type>(m_window.size() - m_pos));
+	}
+
+	return m_io->peek(ptr, count);
+}
+
+void LookaheadIOContext::consume(size_type count)
+{
+	if (m_pos < static_cast<difference_type>(m_window.size())) {
+		if (count > m_window.size() - m_pos) {
+			errno = 0;
+			throw error::EndOfFile{ "insufficient data in buffer", path(), tell(), count };
+		}
+		m_pos += count;
+		return;
+	}
+
+	m_io->consume(count);
+	m_pos += count;
+	m_stream_pos += count;
+}
+
+} // namespace imagine
@@ -0,0 +1,69 @@
+#pragma once
+
+#ifndef IMAGINE_LOOKAHEAD_IO_H_
+#define IMAGINE_LOOKAHEAD_IO_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "io_context.h"
+
+namespace imagine {
+
+/**
+ * Read-only context that makes a non-seekable stream rewindable near its start.
+ *
+ * The first bytes of the stream are recorded, so that seeks within them are
+ * possible until the stream is read past the recorded window. Forward seeks
+ * are always possible and discard data. Offsets are relative to the position
+ * of the stream when it was wrapped. The context is not seekable, so that
+ * decoders do not rely on random access, but is rewindable for probing.
+ */
+class LookaheadIOContext : public IOContext {
+	std::unique_ptr<IOContext> m_io;
+	std::vector<unsigned char> m_window;
+	size_t m_capacity;
+	difference_type m_pos;
+	difference_type m_stream_pos;
+	bool m_eof;
+
+	bool recording() const;
+	size_t fill_window(size_type count);
+	void sync();
+public:
+	static const size_t DEFAULT_WINDOW_SIZE = 64UL * 1024;
+
+	explicit LookaheadIOContext(std::unique_ptr<IOContext> io, size_t window_size = DEFAULT_WINDOW_SIZE);
+
+	bool eof() override;
+
+	bool seekable() override;
+
+	bool rewindable() override;
+
+	const char *path() const override;
+
+	difference_type tell() override;
+
+	size_type size() override;
+
+	difference_type seek_set(difference_type off) override;
+
+	difference_type seek_end(difference_type off) override;
+
+	difference_type seek_rel(difference_type off) override;
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type write(const void *buf, size_type count) override;
+
+	void flush() override;
+
+	size_type peek(const void **ptr, size_type count) override;
+
+	void consume(size_type count) override;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_LOOKAHEAD_IO_H_
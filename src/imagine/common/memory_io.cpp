@@ -110,4 +110,28 @@ void MemoryIOContext::write_all(const void *buf, size_type count)
 	write(buf, count);
 }
 
+void MemoryIOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		const ReadRange &range = ranges[i];
+
+		if (range.off < 0 || static_cast<size_type>(range.off) > m_size || range.count > m_size - range.off)
+			throw error::EndOfFile{ "insufficient data in buffer", path(), range.off, range.count };
+		memcpy(range.buf, static_cast<const char *>(m_ptr) + range.off, static_cast<size_t>(range.count));
+	}
+}
+
+auto MemoryIOContext::peek(const void **ptr, size_type count) -> size_type
+{
+	*ptr = static_cast<const char *>(m_ptr) + m_pos;
+	return std::min(count, static_cast<size_type>(m_size - m_pos));
+}
+
+void MemoryIOContext::consume(size_type count)
+{
+	if (count > m_size - m_pos)
+		throw error::EndOfFile{ "insufficient data in buffer", path(), tell(), count };
+	m_pos += static_cast<size_t>(count);
+}
+
 } // namespace imagine
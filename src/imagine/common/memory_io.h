@@ -44,6 +44,12 @@ public:
 	void read_all(void *buf, size_type count) override;
 
 	void write_all(const void *buf, size_type count) override;
+
+	void read_ranges(const ReadRange *ranges, size_t n) override;
+
+	size_type peek(const void **ptr, size_type count) override;
+
+	void consume(size_type count) override;
 };
 
 } // namespace imagine
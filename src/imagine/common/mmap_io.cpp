@@ -0,0 +1,125 @@
+#ifndef _WIN32
+  #define _FILE_OFFSET_BITS 64
+#endif // _WIN32
+
+#include <cerrno>
+#include <cstdint>
+#include <utility>
+#include "except.h"
+#include "mmap_io.h"
+
+#ifdef _WIN32
+  #define WIN32_LEAN_AND_MEAN
+  #define NOMINMAX
+  #include <Windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/types.h>
+  #include <unistd.h>
+#endif // _WIN32
+
+namespace imagine {
+namespace {
+
+#ifdef _WIN32
+struct close_handle {
+	void operator()(HANDLE handle)
+	{
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+	}
+};
+
+typedef std::unique_ptr<void, close_handle> Win32Handle;
+
+FileMapping map_file(const char *path)
+{
+	Win32Handle file{ CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr) };
+	if (file.get() == INVALID_HANDLE_VALUE)
+		throw error::CannotOpenFile{ "error opening file", path };
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file.get(), &size))
+		throw error::CannotOpenFile{ "unable to determine file size", path };
+	if (static_cast<unsigned long long>(size.QuadPart) > SIZE_MAX) {
+		errno = 0;
+		throw error::CannotOpenFile{ "file too large to map", path };
+	}
+	if (!size.QuadPart)
+		return{};
+
+	Win32Handle mapping{ CreateFileMappingA(file.get(), nullptr, PAGE_READONLY, 0, 0, nullptr) };
+	if (!mapping)
+		throw error::CannotOpenFile{ "error mapping file", path };
+
+	void *ptr = MapViewOfFile(mapping.get(), FILE_MAP_READ, 0, 0, 0);
+	if (!ptr)
+		throw error::CannotOpenFile{ "error mapping file", path };
+
+	return{ ptr, static_cast<size_t>(size.QuadPart) };
+}
+#else
+struct FileDescriptor {
+	int fd;
+
+	~FileDescriptor()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+};
+
+FileMapping map_file(const char *path)
+{
+	FileDescriptor file{ open(path, O_RDONLY) };
+	if (file.fd < 0)
+		throw error::CannotOpenFile{ "error opening file", path };
+
+	struct stat st;
+	if (fstat(file.fd, &st))
+		throw error::CannotOpenFile{ "unable to determine file size", path };
+	if (!S_ISREG(st.st_mode)) {
+		errno = 0;
+		throw error::CannotOpenFile{ "file not mappable", path };
+	}
+	if (static_cast<unsigned long long>(st.st_size) > SIZE_MAX) {
+		errno = 0;
+		throw error::CannotOpenFile{ "file too large to map", path };
+	}
+	if (!st.st_size)
+		return{};
+
+	void *ptr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, file.fd, 0);
+	if (ptr == MAP_FAILED)
+		throw error::CannotOpenFile{ "error mapping file", path };
+
+	return{ ptr, static_cast<size_t>(st.st_size) };
+}
+#endif // _WIN32
+
+} // namespace
+
+
+void FileMapping::unmap_file::operator()(void *ptr)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(ptr);
+#else
+	munmap(ptr, size);
+#endif // _WIN32
+}
+
+MmapIOContext::MmapIOContext(FileMapping mapping, const std::string &path) :
+	MemoryIOContext{ mapping.data(), mapping.size(), path },
+	m_mapping{ std::move(mapping) }
+{
+}
+
+MmapIOContext::MmapIOContext(const std::string &path) :
+	MmapIOContext{ map_file(path.c_str()), path }
+{
+}
+
+} // namespace imagine
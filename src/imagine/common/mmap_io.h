@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef IMAGINE_MMAP_IO_H_
+#define IMAGINE_MMAP_IO_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "memory_io.h"
+
+namespace imagine {
+
+class FileMapping {
+	struct unmap_file {
+		void operator()(void *ptr);
+		size_t size;
+	};
+
+	std::unique_ptr<void, unmap_file> m_ptr;
+public:
+	FileMapping() = default;
+
+	FileMapping(void *ptr, size_t size) :
+		m_ptr{ ptr, { size } }
+	{
+	}
+
+	const void *data() const { return m_ptr.get(); }
+	size_t size() const { return m_ptr ? m_ptr.get_deleter().size : 0; }
+
+	explicit operator bool() { return !!m_ptr; }
+};
+
+/**
+ * Read-only file context backed by a memory mapping of the whole file.
+ */
+class MmapIOContext : public MemoryIOContext {
+	FileMapping m_mapping;
+public:
+	MmapIOContext(FileMapping mapping, const std::string &path);
+
+	explicit MmapIOContext(const std::string &path);
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_MMAP_IO_H_
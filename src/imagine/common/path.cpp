@@ -21,10 +21,13 @@ bool eq_case_insensitive(const char *a, const char *b, const std::locale &loc)
 
 bool is_matching_extension(const char *path, const char * const *extensions, size_t num_extensions)
 {
-	const char *ptr = std::strrchr(path, '.');
+	const char *ptr = path ? std::strrchr(path, '.') : nullptr;
 	if (!ptr)
 		return false;
 
+	// Skip the dot.
+	++ptr;
+
 	const std::locale &loc_classic = std::locale::classic();
 
 	for (size_t i = 0; i < num_extensions; ++i) {
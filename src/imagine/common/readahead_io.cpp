@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <utility>
+#include "except.h"
+#include "readahead_io.h"
+
+namespace imagine {
+namespace {
+
+const size_t MIN_BUFFER_SIZE = 4096;
+
+} // namespace
+
+
+const size_t ReadaheadIOContext::DEFAULT_BUFFER_SIZE;
+
+ReadaheadIOContext::ReadaheadIOContext(std::unique_ptr<IOContext> io, size_t buffer_size) :
+	m_io{ std::move(io) },
+	m_capacity{ std::max(buffer_size, MIN_BUFFER_SIZE) },
+	m_size{},
+	m_seekable{ m_io->seekable() },
+	m_offset{},
+	m_eof{},
+	m_head{},
+	m_fill{},
+	m_held{},
+	m_io_eof{},
+	m_stop{}
+{
+	if (m_seekable) {
+		m_size = m_io->size();
+		m_offset = m_io->tell();
+	}
+
+	m_buffer.reset(new unsigned char[m_capacity]);
+	start(-1);
+}
+
+ReadaheadIOContext::~ReadaheadIOContext()
+{
+	stop();
+}
+
+void ReadaheadIOContext::start(difference_type seek_pos)
+{
+	m_head = 0;
+	m_fill = 0;
+	m_held = 0;
+	m_io_eof = false;
+	m_stop = false;
+	m_error = nullptr;
+
+	try {
+		m_thread = std::thread{ &ReadaheadIOContext::thread_func, this, seek_pos };
+	} catch (const std::system_error &) {
+		throw error::InternalError{ "error creating read-ahead thread" };
+	}
+}
+
+void ReadaheadIOContext::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_stop = true;
+	}
+	m_space_cond.notify_all();
+
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+void ReadaheadIOContext::thread_func(difference_type seek_pos)
+{
+	// Refill in chunks so that the consumer is woken before the buffer is full.
+	size_t chunk = m_capacity / 4;
+
+	try {
+		if (seek_pos >= 0)
+			m_io->seek_set(seek_pos);
+
+		while (true) {
+			size_t tail;
+			size_t space;
+
+			{
+				std::unique_lock<std::mutex> lock{ m_mutex };
+				m_space_cond.wait(lock, [&]() { return m_stop || m_fill + m_held < m_capacity; });
+				if (m_stop)
+					return;
+
+				tail = (m_head + m_fill) % m_capacity;
+				space = std::min(m_capacity - tail, m_capacity - m_fill - m_held);
+			}
+
+			// The consumer never touches the range past the filled region.
+			size_t n = static_cast<size_t>(m_io->read(m_buffer.get() + tail, std::min(space, chunk)));
+
+			{
+				std::lock_guard<std::mutex> lock{ m_mutex };
+				m_fill += n;
+				m_io_eof = !n;
+			}
+			m_data_cond.notify_one();
+
+			if (!n)
+				return;
+		}
+	} catch (...) {
+		{
+			std::lock_guard<std::mutex> lock{ m_mutex };
+			m_error = std::current_exception();
+			m_io_eof = true;
+		}
+		m_data_cond.notify_one();
+	}
+}
+
+size_t ReadaheadIOContext::wait_data()
+{
+	release();
+
+	std::unique_lock<std::mutex> lock{ m_mutex };
+	m_data_cond.wait(lock, [&]() { return m_fill || m_io_eof; });
+
+	if (!m_fill && m_error)
+		std::rethrow_exception(m_error);
+
+	return std::min(m_fill, m_capacity - m_head);
+}
+
+void ReadaheadIOContext::drop(size_t count, bool hold)
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_head = (m_head + count) % m_capacity;
+		m_fill -= count;
+		if (hold)
+			m_held += count;
+	}
+	if (!hold)
+		m_space_cond.notify_one();
+
+	m_offset += count;
+}
+
+void ReadaheadIOContext::release()
+{
+	// Bytes passed to consume stay reserved until the next operation, so
+	// that the pointer obtained from peek remains valid.
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		if (!m_held)
+			return;
+		m_held = 0;
+	}
+	m_space_cond.notify_one();
+}
+
+auto ReadaheadIOContext::seek_to(difference_type pos, difference_type off) -> difference_type
+{
+	if (!m_seekable) {
+		errno = 0;
+		throw error::SeekFailed{ "file not seekable", path(), off };
+	}
+	if (pos < 0) {
+		errno = EINVAL;
+		throw error::SeekFailed{ "seek out of bounds", path(), off };
+	}
+
+	release();
+
+	size_t fill;
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		fill = m_fill;
+	}
+
+	if (pos >= m_offset && static_cast<size_type>(pos - m_offset) <= fill) {
+		drop(static_cast<size_t>(pos - m_offset), false);
+	} else {
+		stop();
+		start(pos);
+		m_offset = pos;
+	}
+
+	m_eof = false;
+	return m_offset;
+}
+
+bool ReadaheadIOContext::eof()
+{
+	return m_eof;
+}
+
+bool ReadaheadIOContext::seekable()
+{
+	return m_seekable;
+}
+
+const char *ReadaheadIOContext::path() const
+{
+	return m_io->path();
+}
+
+auto ReadaheadIOContext::tell() -> difference_type
+{
+	return m_offset;
+}
+
+auto ReadaheadIOContext::size() -> size_type
+{
+	if (!m_seekable) {
+		errno = 0;
+		throw error::SeekFailed{ "file not seekable", path() };
+	}
+	return m_size;
+}
+
+auto ReadaheadIOContext::seek_set(difference_type off) -> difference_type
+{
+	return seek_to(off, off);
+}
+
+auto ReadaheadIOContext::seek_end(difference_type off) -> difference_type
+{
+	return seek_to(static_cast<difference_type>(size()) + off, off);
+}
+
+auto ReadaheadIOContext::seek_rel(difference_type off) -> difference_type
+{
+	return seek_to(m_offset + off, off);
+}
+
+auto ReadaheadIOContext::read(void *buf, size_type count) -> size_type
+{
+	char *buf_p = static_cast<char *>(buf);
+	size_type total = 0;
+
+	while (total < count) {
+		size_t avail = wait_data();
+		if (!avail) {
+			m_eof = true;
+			break;
+		}
+
+		size_t n = static_cast<size_t>(std::min(static_cast<size_type>(avail), count - total));
+		memcpy(buf_p + total, m_buffer.get() + m_head, n);
+		drop(n, false);
+		total += n;
+	}
+
+	return total;
+}
+
+auto ReadaheadIOContext::write(const void *, size_type count) -> size_type
+{
+	errno = 0;
+	throw error::WriteFailed{ "file not writable", path(), m_offset, count };
+}
+
+void ReadaheadIOContext::flush()
+{
+}
+
+auto ReadaheadIOContext::peek(const void **ptr, size_type count) -> size_type
+{
+	size_t avail = wait_data();
+	*ptr = avail ? m_buffer.get() + m_head : nullptr;
+	return std::min(count, static_cast<size_type>(avail));
+}
+
+void ReadaheadIOContext::consume(size_type count)
+{
+	size_t fill;
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		fill = m_fill;
+	}
+
+	if (count > fill) {
+		errno = 0;
+		throw error::EndOfFile{ "insufficient data in buffer", path(), tell(), count };
+	}
+	drop(static_cast<size_t>(count), true);
+}
+
+} // namespace imagine
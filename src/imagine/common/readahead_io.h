@@ -0,0 +1,92 @@
+#pragma once
+
+#ifndef IMAGINE_READAHEAD_IO_H_
+#define IMAGINE_READAHEAD_IO_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "io_context.h"
+
+namespace imagine {
+
+/**
+ * Read-only context that reads ahead of the consumer on a background thread.
+ *
+ * Data from the underlying context is staged in a ring buffer, so that I/O
+ * on the wrapped file overlaps with decoding. Seeking outside the buffered
+ * range restarts the read-ahead at the new position. The underlying context
+ * must not be accessed by the caller once wrapped.
+ */
+class ReadaheadIOContext : public IOContext {
+	std::unique_ptr<IOContext> m_io;
+	std::unique_ptr<unsigned char[]> m_buffer;
+	size_t m_capacity;
+	size_type m_size;
+	bool m_seekable;
+
+	// Consumer state.
+	difference_type m_offset;
+	bool m_eof;
+
+	// Shared state, protected by m_mutex.
+	std::mutex m_mutex;
+	std::condition_variable m_data_cond;
+	std::condition_variable m_space_cond;
+	size_t m_head;
+	size_t m_fill;
+	size_t m_held;
+	bool m_io_eof;
+	bool m_stop;
+	std::exception_ptr m_error;
+
+	std::thread m_thread;
+
+	void start(difference_type seek_pos);
+	void stop();
+	void thread_func(difference_type seek_pos);
+
+	size_t wait_data();
+	void drop(size_t count, bool hold);
+	void release();
+	difference_type seek_to(difference_type pos, difference_type off);
+public:
+	static const size_t DEFAULT_BUFFER_SIZE = 1UL << 20;
+
+	explicit ReadaheadIOContext(std::unique_ptr<IOContext> io, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+
+	~ReadaheadIOContext();
+
+	bool eof() override;
+
+	bool seekable() override;
+
+	const char *path() const override;
+
+	difference_type tell() override;
+
+	size_type size() override;
+
+	difference_type seek_set(difference_type off) override;
+
+	difference_type seek_end(difference_type off) override;
+
+	difference_type seek_rel(difference_type off) override;
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type write(const void *buf, size_type count) override;
+
+	void flush() override;
+
+	size_type peek(const void **ptr, size_type count) override;
+
+	void consume(size_type count) override;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_READAHEAD_IO_H_
@@ -0,0 +1,148 @@
+#include <chrono>
+#include <utility>
+#include "stats_io.h"
+
+namespace imagine {
+namespace {
+
+class ScopedTimer {
+	typedef std::chrono::steady_clock clock;
+
+	unsigned long long &m_total;
+	clock::time_point m_start;
+public:
+	explicit ScopedTimer(unsigned long long &total) : m_total(total), m_start{ clock::now() }
+	{
+	}
+
+	~ScopedTimer()
+	{
+		m_total += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - m_start).count();
+	}
+};
+
+} // namespace
+
+
+StatsIOContext::StatsIOContext(std::unique_ptr<IOContext> io) : m_io{ std::move(io) }
+{
+}
+
+bool StatsIOContext::eof()
+{
+	return m_io->eof();
+}
+
+bool StatsIOContext::seekable()
+{
+	return m_io->seekable();
+}
+
+bool StatsIOContext::rewindable()
+{
+	return m_io->rewindable();
+}
+
+const char *StatsIOContext::path() const
+{
+	return m_io->path();
+}
+
+auto StatsIOContext::tell() -> difference_type
+{
+	return m_io->tell();
+}
+
+auto StatsIOContext::size() -> size_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	return m_io->size();
+}
+
+auto StatsIOContext::seek_set(difference_type off) -> difference_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.seek_calls;
+	return m_io->seek_set(off);
+}
+
+auto StatsIOContext::seek_end(difference_type off) -> difference_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.seek_calls;
+	return m_io->seek_end(off);
+}
+
+auto StatsIOContext::seek_rel(difference_type off) -> difference_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.seek_calls;
+	return m_io->seek_rel(off);
+}
+
+auto StatsIOContext::read(void *buf, size_type count) -> size_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.read_calls;
+
+	size_type n = m_io->read(buf, count);
+	m_stats.bytes_read += n;
+	return n;
+}
+
+auto StatsIOContext::write(const void *buf, size_type count) -> size_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+	return m_io->write(buf, count);
+}
+
+void StatsIOContext::flush()
+{
+	ScopedTimer timer{ m_stats.io_time };
+	m_io->flush();
+}
+
+void StatsIOContext::read_all(void *buf, size_type count)
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.read_calls;
+
+	m_io->read_all(buf, count);
+	m_stats.bytes_read += count;
+}
+
+void StatsIOContext::discard(size_type count)
+{
+	ScopedTimer timer{ m_stats.io_time };
+	m_io->discard(count);
+	m_stats.bytes_discarded += count;
+}
+
+void StatsIOContext::read_ranges(const ReadRange *ranges, size_t n)
+{
+	ScopedTimer timer{ m_stats.io_time };
+	++m_stats.read_calls;
+
+	m_io->read_ranges(ranges, n);
+	for (size_t i = 0; i < n; ++i) {
+		m_stats.bytes_read += ranges[i].count;
+	}
+}
+
+auto StatsIOContext::peek(const void **ptr, size_type count) -> size_type
+{
+	ScopedTimer timer{ m_stats.io_time };
+
+	size_type n = m_io->peek(ptr, count);
+	if (n)
+		++m_stats.read_calls;
+	return n;
+}
+
+void StatsIOContext::consume(size_type count)
+{
+	m_io->consume(count);
+	m_stats.bytes_read += count;
+}
+
+} // namespace imagine
@@ -0,0 +1,75 @@
+#pragma once
+
+#ifndef IMAGINE_STATS_IO_H_
+#define IMAGINE_STATS_IO_H_
+
+#include <memory>
+#include "io_context.h"
+
+namespace imagine {
+
+struct IOStats {
+	unsigned long long read_calls;
+	unsigned long long bytes_read;
+	unsigned long long seek_calls;
+	unsigned long long bytes_discarded;
+	// Wall time spent in the underlying context, in nanoseconds.
+	unsigned long long io_time;
+
+	IOStats() : read_calls{}, bytes_read{}, seek_calls{}, bytes_discarded{}, io_time{}
+	{
+	}
+};
+
+/**
+ * Context that forwards to another context and records its usage.
+ *
+ * Bytes obtained through peek are counted as read when consumed. The
+ * statistics are not synchronized with concurrent use of the context.
+ */
+class StatsIOContext : public IOContext {
+	std::unique_ptr<IOContext> m_io;
+	IOStats m_stats;
+public:
+	explicit StatsIOContext(std::unique_ptr<IOContext> io);
+
+	const IOStats &stats() const { return m_stats; }
+
+	bool eof() override;
+
+	bool seekable() override;
+
+	bool rewindable() override;
+
+	const char *path() const override;
+
+	difference_type tell() override;
+
+	size_type size() override;
+
+	difference_type seek_set(difference_type off) override;
+
+	difference_type seek_end(difference_type off) override;
+
+	difference_type seek_rel(difference_type off) override;
+
+	size_type read(void *buf, size_type count) override;
+
+	size_type write(const void *buf, size_type count) override;
+
+	void flush() override;
+
+	void read_all(void *buf, size_type count) override;
+
+	void discard(size_type count) override;
+
+	void read_ranges(const ReadRange *ranges, size_t n) override;
+
+	size_type peek(const void **ptr, size_type count) override;
+
+	void consume(size_type count) override;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_STATS_IO_H_
@@ -0,0 +1,90 @@
+#include <algorithm>
+#include <cstdint>
+#include "align.h"
+#include "decoder.h"
+#include "except.h"
+#include "strip_buffer.h"
+
+namespace imagine {
+namespace {
+
+size_t row_bytes(const PlaneFormat &plane, unsigned channels = 1)
+{
+	return ceil_n(static_cast<size_t>(plane.width) * channels * (ceil_n(plane.bit_depth, 8) / 8), ALIGNMENT);
+}
+
+// Rows of plane p spanned by rows of plane 0, allowing for a partial sample at either end.
+size_t plane_rows(const FrameFormat &format, unsigned p, unsigned rows)
+{
+	const PlaneFormat &plane = format.plane[p];
+	size_t base_height = std::max(format.plane[0].height, 1U);
+	size_t n = (static_cast<size_t>(rows) * plane.height + base_height - 1) / base_height + (p ? 1 : 0);
+
+	return std::min(n, static_cast<size_t>(plane.height));
+}
+
+} // namespace
+
+
+StripBuffer::StripBuffer(Allocator *allocator) :
+	m_data(allocator),
+	m_rows{}
+{
+}
+
+size_t StripBuffer::scratch_bytes(const FrameFormat &format, unsigned rows, const OutputLayout &layout)
+{
+	if (layout.interleaved)
+		return row_bytes(format.plane[0], format.plane_count) * rows;
+
+	size_t bytes = 0;
+
+	for (unsigned p = 0; p < format.plane_count; ++p) {
+		bytes += row_bytes(format.plane[p]) * plane_rows(format, p, rows);
+	}
+	return bytes;
+}
+
+void StripBuffer::reset(const FrameFormat &format, unsigned rows, const OutputLayout &layout) try
+{
+	size_t offset[MAX_PLANE_COUNT] = {};
+	size_t size = 0;
+
+	m_buffer = OutputBuffer{};
+	m_rows = rows;
+
+	// All planes share buffer 0.
+	if (layout.interleaved) {
+		m_data.resize(row_bytes(format.plane[0], format.plane_count) * rows);
+		m_buffer.data[0] = m_data.data();
+		m_buffer.stride[0] = row_bytes(format.plane[0], format.plane_count);
+		return;
+	}
+
+	for (unsigned p = 0; p < format.plane_count; ++p) {
+		offset[p] = size;
+		size += row_bytes(format.plane[p]) * plane_rows(format, p, rows);
+	}
+	m_data.resize(size);
+
+	for (unsigned p = 0; p < format.plane_count; ++p) {
+		m_buffer.data[p] = m_data.data() + offset[p];
+		m_buffer.stride[p] = row_bytes(format.plane[p]);
+	}
+} catch (const std::bad_alloc &) {
+	throw error::OutOfMemory{};
+}
+
+void StripBuffer::set_allocator(Allocator *allocator)
+{
+	m_data = ScratchVector<uint8_t>(allocator);
+	m_buffer = OutputBuffer{};
+	m_rows = 0;
+}
+
+bool StripBuffer::flush(RowSink &sink, unsigned top, unsigned height) const
+{
+	return sink.write_rows(m_buffer, top, height);
+}
+
+} // namespace imagine
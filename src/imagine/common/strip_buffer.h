@@ -0,0 +1,58 @@
+#pragma once
+
+#ifndef IMAGINE_STRIP_BUFFER_H_
+#define IMAGINE_STRIP_BUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include "allocator.h"
+#include "buffer.h"
+#include "format.h"
+
+namespace imagine {
+
+class RowSink;
+
+/**
+ * Holds a band of rows of each plane while a frame is passed to a RowSink,
+ * so that memory use is proportional to the band rather than the frame.
+ * Decoders write the band into buffer, starting at its first row, and then
+ * flush it.
+ */
+class StripBuffer {
+	ScratchVector<uint8_t> m_data;
+	OutputBuffer m_buffer;
+	unsigned m_rows;
+public:
+	explicit StripBuffer(Allocator *allocator);
+
+	/**
+	 * Memory needed for bands of a given number of rows of plane 0.
+	 */
+	static size_t scratch_bytes(const FrameFormat &format, unsigned rows, const OutputLayout &layout = OutputLayout{});
+
+	/**
+	 * Allocate bands of a given number of rows of plane 0. Subsampled planes
+	 * receive the corresponding number of rows.
+	 */
+	void reset(const FrameFormat &format, unsigned rows, const OutputLayout &layout = OutputLayout{});
+
+	/**
+	 * Replace the allocator, releasing the band.
+	 */
+	void set_allocator(Allocator *allocator);
+
+	const OutputBuffer &buffer() const { return m_buffer; }
+
+	unsigned rows() const { return m_rows; }
+
+	/**
+	 * Pass the band to sink as rows [top, top + height) of plane 0. Returns
+	 * false if sink stopped decoding.
+	 */
+	bool flush(RowSink &sink, unsigned top, unsigned height) const;
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_STRIP_BUFFER_H_
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <system_error>
+#include <utility>
+#include "except.h"
+#include "thread_pool.h"
+
+namespace imagine {
+namespace {
+
+// Indices are dealt round-robin to one slot per participant. Each participant
+// takes work from the front of its own slot and steals from the back of the
+// others once it runs out, so that a slow item or a helper that never starts
+// does not hold up the rest.
+struct ParallelForState {
+	struct Slot {
+		std::mutex mutex;
+		size_t head;
+		size_t tail;
+
+		Slot() : head{}, tail{} {}
+	};
+
+	std::function<void(size_t)> func;
+	size_t n;
+	std::vector<Slot> slots;
+	std::atomic<size_t> next_slot;
+	size_t done;
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	ParallelForState(std::function<void(size_t)> func, size_t n, size_t num_slots) :
+		func(std::move(func)),
+		n{ n },
+		slots(num_slots),
+		next_slot{},
+		done{}
+	{
+		for (size_t s = 0; s < num_slots; ++s) {
+			slots[s].tail = (n - s + num_slots - 1) / num_slots;
+		}
+	}
+
+	size_t index(size_t s, size_t pos) const { return s + pos * slots.size(); }
+
+	bool pop_front(size_t s, size_t *i)
+	{
+		std::lock_guard<std::mutex> lock{ slots[s].mutex };
+		if (slots[s].head == slots[s].tail)
+			return false;
+
+		*i = index(s, slots[s].head++);
+		return true;
+	}
+
+	bool pop_back(size_t s, size_t *i)
+	{
+		std::lock_guard<std::mutex> lock{ slots[s].mutex };
+		if (slots[s].head == slots[s].tail)
+			return false;
+
+		*i = index(s, --slots[s].tail);
+		return true;
+	}
+
+	bool steal(size_t thief, size_t *i)
+	{
+		for (size_t k = 1; k <= slots.size(); ++k) {
+			if (pop_back((thief + k) % slots.size(), i))
+				return true;
+		}
+		return false;
+	}
+
+	void run()
+	{
+		size_t s = next_slot++;
+		size_t count = 0;
+		size_t i;
+
+		while ((s < slots.size() && pop_front(s, &i)) || steal(s, &i)) {
+			func(i);
+			++count;
+		}
+
+		if (count) {
+			std::lock_guard<std::mutex> lock{ mutex };
+			done += count;
+			if (done == n)
+				cond.notify_all();
+		}
+	}
+};
+
+} // namespace
+
+
+ThreadPool &ThreadPool::default_pool()
+{
+	// Never destroyed, as joining workers during static destruction can
+	// deadlock when the library is unloaded.
+	try {
+		static ThreadPool *pool = new ThreadPool{};
+		return *pool;
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+}
+
+ThreadPool::ThreadPool(unsigned num_threads) : m_stop{}
+{
+	if (!num_threads)
+		num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+	try {
+		m_threads.reserve(num_threads);
+		for (unsigned i = 0; i < num_threads; ++i) {
+			m_threads.emplace_back(&ThreadPool::thread_func, this);
+		}
+	} catch (const std::system_error &) {
+		stop();
+		throw error::InternalError{ "error creating worker thread" };
+	} catch (const std::bad_alloc &) {
+		stop();
+		throw error::OutOfMemory{};
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+void ThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+		m_stop = true;
+	}
+	m_cond.notify_all();
+
+	for (std::thread &thread : m_threads) {
+		thread.join();
+	}
+	m_threads.clear();
+}
+
+void ThreadPool::thread_func()
+{
+	while (true) {
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock{ m_mutex };
+			m_cond.wait(lock, [&]() { return m_stop || !m_queue.empty(); });
+			if (m_queue.empty())
+				return;
+
+			task = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		task();
+	}
+}
+
+unsigned ThreadPool::num_threads() const
+{
+	return static_cast<unsigned>(m_threads.size());
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock{ m_mutex };
+
+		try {
+			m_queue.push_back(std::move(task));
+		} catch (const std::bad_alloc &) {
+			throw error::OutOfMemory{};
+		}
+	}
+	m_cond.notify_one();
+}
+
+void ThreadPool::parallel_for(size_t n, std::function<void(size_t)> func)
+{
+	if (!n)
+		return;
+
+	// Helpers that start after the work is exhausted return immediately.
+	size_t helpers = std::min(n - 1, m_threads.size());
+	std::shared_ptr<ParallelForState> state;
+
+	try {
+		state = std::make_shared<ParallelForState>(std::move(func), n, helpers + 1);
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+
+	for (size_t i = 0; i < helpers; ++i) {
+		// The calling thread completes the work on its own if need be.
+		try {
+			submit([state]() { state->run(); });
+		} catch (const error::OutOfMemory &) {
+			break;
+		}
+	}
+
+	state->run();
+
+	std::unique_lock<std::mutex> lock{ state->mutex };
+	state->cond.wait(lock, [&]() { return state->done == state->n; });
+}
+
+} // namespace imagine
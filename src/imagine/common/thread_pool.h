@@ -0,0 +1,59 @@
+#pragma once
+
+#ifndef IMAGINE_THREAD_POOL_H_
+#define IMAGINE_THREAD_POOL_H_
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace imagine {
+
+/**
+ * Fixed set of worker threads executing queued tasks in FIFO order.
+ *
+ * Tasks must not throw. The destructor completes all queued tasks before
+ * joining the workers.
+ */
+class ThreadPool {
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()>> m_queue;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop;
+
+	void thread_func();
+	void stop();
+public:
+	/**
+	 * Library worker pool for asynchronous operations, created on first use.
+	 */
+	static ThreadPool &default_pool();
+
+	/**
+	 * @param num_threads number of workers, or 0 to match the hardware
+	 */
+	explicit ThreadPool(unsigned num_threads = 0);
+
+	~ThreadPool();
+
+	unsigned num_threads() const;
+
+	void submit(std::function<void()> task);
+
+	/**
+	 * Call func for every index in [0, n) and wait for completion. The
+	 * calling thread takes part in the work, so this may be used from within
+	 * a task. Indices are started roughly in ascending order, with idle
+	 * threads stealing work from busy ones. func must not throw.
+	 */
+	void parallel_for(size_t n, std::function<void(size_t)> func);
+};
+
+} // namespace imagine
+
+#endif // IMAGINE_THREAD_POOL_H_
@@ -7,6 +7,8 @@
 #include <vector>
 #include "libp2p/p2p.h"
 #include "common/align.h"
+#include "common/allocator.h"
+#include "common/box_filter.h"
 #include "common/buffer.h"
 #include "common/decoder.h"
 #include "common/except.h"
@@ -14,6 +16,7 @@
 #include "common/io_context.h"
 #include "common/im_assert.h"
 #include "common/path.h"
+#include "common/strip_buffer.h"
 #include "bmp_decoder.h"
 
 #ifdef _MSC_VER
@@ -44,6 +47,9 @@ const size_t BITMAPV5HEADER_SIZE = 124;
 
 const uint16_t BITMAP_MAGIC = ('M' << 8) | 'B';
 
+// Rows per band passed to a RowSink.
+const unsigned BAND_ROWS = 16;
+
 #if BYTE_ORDER == BIG_ENDIAN
 uint16_t to_le(uint16_t x) { return __builtin_bswap16(x); }
 int32_t to_le(int32_t x) { return __builtin_bswap32(x); }
@@ -251,30 +257,22 @@ void biheader_to_le(BITMAPV5HEADER &bi)
 }
 
 
-void discard_from_io(IOContext *io, IOContext::size_type count)
+bool probe_bmp(const void *buf, size_t size)
 {
-	char buf[1024];
+	const uint8_t *vec = static_cast<const uint8_t *>(buf);
 
-	while (count) {
-		IOContext::size_type n = std::min(count, static_cast<IOContext::size_type>(sizeof(buf)));
-		io->read_all(buf, n);
-		count -= n;
-	}
+	// BMP marker bytes.
+	return size >= 2 && vec[0] == 'B' && vec[1] == 'M';
 }
 
 bool recognize_bmp(IOContext *io)
 {
 	uint8_t vec[2];
 	IOContext::difference_type pos = io->tell();
-	bool ret = false;
-
-	io->read_all(vec, sizeof(vec));
-	// BMP marker bytes.
-	if (vec[0] == 'B' && vec[1] == 'M')
-		ret = true;
+	size_t n = static_cast<size_t>(io->read(vec, sizeof(vec)));
 
 	io->seek_set(pos);
-	return ret;
+	return probe_bmp(vec, n);
 }
 
 BitmapVersion check_bi_size(DWORD sz)
@@ -308,7 +306,7 @@ std::pair<unsigned, unsigned> decode_bitfield(DWORD bitfield)
 }
 
 template <unsigned N>
-void depalettize(void * const dst[3], const void *src, DWORD width, const RGBQUAD pal[256])
+void depalettize(void * const dst[3], const void *src, DWORD offset, DWORD width, const RGBQUAD pal[256])
 {
 	const unsigned mask = lsb_mask<unsigned>(N);
 
@@ -316,7 +314,8 @@ void depalettize(void * const dst[3], const void *src, DWORD width, const RGBQUA
 	const uint8_t *src_p = static_cast<const uint8_t *>(src);
 
 	for (DWORD i = 0; i < width; ++i) {
-		unsigned x = (src_p[(i * N) / 8] >> (8 - N - (i * N) % 8)) & mask;
+		DWORD j = offset + i;
+		unsigned x = (src_p[(j * N) / 8] >> (8 - N - (j * N) % 8)) & mask;
 		RGBQUAD val = pal[x];
 
 		dst_p[0][i] = val.rgbRed;
@@ -351,9 +350,13 @@ class BMPDecoder : public ImageDecoder {
 	BitmapVersion m_bmp_version;
 	RGBQUAD m_palette[256];
 
-	ImageDecoderRegistry m_nested_registry;
+	// Copy of the creating registry, for JPEG and PNG images nested in the file.
+	ImageDecoderRegistry m_registry;
 	std::unique_ptr<ImageDecoder> m_nested_decoder;
 	std::unique_ptr<IOContext> m_io;
+	ScratchVector<uint8_t> m_row_data;
+	BoxFilter m_filter;
+	StripBuffer m_strip;
 	FileFormat m_format;
 	bool m_alive;
 
@@ -407,7 +410,7 @@ class BMPDecoder : public ImageDecoder {
 			m_bmp_info_header.biSize = biSize;
 
 			if (is_os2) {
-				discard_from_io(m_io.get(), OS22XBITMAPHEADER_SIZE - BITMAPINFOHEADER_SIZE);
+				m_io->discard(OS22XBITMAPHEADER_SIZE - BITMAPINFOHEADER_SIZE);
 				m_bmp_version = BitmapVersion::INFO;
 			}
 		}
@@ -507,65 +510,111 @@ class BMPDecoder : public ImageDecoder {
 		if (!m_io->seekable()) {
 			if (m_io->tell() > m_bmp_file_header.bfOffBits)
 				throw error::CannotDecodeImage{ "incorrect bfOffBits" };
-			discard_from_io(m_io.get(), m_bmp_file_header.bfOffBits - m_io->tell());
+			m_io->discard(m_bmp_file_header.bfOffBits - m_io->tell());
 		} else {
 			m_io->seek_set(m_bmp_file_header.bfOffBits);
 		}
 
 		if (m_bmp_info_header.biCompression == BI_JPEG || m_bmp_info_header.biCompression == BI_PNG) {
 			FileFormat nested_format{ m_bmp_info_header.biCompression == BI_JPEG ? ImageType::JPEG : ImageType::PNG };
-			m_nested_decoder = m_nested_registry.create_decoder("", &nested_format, std::move(m_io));
+			m_nested_decoder = m_registry.create_decoder("", &nested_format, std::move(m_io));
 			if (!m_nested_decoder)
 				throw error::CannotDecodeImage{ "no codec available for nested JPEG/PNG in BMP" };
+			m_nested_decoder->set_allocator(m_allocator);
+			m_nested_decoder->set_scale_denominator(m_scale_denom);
+			m_nested_decoder->set_output_layout(m_layout);
+			m_nested_decoder->set_sample_format(m_sample);
+		}
+	}
+
+	size_t row_size() const
+	{
+		return ceil_n((static_cast<size_t>(m_bmp_info_header.biWidth) * m_bmp_info_header.biBitCount + 7) / 8, sizeof(DWORD));
+	}
+
+	const uint8_t *read_row(size_t rowsize)
+	{
+		const void *ptr;
+
+		if (m_io->peek(&ptr, rowsize) == rowsize) {
+			m_io->consume(rowsize);
+			return static_cast<const uint8_t *>(ptr);
+		}
+
+		m_row_data.resize(rowsize);
+		m_io->read_all(m_row_data.data(), rowsize);
+		return m_row_data.data();
+	}
+
+	// Read count bytes starting at byte first of a DIB row, skipping intermediate data.
+	const uint8_t *read_row_span(IOContext::size_type *pos, DWORD dib_row, size_t rowsize, size_t first, size_t count)
+	{
+		IOContext::size_type target = m_bmp_file_header.bfOffBits + static_cast<IOContext::size_type>(dib_row) * rowsize + first;
+
+		if (target != *pos) {
+			if (m_io->seekable())
+				m_io->seek_set(target);
+			else
+				m_io->discard(target - *pos);
 		}
+		*pos = target + count;
+		return read_row(count);
 	}
 
-	void decode_pal(const OutputBuffer &buffer) try
+	void decode_pal(const ImageRect &rect) try
 	{
 		im_assert_d(m_bmp_info_header.biWidth >= 0, "bad biWidth");
 		im_assert_d(m_bmp_info_header.biHeight >= 0, "bad biHeight");
 		im_assert_d(m_bmp_info_header.biCompression == BI_RGB, "compression not implemented");
 
-		size_t rowsize = ceil_n((static_cast<size_t>(m_bmp_info_header.biWidth) * m_bmp_info_header.biBitCount + 7) / 8, sizeof(DWORD));
-		std::vector<uint8_t> row_data(rowsize);
+		size_t rowsize = row_size();
 
 		if (static_cast<size_t>(PTRDIFF_MAX) / rowsize < static_cast<size_t>(m_bmp_info_header.biHeight))
 			throw error::OutOfMemory{};
 
-		for (LONG i = 0; i < m_bmp_info_header.biHeight; ++i) {
-			LONG dib_row = m_bmp_info_header.biHeight - i - 1;
+		unsigned bits = m_bmp_info_header.biBitCount;
+		size_t first = static_cast<size_t>(rect.left) * bits / 8;
+		size_t last = (static_cast<size_t>(rect.left + rect.width) * bits + 7) / 8;
+		DWORD offset = (rect.left * bits % 8) / bits;
+
+		// Rows are stored bottom-up.
+		DWORD height = m_bmp_info_header.biHeight;
+		IOContext::size_type pos = static_cast<IOContext::size_type>(m_io->tell());
+
+		for (DWORD dib_row = height - rect.top - rect.height; dib_row < height - rect.top; ++dib_row) {
+			DWORD i = height - dib_row - 1 - rect.top;
 			void *dst_p[3];
 
-			dst_p[0] = static_cast<uint8_t *>(buffer.data[0]) + dib_row * buffer.stride[0];
-			dst_p[1] = static_cast<uint8_t *>(buffer.data[1]) + dib_row * buffer.stride[1];
-			dst_p[2] = static_cast<uint8_t *>(buffer.data[2]) + dib_row * buffer.stride[2];
+			dst_p[0] = m_filter.row(0, i);
+			dst_p[1] = m_filter.row(1, i);
+			dst_p[2] = m_filter.row(2, i);
 
 			// TODO: Implement RLE4 and RLE8.
-			m_io->read_all(row_data.data(), rowsize);
-
-			if (m_bmp_info_header.biBitCount == 1)
-				depalettize<1>(dst_p, row_data.data(), m_bmp_info_header.biWidth, m_palette);
-			else if (m_bmp_info_header.biBitCount == 4)
-				depalettize<4>(dst_p, row_data.data(), m_bmp_info_header.biWidth, m_palette);
-			else if (m_bmp_info_header.biBitCount == 8)
-				depalettize<8>(dst_p, row_data.data(), m_bmp_info_header.biWidth, m_palette);
+			const uint8_t *src_p = read_row_span(&pos, dib_row, rowsize, first, last - first);
+
+			if (bits == 1)
+				depalettize<1>(dst_p, src_p, offset, rect.width, m_palette);
+			else if (bits == 4)
+				depalettize<4>(dst_p, src_p, offset, rect.width, m_palette);
+			else if (bits == 8)
+				depalettize<8>(dst_p, src_p, offset, rect.width, m_palette);
 			else
 				im_assert_d(false, "bad biBitCount");
+
+			for (unsigned p = 0; p < 3; ++p) {
+				m_filter.commit(p, i);
+			}
 		}
 	} catch (const std::bad_alloc &) {
 		throw error::OutOfMemory{};
 	}
 
-	void decode_rgb(const OutputBuffer &buffer) try
+	void decode_rgb(const ImageRect &rect) try
 	{
 		im_assert_d(m_bmp_info_header.biWidth >= 0, "bad biWidth");
 		im_assert_d(m_bmp_info_header.biCompression == BI_RGB || m_bmp_info_header.biCompression == BI_BITFIELDS, "compression not implemented");
 
-		size_t rowsize = ceil_n(static_cast<size_t>(m_bmp_info_header.biWidth) * (m_bmp_info_header.biBitCount / 8), sizeof(DWORD));
-		std::vector<uint8_t> row_data(rowsize);
-
-		if (static_cast<size_t>(PTRDIFF_MAX) / rowsize < static_cast<size_t>(m_bmp_info_header.biHeight))
-			throw error::OutOfMemory{};
+		size_t rowsize = row_size();
 
 		std::pair<unsigned, unsigned> bitfield_spec[4] = {};
 		if (m_bmp_info_header.biCompression == BI_BITFIELDS) {
@@ -577,51 +626,105 @@ class BMPDecoder : public ImageDecoder {
 				bitfield_spec[3] = decode_bitfield(m_bmp_info_header.bV3AlphaMask);
 		}
 
+		size_t pixel_size = m_bmp_info_header.biBitCount / 8;
+
+		// Byte-aligned pixels can go straight to interleaved output.
+		unsigned src_pos[MAX_PLANE_COUNT] = { 2, 1, 0, 3 };
+		bool packable = pixel_size >= 3;
+
+		if (m_bmp_info_header.biCompression == BI_BITFIELDS) {
+			for (unsigned p = 0; p < m_format.plane_count; ++p) {
+				packable = packable && bitfield_spec[p].first == 8 && bitfield_spec[p].second % 8 == 0;
+				src_pos[p] = bitfield_spec[p].second / 8;
+			}
+		}
+
+		bool bottom_up = m_bmp_info_header.biHeight >= 0;
 		DWORD height = std::labs(m_bmp_info_header.biHeight);
-		for (DWORD i = 0; i < height; ++i) {
-			DWORD dib_row = m_bmp_info_header.biHeight >= 0 ? height - i - 1 : i;
+
+		if (static_cast<size_t>(PTRDIFF_MAX) / rowsize < height)
+			throw error::OutOfMemory{};
+		DWORD first_row = bottom_up ? height - rect.top - rect.height : rect.top;
+		IOContext::size_type pos = static_cast<IOContext::size_type>(m_io->tell());
+
+		for (DWORD dib_row = first_row; dib_row < first_row + rect.height; ++dib_row) {
+			DWORD i = (bottom_up ? height - dib_row - 1 : dib_row) - rect.top;
 			void *dst_p[MAX_PLANE_COUNT] = {};
 
-			dst_p[0] = static_cast<uint8_t *>(buffer.data[0]) + dib_row * buffer.stride[0];
-			dst_p[1] = static_cast<uint8_t *>(buffer.data[1]) + dib_row * buffer.stride[1];
-			dst_p[2] = static_cast<uint8_t *>(buffer.data[2]) + dib_row * buffer.stride[2];
-			if (m_bmp_info_header.biCompression == BI_BITFIELDS && bitfield_spec[3].first)
-				dst_p[3] = static_cast<uint8_t *>(buffer.data[3]) + dib_row * buffer.stride[3];
+			for (unsigned p = 0; p < m_format.plane_count; ++p) {
+				dst_p[p] = m_filter.row(p, i);
+			}
+
+			const uint8_t *src_p = read_row_span(&pos, dib_row, rowsize, rect.left * pixel_size, rect.width * pixel_size);
 
-			m_io->read_all(row_data.data(), rowsize);
+			if (packable && m_filter.pack(i, 0, rect.width, src_p, static_cast<unsigned>(pixel_size), src_pos))
+				continue;
 
 			if (m_bmp_info_header.biCompression == BI_BITFIELDS) {
 				if (m_bmp_info_header.biBitCount == 16)
-					unpack_bitfield<WORD>(row_data.data(), dst_p, m_bmp_info_header.biWidth, bitfield_spec);
+					unpack_bitfield<WORD>(src_p, dst_p, rect.width, bitfield_spec);
 				else if (m_bmp_info_header.biBitCount == 32)
-					unpack_bitfield<DWORD>(row_data.data(), dst_p, m_bmp_info_header.biWidth, bitfield_spec);
+					unpack_bitfield<DWORD>(src_p, dst_p, rect.width, bitfield_spec);
 				else
 					im_assert_d(false, "bad biBitCount");
 			} else {
 				if (m_bmp_info_header.biBitCount == 16)
-					im_p2p::packed_to_planar<packed_rgb555>::unpack(row_data.data(), dst_p, 0, m_bmp_info_header.biWidth);
+					im_p2p::packed_to_planar<packed_rgb555>::unpack(src_p, dst_p, 0, rect.width);
 				else if (m_bmp_info_header.biBitCount == 24)
-					im_p2p::packed_to_planar<im_p2p::packed_rgb24_le>::unpack(row_data.data(), dst_p, 0, m_bmp_info_header.biWidth);
+					im_p2p::packed_to_planar<im_p2p::packed_rgb24_le>::unpack(src_p, dst_p, 0, rect.width);
 				else if (m_bmp_info_header.biBitCount == 32)
-					im_p2p::packed_to_planar<im_p2p::packed_argb32_le>::unpack(row_data.data(), dst_p, 0, m_bmp_info_header.biWidth);
+					im_p2p::packed_to_planar<im_p2p::packed_argb32_le>::unpack(src_p, dst_p, 0, rect.width);
 				else
 					im_assert_d(false, "bad biBitCount");
 			}
+
+			for (unsigned p = 0; p < m_format.plane_count; ++p) {
+				m_filter.commit(p, i);
+			}
 		}
 	} catch (const std::bad_alloc &) {
 		throw error::OutOfMemory{};
 	}
+
+	// Format of a source region, as unpacked before scaling.
+	FrameFormat region_format(const ImageRect &src) const
+	{
+		FrameFormat format = m_format;
+
+		for (unsigned p = 0; p < format.plane_count; ++p) {
+			format.plane[p].width = src.width;
+			format.plane[p].height = src.height;
+		}
+		return format;
+	}
+
+	// Decode a rectangle of the scaled frame.
+	void decode_rect(const OutputBuffer &buffer, const ImageRect &rect)
+	{
+		check_layout(next_frame_format());
+
+		ImageRect src = unscale_rect(rect, m_scale_denom, m_format.plane[0]);
+		m_filter.reset(buffer, region_format(src), m_scale_denom, m_layout, m_sample);
+
+		if (m_bmp_info_header.biBitCount <= 8)
+			decode_pal(src);
+		else
+			decode_rgb(src);
+	}
 public:
-	explicit BMPDecoder(std::unique_ptr<IOContext> io) :
+	BMPDecoder(std::unique_ptr<IOContext> io, const ImageDecoderRegistry &registry) :
 		m_bmp_file_header{},
 		m_bmp_info_header{},
 		m_bmp_version{ BitmapVersion::UNKNOWN },
 		m_palette{},
+		m_registry(registry),
 		m_io{ std::move(io) },
+		m_row_data(m_allocator),
+		m_filter{ m_allocator },
+		m_strip{ m_allocator },
 		m_format{ ImageType::BMP, 1 },
 		m_alive{ true }
 	{
-		m_nested_registry.register_default_providers();
 	}
 
 	const char *name() const override
@@ -646,7 +749,7 @@ public:
 		if (m_nested_decoder)
 			return m_nested_decoder->next_frame_format();
 
-		return m_alive ? file_format() : FrameFormat{};
+		return m_alive ? convert_frame_format(scale_frame_format(file_format(), m_scale_denom), m_sample) : FrameFormat{};
 	}
 
 	void decode(const OutputBuffer &buffer) override
@@ -656,13 +759,111 @@ public:
 			return;
 		}
 
-		if (m_bmp_info_header.biBitCount <= 8)
-			decode_pal(buffer);
-		else
-			decode_rgb(buffer);
+		if (!m_alive)
+			return;
+
+		decode_rect(buffer, full_frame_rect(next_frame_format()));
+		m_alive = false;
+	}
+
+	void decode_region(const OutputBuffer &buffer, const ImageRect &rect) override
+	{
+		if (m_nested_decoder) {
+			m_nested_decoder->decode_region(buffer, rect);
+			return;
+		}
+		if (!m_alive)
+			return;
+
+		check_region(next_frame_format(), rect);
+		decode_rect(buffer, rect);
+		m_alive = false;
+	}
+
+	void decode_rows(RowSink &sink) override
+	{
+		if (m_nested_decoder) {
+			m_nested_decoder->decode_rows(sink);
+			return;
+		}
+		if (!m_alive)
+			return;
+
+		FrameFormat format = next_frame_format();
+		unsigned height = format.plane[0].height;
+		bool bottom_up = m_bmp_info_header.biHeight >= 0;
+
+		check_layout(format);
+		m_strip.reset(format, std::min(BAND_ROWS, height), m_layout);
+
+		// Bands follow the file, which is stored from the bottom unless biHeight is negative.
+		for (unsigned n = 0; n < height; n += m_strip.rows()) {
+			unsigned rows = std::min(m_strip.rows(), height - n);
+			unsigned top = bottom_up ? height - n - rows : n;
 
+			decode_rect(m_strip.buffer(), { 0, top, format.plane[0].width, rows });
+			if (!m_strip.flush(sink, top, rows))
+				break;
+		}
 		m_alive = false;
 	}
+
+	size_t scratch_bytes() override
+	{
+		if (!is_constant_format(next_frame_format()))
+			return 0;
+		if (m_nested_decoder)
+			return m_nested_decoder->scratch_bytes();
+
+		// Rows are read in place where the context buffers enough data.
+		return row_size() + BoxFilter::scratch_bytes(m_format, m_scale_denom, m_layout, m_sample);
+	}
+
+	void reset(std::unique_ptr<IOContext> io) override
+	{
+		m_bmp_file_header = BITMAPFILEHEADER{};
+		m_bmp_info_header = BITMAPV5HEADER{};
+		m_bmp_version = BitmapVersion::UNKNOWN;
+		m_nested_decoder.reset();
+		m_io = std::move(io);
+		m_format = FileFormat{ ImageType::BMP, 1 };
+		m_alive = true;
+	}
+
+	void set_allocator(Allocator *allocator) override
+	{
+		ImageDecoder::set_allocator(allocator);
+		m_row_data = ScratchVector<uint8_t>(m_allocator);
+		m_filter.set_allocator(m_allocator);
+		m_strip.set_allocator(m_allocator);
+
+		if (m_nested_decoder)
+			m_nested_decoder->set_allocator(m_allocator);
+	}
+
+	void set_scale_denominator(unsigned denom) override
+	{
+		ImageDecoder::set_scale_denominator(denom);
+
+		if (m_nested_decoder)
+			m_nested_decoder->set_scale_denominator(denom);
+	}
+
+	void set_output_layout(const OutputLayout &layout) override
+	{
+		ImageDecoder::set_output_layout(layout);
+
+		if (m_nested_decoder)
+			m_nested_decoder->set_output_layout(layout);
+	}
+
+	void set_sample_format(const SampleFormat &sample) override
+	{
+		ImageDecoder::set_sample_format(sample);
+
+		if (m_nested_decoder)
+			m_nested_decoder->set_sample_format(sample);
+	}
 };
 
 } // namespace
@@ -678,18 +879,38 @@ int BMPDecoderFactory::priority() const
 	return PRIORITY_NORMAL;
 }
 
-std::unique_ptr<ImageDecoder> BMPDecoderFactory::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) try
+ImageType BMPDecoderFactory::type() const
+{
+	return ImageType::BMP;
+}
+
+bool BMPDecoderFactory::probe(const void *buf, size_t size) const
+{
+	return probe_bmp(buf, size);
+}
+
+bool BMPDecoderFactory::matches_extension(const char *path) const
+{
+	return is_matching_extension(path, bmp_extensions.data(), bmp_extensions.size());
+}
+
+std::unique_ptr<ImageDecoder> BMPDecoderFactory::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io)
+{
+	return create_decoder_in(ImageDecoderRegistry::default_registry(), path, format, std::move(io));
+}
+
+std::unique_ptr<ImageDecoder> BMPDecoderFactory::create_decoder_in(const ImageDecoderRegistry &registry, const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) try
 {
 	bool recognized;
 
 	if (format)
 		recognized = format->type == ImageType::BMP;
-	else if (io->seekable())
+	else if (io->rewindable())
 		recognized = recognize_bmp(io.get());
 	else
 		recognized = is_matching_extension(path, bmp_extensions.data(), bmp_extensions.size());
 
-	return recognized ? std::unique_ptr<ImageDecoder>{ new BMPDecoder{ std::move(io) } } : nullptr;
+	return recognized ? std::unique_ptr<ImageDecoder>{ new BMPDecoder{ std::move(io), registry } } : nullptr;
 } catch (const std::bad_alloc &) {
 	throw error::OutOfMemory{};
 }
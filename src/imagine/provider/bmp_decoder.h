@@ -13,7 +13,15 @@ public:
 
 	int priority() const override;
 
+	ImageType type() const override;
+
+	bool probe(const void *buf, size_t size) const override;
+
+	bool matches_extension(const char *path) const override;
+
 	std::unique_ptr<ImageDecoder> create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) override;
+
+	std::unique_ptr<ImageDecoder> create_decoder_in(const ImageDecoderRegistry &registry, const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) override;
 };
 
 } // namespace imagine
@@ -10,6 +10,8 @@
 #include <vector>
 #include <jpeglib.h>
 #include "common/align.h"
+#include "common/allocator.h"
+#include "common/box_filter.h"
 #include "common/buffer.h"
 #include "common/decoder.h"
 #include "common/except.h"
@@ -17,6 +19,7 @@
 #include "common/io_context.h"
 #include "common/jumpman.h"
 #include "common/path.h"
+#include "common/strip_buffer.h"
 #include "provider/jpeg_decoder.h"
 
 #ifdef IMAGINE_JPEG_ENABLED
@@ -25,34 +28,40 @@ namespace imagine {
 namespace {
 
 const char JPEG_DECODER_NAME[] = "jpeg";
-const std::array<const char *, 8> jpeg_extensions{ { "jpg", "jpeg", "jpe", "jif", "jfif", "jfi" } };
+const std::array<const char *, 6> jpeg_extensions{ { "jpg", "jpeg", "jpe", "jif", "jfif", "jfi" } };
 
 const size_t JPEG_BUFFER_SIZE = 2048;
 const JOCTET eoi_marker[] = { 0xFF, JPEG_EOI };
 
-void discard_from_io(IOContext *io, IOContext::size_type count)
+// Marker codes not exported by jpeglib.
+const uint8_t M_SOF0 = 0xC0;
+const uint8_t M_DHT = 0xC4;
+const uint8_t M_JPG = 0xC8;
+const uint8_t M_DAC = 0xCC;
+const uint8_t M_SOF15 = 0xCF;
+const uint8_t M_RST7 = 0xD7;
+const uint8_t M_SOS = 0xDA;
+const uint8_t M_APP14 = JPEG_APP0 + 14;
+const uint8_t M_TEM = 0x01;
+
+const size_t JPEG_MAGIC_LEN = 3;
+
+bool probe_jpeg(const void *buf, size_t size)
 {
-	char buf[1024];
+	const uint8_t *vec = static_cast<const uint8_t *>(buf);
 
-	while (count) {
-		IOContext::size_type n = std::min(count, static_cast<IOContext::size_type>(sizeof(buf)));
-		io->read_all(buf, n);
-		count -= n;
-	}
+	// SOI followed by additional segment.
+	return size >= JPEG_MAGIC_LEN && vec[0] == 0xFF && vec[1] == 0xD8 && vec[2] == 0xFF;
 }
 
 bool recognize_jpeg(IOContext *io)
 {
-	uint8_t vec[3];
+	uint8_t vec[JPEG_MAGIC_LEN];
 	IOContext::difference_type pos = io->tell();
-	bool ret = false;
+	size_t n = static_cast<size_t>(io->read(vec, sizeof(vec)));
 
-	io->read_all(vec, sizeof(vec));
-	// SOI followed by additional segment.
-	ret = vec[0] = 0xFF && vec[1] == 0xD8 && vec[2] == 0xFF;
 	io->seek_set(pos);
-
-	return ret;
+	return probe_jpeg(vec, n);
 }
 
 ColorFamily translate_jcs_color(J_COLOR_SPACE color)
@@ -73,6 +82,177 @@ ColorFamily translate_jcs_color(J_COLOR_SPACE color)
 	}
 }
 
+// Samples per block edge after IDCT scaling, equal in both directions as set
+// by libjpeg-turbo. jpeglib 7 added separate horizontal and vertical sizes.
+#if JPEG_LIB_VERSION >= 70
+unsigned min_dct_scaled_size(const jpeg_decompress_struct &jpeg) { return jpeg.min_DCT_v_scaled_size; }
+unsigned dct_scaled_size(const jpeg_component_info &comp) { return comp.DCT_v_scaled_size; }
+#else
+unsigned min_dct_scaled_size(const jpeg_decompress_struct &jpeg) { return jpeg.min_DCT_scaled_size; }
+unsigned dct_scaled_size(const jpeg_component_info &comp) { return comp.DCT_scaled_size; }
+#endif
+
+uint8_t read_byte(IOContext *io)
+{
+	uint8_t c;
+	io->read_all(&c, 1);
+	return c;
+}
+
+uint8_t next_marker(IOContext *io)
+{
+	uint8_t c;
+
+	do {
+		// Skip garbage and fill bytes, as jpeglib does.
+		do {
+			c = read_byte(io);
+		} while (c != 0xFF);
+		do {
+			c = read_byte(io);
+		} while (c == 0xFF);
+	} while (!c);
+
+	return c;
+}
+
+bool is_sof_marker(uint8_t marker)
+{
+	return marker >= M_SOF0 && marker <= M_SOF15 && marker != M_DHT && marker != M_JPG && marker != M_DAC;
+}
+
+// Color space guessed by jpeglib from the component count and the JFIF and Adobe markers.
+J_COLOR_SPACE guess_jpeg_color_space(unsigned num_components, const uint8_t *component_id, bool jfif, bool adobe, uint8_t adobe_transform)
+{
+	switch (num_components) {
+	case 1:
+		return JCS_GRAYSCALE;
+	case 3:
+		if (jfif)
+			return JCS_YCbCr;
+		if (adobe)
+			return adobe_transform == 0 ? JCS_RGB : JCS_YCbCr;
+		if (component_id[0] == 'R' && component_id[1] == 'G' && component_id[2] == 'B')
+			return JCS_RGB;
+		return JCS_YCbCr;
+	case 4:
+		if (adobe)
+			return adobe_transform == 0 ? JCS_CMYK : JCS_YCCK;
+		return JCS_CMYK;
+	default:
+		return JCS_UNKNOWN;
+	}
+}
+
+// Parse the markers up to the first scan, producing the same format as JPEGDecoder.
+void read_jpeg_header(IOContext *io, FileFormat *format)
+{
+	uint8_t soi[2];
+	io->read_all(soi, sizeof(soi));
+	if (soi[0] != 0xFF || soi[1] != 0xD8)
+		throw error::CannotDecodeImage{ "not a JPEG file" };
+
+	uint8_t frame[6 + 3 * MAX_PLANE_COUNT];
+	unsigned num_components = 0;
+	bool jfif = false;
+	bool adobe = false;
+	uint8_t adobe_transform = 0;
+
+	while (true) {
+		uint8_t marker = next_marker(io);
+
+		if (marker == M_SOS)
+			break;
+		if (marker == JPEG_EOI)
+			throw error::CannotDecodeImage{ "no image in JPEG" };
+		// Markers without a payload.
+		if (marker == M_TEM || (marker >= JPEG_RST0 && marker <= M_RST7))
+			continue;
+
+		uint8_t len_buf[2];
+		io->read_all(len_buf, sizeof(len_buf));
+
+		size_t len = (len_buf[0] << 8) | len_buf[1];
+		if (len < sizeof(len_buf))
+			throw error::CannotDecodeImage{ "bad JPEG marker length" };
+		len -= sizeof(len_buf);
+
+		if (is_sof_marker(marker)) {
+			if (num_components)
+				throw error::CannotDecodeImage{ "duplicate SOF marker" };
+			if (len < 6)
+				throw error::CannotDecodeImage{ "bad SOF marker length" };
+
+			io->read_all(frame, 6);
+			num_components = frame[5];
+
+			if (frame[0] != BITS_IN_JSAMPLE)
+				throw error::CannotDecodeImage{ "unsupported JPEG data precision" };
+			if (num_components == 0)
+				throw error::CannotDecodeImage{ "no components in JPEG" };
+			if (num_components > MAX_PLANE_COUNT)
+				throw error::TooManyImagePlanes{ "maximum plane count exceeded" };
+			if (len < 6 + 3 * num_components)
+				throw error::CannotDecodeImage{ "bad SOF marker length" };
+
+			io->read_all(frame + 6, 3 * num_components);
+			len -= 6 + 3 * num_components;
+		} else if (marker == JPEG_APP0 && len >= 14) {
+			uint8_t id[5];
+			io->read_all(id, sizeof(id));
+			jfif = jfif || !memcmp(id, "JFIF", sizeof(id));
+			len -= sizeof(id);
+		} else if (marker == M_APP14 && len >= 12) {
+			uint8_t id[12];
+			io->read_all(id, sizeof(id));
+			if (!memcmp(id, "Adobe", 5)) {
+				adobe = true;
+				adobe_transform = id[11];
+			}
+			len -= sizeof(id);
+		}
+
+		io->discard(len);
+	}
+
+	if (!num_components)
+		throw error::CannotDecodeImage{ "no SOF marker before SOS" };
+
+	unsigned image_height = (frame[1] << 8) | frame[2];
+	unsigned image_width = (frame[3] << 8) | frame[4];
+	unsigned max_h_samp_factor = 1;
+	unsigned max_v_samp_factor = 1;
+	uint8_t component_id[MAX_PLANE_COUNT];
+
+	if (!image_width || !image_height)
+		throw error::CannotDecodeImage{ "empty JPEG image" };
+
+	for (unsigned p = 0; p < num_components; ++p) {
+		const uint8_t *comp = frame + 6 + 3 * p;
+		unsigned h_samp = comp[1] >> 4;
+		unsigned v_samp = comp[1] & 0x0F;
+
+		if (h_samp < 1 || h_samp > MAX_SAMP_FACTOR || v_samp < 1 || v_samp > MAX_SAMP_FACTOR)
+			throw error::CannotDecodeImage{ "bad sampling factor" };
+
+		component_id[p] = comp[0];
+		max_h_samp_factor = std::max(max_h_samp_factor, h_samp);
+		max_v_samp_factor = std::max(max_v_samp_factor, v_samp);
+	}
+
+	*format = FileFormat{ ImageType::JPEG, 1 };
+	format->plane_count = num_components;
+	for (unsigned p = 0; p < num_components; ++p) {
+		const uint8_t *comp = frame + 6 + 3 * p;
+
+		format->plane[p].width = (image_width * (comp[1] >> 4)) / max_h_samp_factor;
+		format->plane[p].height = (image_height * (comp[1] & 0x0F)) / max_v_samp_factor;
+		format->plane[p].bit_depth = BITS_IN_JSAMPLE;
+	}
+	format->color_family = translate_jcs_color(guess_jpeg_color_space(num_components, component_id, jfif, adobe, adobe_transform));
+}
+
+
 class JPEGDecoder : public ImageDecoder {
 	jpeg_decompress_struct m_jpeg;
 	jpeg_source_mgr m_jpeg_source;
@@ -80,6 +260,11 @@ class JPEGDecoder : public ImageDecoder {
 
 	std::unique_ptr<IOContext> m_io;
 	std::vector<JOCTET> m_buffer;
+	ScratchVector<JSAMPLE> m_discard_buf;
+	ScratchVector<JSAMPLE> m_scanline;
+	BoxFilter m_filter;
+	StripBuffer m_strip;
+	StripBuffer m_band;
 	FileFormat m_format;
 	Jumpman m_jumpman;
 	bool m_alive;
@@ -92,10 +277,20 @@ class JPEGDecoder : public ImageDecoder {
 		bool eof = false;
 
 		try {
-			cinfo->src->bytes_in_buffer = d->m_io->read(d->m_buffer.data(), d->m_buffer.size());
-			cinfo->src->next_input_byte = d->m_buffer.data();
-			if (d->m_io->eof())
-				eof = true;
+			const void *ptr;
+			IOContext::size_type count = d->m_io->peek(&ptr, SIZE_MAX);
+
+			if (count) {
+				// Hand the backing store to jpeglib directly, as in jpeg_mem_src.
+				d->m_io->consume(count);
+				cinfo->src->bytes_in_buffer = static_cast<size_t>(count);
+				cinfo->src->next_input_byte = static_cast<const JOCTET *>(ptr);
+			} else {
+				cinfo->src->bytes_in_buffer = d->m_io->read(d->m_buffer.data(), d->m_buffer.size());
+				cinfo->src->next_input_byte = d->m_buffer.data();
+				if (!cinfo->src->bytes_in_buffer && d->m_io->eof())
+					eof = true;
+			}
 		} catch (...) {
 			d->m_jumpman.store_exception();
 			eof = true;
@@ -118,12 +313,7 @@ class JPEGDecoder : public ImageDecoder {
 				cinfo->src->bytes_in_buffer -= num_bytes;
 				cinfo->src->next_input_byte += num_bytes;
 			} else {
-				long seek = num_bytes - static_cast<long>(cinfo->src->bytes_in_buffer);
-
-				if (d->m_io->seekable())
-					d->m_io->seek_rel(seek);
-				else
-					discard_from_io(d->m_io.get(), seek);
+				d->m_io->discard(num_bytes - cinfo->src->bytes_in_buffer);
 
 				cinfo->src->bytes_in_buffer = 0;
 				cinfo->src->next_input_byte = d->m_buffer.data();
@@ -176,10 +366,178 @@ class JPEGDecoder : public ImageDecoder {
 
 	void done()
 	{
+		// Return to the start state, keeping permanent allocations for reuse.
 		if (m_alive)
-			jpeg_destroy_decompress(&m_jpeg);
+			jpeg_abort_decompress(&m_jpeg);
 		m_alive = false;
 	}
+
+	// Format of the next frame as decoded by jpeglib, before conversion.
+	FrameFormat scaled_frame_format()
+	{
+		if (!m_alive)
+			return{};
+
+		FrameFormat format = file_format();
+
+		// Components may be reduced by different factors, so take the sizes from jpeglib.
+		m_jpeg.scale_num = 1;
+		m_jpeg.scale_denom = m_scale_denom;
+		m_jumpman.call(jpeg_calc_output_dimensions, &m_jpeg);
+
+		if (m_scale_denom > 1) {
+			for (unsigned p = 0; p < format.plane_count; ++p) {
+				format.plane[p].width = m_jpeg.comp_info[p].downsampled_width;
+				format.plane[p].height = m_jpeg.comp_info[p].downsampled_height;
+			}
+		}
+		return format;
+	}
+
+	// Decode interleaved output from scanlines, which hold the components in
+	// file order when color conversion is disabled.
+	void decode_interleaved(const OutputBuffer &buffer, RowSink *sink)
+	{
+		FrameFormat format = scaled_frame_format();
+		FrameFormat output = convert_frame_format(format, m_sample);
+		check_layout(output);
+
+		m_jpeg.raw_data_out = FALSE;
+		m_jpeg.out_color_space = m_jpeg.jpeg_color_space;
+		m_jumpman.call(jpeg_start_decompress, &m_jpeg);
+
+		static const unsigned src_pos[MAX_PLANE_COUNT] = { 0, 1, 2, 3 };
+		unsigned components = m_jpeg.output_components;
+		unsigned height = format.plane[0].height;
+		unsigned band_rows = height;
+		bool in_order = true;
+		const OutputBuffer *dst = &buffer;
+
+		if (sink) {
+			m_strip.reset(output, std::min(min_dct_scaled_size(m_jpeg) * m_jpeg.max_v_samp_factor, height), m_layout);
+			band_rows = m_strip.rows();
+			dst = &m_strip.buffer();
+		}
+		m_filter.reset(*dst, format, 1, m_layout, m_sample);
+
+		for (unsigned c = 0; c < components; ++c) {
+			in_order = in_order && m_layout.order[c] == c;
+		}
+		in_order = in_order && !m_filter.converting();
+
+		if (!in_order)
+			m_scanline.resize(static_cast<size_t>(m_jpeg.output_width) * components);
+
+		// Scanlines are read in place when the components are already in order.
+		for (unsigned i = 0; i < height; ++i) {
+			unsigned band_row = i % band_rows;
+			JSAMPROW row = in_order ? static_cast<JSAMPROW>(m_filter.packed_row(band_row)) : m_scanline.data();
+
+			if (m_jumpman.call(jpeg_read_scanlines, &m_jpeg, &row, 1) != 1)
+				throw error::CannotDecodeImage{ "error reading JPEG scanline" };
+			if (!in_order)
+				m_filter.pack(band_row, 0, format.plane[0].width, row, components, src_pos);
+
+			// Stopping abandons the frame, leaving the remaining scanlines unread.
+			if (sink && (band_row + 1 == band_rows || i + 1 == height) && !m_strip.flush(*sink, i - band_row, band_row + 1)) {
+				done();
+				return;
+			}
+		}
+		m_jumpman.call(jpeg_finish_decompress, &m_jpeg);
+		done();
+	}
+
+	// Decode the frame into buffer, or one iMCU row at a time into the band
+	// passed to sink if given. Samples to be converted are decoded a band at
+	// a time and written through the filter.
+	void decode_frame(const OutputBuffer &buffer, RowSink *sink) try
+	{
+		if (m_layout.interleaved) {
+			decode_interleaved(buffer, sink);
+			return;
+		}
+
+		FrameFormat format = scaled_frame_format();
+
+		// Reduced sizes are produced by the IDCT, with the scale set by next_frame_format.
+		m_jpeg.raw_data_out = TRUE;
+		m_jumpman.call(jpeg_start_decompress, &m_jpeg);
+
+		if (SIZE_MAX / m_jpeg.output_width < m_jpeg.output_height)
+			throw error::OutOfMemory{};
+
+		unsigned vstep = min_dct_scaled_size(m_jpeg) * m_jpeg.max_v_samp_factor;
+		unsigned base_step = dct_scaled_size(m_jpeg.comp_info[0]) * m_jpeg.comp_info[0].v_samp_factor;
+		unsigned band_rows = std::min(base_step, format.plane[0].height);
+		const OutputBuffer *dst = &buffer;
+		JSAMPROW row_index[MAX_PLANE_COUNT][DCTSIZE * MAX_SAMP_FACTOR];
+		JSAMPARRAY plane_index[MAX_PLANE_COUNT] = {
+			&row_index[0][0], &row_index[1][0], &row_index[2][0], &row_index[3][0],
+		};
+
+		if (sink) {
+			m_strip.reset(convert_frame_format(format, m_sample), band_rows);
+			dst = &m_strip.buffer();
+		}
+		m_filter.reset(*dst, format, 1, OutputLayout{}, m_sample);
+
+		bool convert = m_filter.converting();
+		const OutputBuffer *raw = dst;
+
+		if (convert) {
+			m_band.reset(format, band_rows);
+			raw = &m_band.buffer();
+		}
+
+		for (unsigned p = 0; (sink || convert) && p < format.plane_count; ++p) {
+			if (base_step % (dct_scaled_size(m_jpeg.comp_info[p]) * m_jpeg.comp_info[p].v_samp_factor))
+				throw error::UnsupportedOperation{ "fractional subsampling not supported in bands" };
+		}
+
+		for (JDIMENSION i = 0; i < m_jpeg.output_height;) {
+			JDIMENSION group = i / vstep;
+
+			for (unsigned p = 0; p < format.plane_count; ++p) {
+				unsigned plane_step = dct_scaled_size(m_jpeg.comp_info[p]) * m_jpeg.comp_info[p].v_samp_factor;
+				JDIMENSION row_offset = group * plane_step;
+
+				for (unsigned ii = 0; ii < plane_step; ++ii) {
+					JDIMENSION dst_row = sink || convert ? ii : row_offset;
+
+					if (row_offset >= format.plane[p].height) {
+						m_discard_buf.resize(format.plane[p].width + DCTSIZE * MAX_SAMP_FACTOR);
+						row_index[p][ii] = m_discard_buf.data();
+					} else {
+						row_index[p][ii] = reinterpret_cast<JSAMPLE *>(static_cast<uint8_t *>(raw->data[p]) + dst_row * raw->stride[p]);
+					}
+					++row_offset;
+				}
+			}
+
+			unsigned top = group * base_step;
+			i += m_jumpman.call(jpeg_read_raw_data, &m_jpeg, plane_index, vstep);
+
+			for (unsigned p = 0; convert && p < format.plane_count; ++p) {
+				unsigned plane_step = dct_scaled_size(m_jpeg.comp_info[p]) * m_jpeg.comp_info[p].v_samp_factor;
+				JDIMENSION plane_top = group * plane_step;
+
+				for (unsigned ii = 0; ii < plane_step && plane_top + ii < format.plane[p].height; ++ii) {
+					const uint8_t *src_p = static_cast<const uint8_t *>(raw->data[p]) + ii * raw->stride[p];
+					m_filter.commit(p, sink ? ii : plane_top + ii, 0, format.plane[p].width, src_p);
+				}
+			}
+
+			if (sink && top < format.plane[0].height && !m_strip.flush(*sink, top, std::min(base_step, format.plane[0].height - top))) {
+				done();
+				return;
+			}
+		}
+		m_jumpman.call(jpeg_finish_decompress, &m_jpeg);
+		done();
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
 public:
 	explicit JPEGDecoder(std::unique_ptr<IOContext> io) :
 		m_jpeg{},
@@ -187,6 +545,11 @@ public:
 		m_jpeg_error{},
 		m_io{ std::move(io) },
 		m_buffer(JPEG_BUFFER_SIZE),
+		m_discard_buf(m_allocator),
+		m_scanline(m_allocator),
+		m_filter{ m_allocator },
+		m_strip{ m_allocator },
+		m_band{ m_allocator },
 		m_format{ ImageType::JPEG, 1 },
 		m_jumpman{ [](void *) { throw error::CannotDecodeImage{ "jpeglib error" }; } , nullptr },
 		m_alive{}
@@ -209,7 +572,7 @@ public:
 
 	~JPEGDecoder()
 	{
-		done();
+		jpeg_destroy_decompress(&m_jpeg);
 	}
 
 	const char *name() const override
@@ -227,51 +590,174 @@ public:
 
 	FrameFormat next_frame_format() override
 	{
-		return m_alive ? file_format() : FrameFormat{};
+		return convert_frame_format(scaled_frame_format(), m_sample);
 	}
 
-	void decode(const OutputBuffer &buffer) override try
+	void decode(const OutputBuffer &buffer) override
 	{
 		if (!m_alive)
 			return;
 
-		m_jpeg.raw_data_out = TRUE;
-		m_jpeg.output_width = m_jpeg.image_width;
-		m_jpeg.output_height = m_jpeg.image_height;
+		decode_frame(buffer, nullptr);
+	}
+
+	void decode_rows(RowSink &sink) override
+	{
+		if (!m_alive)
+			return;
+
+		decode_frame(OutputBuffer{}, &sink);
+	}
+
+	void decode_region(const OutputBuffer &buffer, const ImageRect &rect) override try
+	{
+		if (!m_alive)
+			return;
+
+		FrameFormat format = scaled_frame_format();
+		unsigned sw[MAX_PLANE_COUNT];
+		unsigned sh[MAX_PLANE_COUNT];
+		unsigned max_sw = 1;
+		unsigned max_sh = 1;
+
+		for (unsigned p = 0; p < format.plane_count; ++p) {
+			const jpeg_component_info &comp = m_jpeg.comp_info[p];
+			unsigned h_units = m_jpeg.max_h_samp_factor * min_dct_scaled_size(m_jpeg);
+			unsigned v_units = m_jpeg.max_v_samp_factor * min_dct_scaled_size(m_jpeg);
+			unsigned comp_h_units = comp.h_samp_factor * dct_scaled_size(comp);
+			unsigned comp_v_units = comp.v_samp_factor * dct_scaled_size(comp);
+
+			if (h_units % comp_h_units || v_units % comp_v_units)
+				throw error::UnsupportedOperation{ "fractional subsampling not supported in region" };
+
+			sw[p] = h_units / comp_h_units;
+			sh[p] = v_units / comp_v_units;
+			max_sw = std::max(max_sw, sw[p]);
+			max_sh = std::max(max_sh, sh[p]);
+		}
+		check_layout(convert_frame_format(format, m_sample));
+		check_region(format, rect, max_sw, max_sh);
+
+#ifdef LIBJPEG_TURBO_VERSION_NUMBER
+		// Cropping and skipping are not available for raw data. Without color
+		// conversion or fancy upsampling, each chroma sample is replicated
+		// and can be picked from the scanline.
+		m_jpeg.raw_data_out = FALSE;
+		m_jpeg.out_color_space = m_jpeg.jpeg_color_space;
+		m_jpeg.do_fancy_upsampling = FALSE;
 		m_jumpman.call(jpeg_start_decompress, &m_jpeg);
 
-		if (SIZE_MAX / m_jpeg.output_width < m_jpeg.output_height)
-			throw error::OutOfMemory{};
+		JDIMENSION xoffset = rect.left;
+		JDIMENSION width = rect.width;
+		m_jumpman.call(jpeg_crop_scanline, &m_jpeg, &xoffset, &width);
 
-		unsigned vstep = DCTSIZE * m_jpeg.max_v_samp_factor;
-		JSAMPROW row_index[MAX_PLANE_COUNT][DCTSIZE * MAX_SAMP_FACTOR];
-		JSAMPARRAY plane_index[MAX_PLANE_COUNT] = {
-			&row_index[0][0], &row_index[1][0], &row_index[2][0], &row_index[3][0],
-		};
+		if (rect.top && m_jumpman.call(jpeg_skip_scanlines, &m_jpeg, static_cast<JDIMENSION>(rect.top)) != rect.top)
+			throw error::CannotDecodeImage{ "error skipping JPEG scanlines" };
 
-		std::vector<JSAMPLE> discard_buf;
-		for (JDIMENSION i = 0; i < m_jpeg.output_height;) {
-			for (unsigned p = 0; p < m_format.plane_count; ++p) {
-				JDIMENSION row_offset = (i * m_jpeg.comp_info[p].v_samp_factor) / m_jpeg.max_v_samp_factor;
-				unsigned plane_step = (vstep * m_jpeg.comp_info[p].v_samp_factor + m_jpeg.max_v_samp_factor - 1) / m_jpeg.max_v_samp_factor;
+		unsigned components = m_jpeg.output_components;
+		FrameFormat region = format;
+		ImageRect plane_rect[MAX_PLANE_COUNT];
 
-				for (unsigned ii = 0; ii < plane_step; ++ii) {
-					if (row_offset >= m_format.plane[p].height) {
-						discard_buf.resize(m_format.plane[p].width + DCTSIZE * MAX_SAMP_FACTOR);
-						row_index[p][ii] = discard_buf.data();
-					} else {
-						row_index[p][ii] = reinterpret_cast<JSAMPLE *>(static_cast<uint8_t *>(buffer.data[p]) + row_offset * buffer.stride[p]);
-					}
-					++row_offset;
+		for (unsigned p = 0; p < format.plane_count; ++p) {
+			plane_rect[p] = subsample_rect(rect, sw[p], sh[p], format.plane[p]);
+			region.plane[p].width = plane_rect[p].width;
+			region.plane[p].height = plane_rect[p].height;
+		}
+		m_filter.reset(buffer, region, 1, m_layout, m_sample);
+		m_scanline.resize(static_cast<size_t>(m_jpeg.output_width) * components);
+
+		for (unsigned i = rect.top; i < rect.top + rect.height; ++i) {
+			JSAMPROW row = m_scanline.data();
+			if (m_jumpman.call(jpeg_read_scanlines, &m_jpeg, &row, 1) != 1)
+				throw error::CannotDecodeImage{ "error reading JPEG scanline" };
+
+			for (unsigned p = 0; p < format.plane_count; ++p) {
+				if (i % sh[p] || i / sh[p] - plane_rect[p].top >= plane_rect[p].height)
+					continue;
+
+				unsigned dst_row = i / sh[p] - plane_rect[p].top;
+				JSAMPLE *dst_p = static_cast<JSAMPLE *>(m_filter.row(p, dst_row));
+				const JSAMPLE *src_p = m_scanline.data() + (plane_rect[p].left * sw[p] - xoffset) * components + p;
+
+				for (unsigned j = 0; j < plane_rect[p].width; ++j) {
+					dst_p[j] = src_p[j * sw[p] * components];
 				}
+				m_filter.commit(p, dst_row);
 			}
-			i += m_jumpman.call(jpeg_read_raw_data, &m_jpeg, plane_index, vstep);
 		}
-		m_jumpman.call(jpeg_finish_decompress, &m_jpeg);
+
+		// Rows below the region are not decoded.
 		done();
+#else
+		throw error::UnsupportedOperation{ "JPEG region decoding requires libjpeg-turbo" };
+#endif
 	} catch (const std::bad_alloc &) {
 		throw error::OutOfMemory{};
 	}
+
+	size_t scratch_bytes() override
+	{
+		if (!is_constant_format(next_frame_format()))
+			return 0;
+
+		size_t bytes = 0;
+
+		// Images with more than one scan, progressive or not, are buffered by
+		// jpeglib as whole-image coefficient arrays.
+		if (m_jumpman.call(jpeg_has_multiple_scans, &m_jpeg)) {
+			for (int c = 0; c < m_jpeg.num_components; ++c) {
+				const jpeg_component_info &comp = m_jpeg.comp_info[c];
+				size_t h_blocks = m_jpeg.max_h_samp_factor * DCTSIZE;
+				size_t v_blocks = m_jpeg.max_v_samp_factor * DCTSIZE;
+				size_t width_in_blocks = (static_cast<size_t>(m_jpeg.image_width) * comp.h_samp_factor + h_blocks - 1) / h_blocks;
+				size_t height_in_blocks = (static_cast<size_t>(m_jpeg.image_height) * comp.v_samp_factor + v_blocks - 1) / v_blocks;
+
+				bytes += ceil_n(width_in_blocks, comp.h_samp_factor) * ceil_n(height_in_blocks, comp.v_samp_factor) * DCTSIZE2 * sizeof(JCOEF);
+			}
+		}
+
+		// Rows past the end of a plane in the final iMCU row are discarded.
+		if (m_jpeg.image_height % (DCTSIZE * m_jpeg.max_v_samp_factor)) {
+			unsigned width = 0;
+
+			for (unsigned p = 0; p < m_format.plane_count; ++p) {
+				width = std::max(width, m_format.plane[p].width);
+			}
+			bytes += (width + DCTSIZE * MAX_SAMP_FACTOR) * sizeof(JSAMPLE);
+		}
+
+		// Reordered scanlines are read into a temporary row.
+		if (m_layout.interleaved)
+			bytes += static_cast<size_t>(m_format.plane[0].width) * m_format.plane_count * sizeof(JSAMPLE);
+
+		// Converted samples are decoded into a band of iMCU rows first.
+		FrameFormat format = scaled_frame_format();
+
+		if (m_sample.bit_depth && (m_sample.bit_depth != BITS_IN_JSAMPLE || m_sample.floating_point))
+			bytes += StripBuffer::scratch_bytes(format, DCTSIZE * m_jpeg.max_v_samp_factor);
+		return bytes + BoxFilter::scratch_bytes(format, 1, m_layout, m_sample);
+	}
+
+	void reset(std::unique_ptr<IOContext> io) override
+	{
+		done();
+
+		m_io = std::move(io);
+		m_format = FileFormat{ ImageType::JPEG, 1 };
+		m_jpeg_source.bytes_in_buffer = 0;
+		m_jpeg_source.next_input_byte = nullptr;
+		m_alive = true;
+	}
+
+	void set_allocator(Allocator *allocator) override
+	{
+		ImageDecoder::set_allocator(allocator);
+		m_discard_buf = ScratchVector<JSAMPLE>(m_allocator);
+		m_scanline = ScratchVector<JSAMPLE>(m_allocator);
+		m_filter.set_allocator(m_allocator);
+		m_strip.set_allocator(m_allocator);
+		m_band.set_allocator(m_allocator);
+	}
 };
 
 } // namespace
@@ -287,13 +773,34 @@ int JPEGDecoderFactory::priority() const
 	return PRIORITY_HIGH;
 }
 
+ImageType JPEGDecoderFactory::type() const
+{
+	return ImageType::JPEG;
+}
+
+bool JPEGDecoderFactory::probe(const void *buf, size_t size) const
+{
+	return probe_jpeg(buf, size);
+}
+
+bool JPEGDecoderFactory::matches_extension(const char *path) const
+{
+	return is_matching_extension(path, jpeg_extensions.data(), jpeg_extensions.size());
+}
+
+bool JPEGDecoderFactory::probe_format(IOContext *io, FileFormat *format) const
+{
+	read_jpeg_header(io, format);
+	return true;
+}
+
 std::unique_ptr<ImageDecoder> JPEGDecoderFactory::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) try
 {
 	bool recognized;
 
 	if (format)
 		recognized = format->type == ImageType::JPEG;
-	else if (io->seekable())
+	else if (io->rewindable())
 		recognized = recognize_jpeg(io.get());
 	else
 		recognized = is_matching_extension(path, jpeg_extensions.data(), jpeg_extensions.size());
@@ -19,6 +19,14 @@ public:
 
 	int priority() const override;
 
+	ImageType type() const override;
+
+	bool probe(const void *buf, size_t size) const override;
+
+	bool matches_extension(const char *path) const override;
+
+	bool probe_format(IOContext *io, FileFormat *format) const override;
+
 	std::unique_ptr<ImageDecoder> create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) override;
 };
 
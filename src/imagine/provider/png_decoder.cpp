@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <csetjmp>
 #include <cstdio>
@@ -6,6 +7,8 @@
 #include <vector>
 #include <png.h>
 #include "libp2p/p2p.h"
+#include "common/allocator.h"
+#include "common/box_filter.h"
 #include "common/buffer.h"
 #include "common/decoder.h"
 #include "common/except.h"
@@ -14,6 +17,7 @@
 #include "common/io_context.h"
 #include "common/jumpman.h"
 #include "common/path.h"
+#include "common/strip_buffer.h"
 #include "png_decoder.h"
 
 #define IMAGINE_PNG_ENABLED
@@ -27,23 +31,27 @@ const std::array<const char *, 1> png_extensions{ { "png" } };
 
 const size_t PNG_MAGIC_LEN = 8;
 
+// Rows per band passed to a RowSink.
+const unsigned BAND_ROWS = 16;
+
 using packed_ay8 = im_p2p::byte_packed_444_be<uint8_t, uint16_t, im_p2p::make_mask(im_p2p::C__, im_p2p::C__, im_p2p::C_A, im_p2p::C_Y)>;
 using packed_ay16 = im_p2p::byte_packed_444_be<uint16_t, uint32_t, im_p2p::make_mask(im_p2p::C__, im_p2p::C__, im_p2p::C_A, im_p2p::C_Y)>;
 
 typedef void(*unpack_func)(const void *, void * const *, unsigned, unsigned);
 
+bool probe_png(const void *buf, size_t size)
+{
+	return size >= PNG_MAGIC_LEN && !png_sig_cmp(static_cast<png_bytep>(const_cast<void *>(buf)), 0, PNG_MAGIC_LEN);
+}
+
 bool recognize_png(IOContext *io)
 {
 	uint8_t vec[PNG_MAGIC_LEN];
 	IOContext::difference_type pos = io->tell();
-	bool ret = false;
-
-	io->read_all(vec, sizeof(vec));
-	if (!png_sig_cmp(vec, 0, sizeof(vec)))
-		ret = true;
+	size_t n = static_cast<size_t>(io->read(vec, sizeof(vec)));
 
 	io->seek_set(pos);
-	return ret;
+	return probe_png(vec, n);
 }
 
 ColorFamily translate_png_color(png_byte color_type, unsigned plane_count)
@@ -68,6 +76,108 @@ ColorFamily translate_png_color(png_byte color_type, unsigned plane_count)
 	}
 }
 
+uint32_t read_be32(const uint8_t *p)
+{
+	return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+bool is_valid_png_depth(unsigned color_type, unsigned depth)
+{
+	switch (color_type) {
+	case PNG_COLOR_TYPE_GRAY:
+		return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+	case PNG_COLOR_TYPE_PALETTE:
+		return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+	case PNG_COLOR_TYPE_RGB:
+	case PNG_COLOR_TYPE_GRAY_ALPHA:
+	case PNG_COLOR_TYPE_RGB_ALPHA:
+		return depth == 8 || depth == 16;
+	default:
+		return false;
+	}
+}
+
+// Read IHDR and the chunks preceding the image data, producing the same format as PNGDecoder.
+void read_png_header(IOContext *io, FileFormat *format)
+{
+	uint8_t buf[PNG_MAGIC_LEN + 8 + 13];
+	io->read_all(buf, sizeof(buf));
+
+	const uint8_t *ihdr = buf + PNG_MAGIC_LEN + 8;
+	if (!probe_png(buf, PNG_MAGIC_LEN))
+		throw error::CannotDecodeImage{ "not a PNG file" };
+	if (read_be32(buf + PNG_MAGIC_LEN) != 13 || memcmp(buf + PNG_MAGIC_LEN + 4, "IHDR", 4))
+		throw error::CannotDecodeImage{ "missing IHDR in PNG" };
+
+	uint32_t w = read_be32(ihdr);
+	uint32_t h = read_be32(ihdr + 4);
+	unsigned depth = ihdr[8];
+	unsigned color_type = ihdr[9];
+
+	if (!w || !h || w > PNG_UINT_31_MAX || h > PNG_UINT_31_MAX)
+		throw error::CannotDecodeImage{ "bad PNG dimensions" };
+	if (!is_valid_png_depth(color_type, depth))
+		throw error::CannotDecodeImage{ "bad PNG color_type or bit depth" };
+
+	// Skip the IHDR CRC.
+	io->discard(4);
+
+	// Look for a transparency chunk, which must precede the image data.
+	uint32_t palette_len = 0;
+	bool trns = false;
+
+	while (true) {
+		uint8_t chunk[8];
+		io->read_all(chunk, sizeof(chunk));
+
+		uint32_t len = read_be32(chunk);
+		if (!memcmp(chunk + 4, "IDAT", 4))
+			break;
+		if (!memcmp(chunk + 4, "IEND", 4))
+			throw error::CannotDecodeImage{ "no image data in PNG" };
+
+		if (!memcmp(chunk + 4, "PLTE", 4)) {
+			palette_len = len / 3;
+		} else if (!memcmp(chunk + 4, "tRNS", 4)) {
+			// libpng ignores malformed tRNS chunks.
+			if (color_type == PNG_COLOR_TYPE_GRAY)
+				trns = len == 2;
+			else if (color_type == PNG_COLOR_TYPE_RGB)
+				trns = len == 6;
+			else if (color_type == PNG_COLOR_TYPE_PALETTE)
+				trns = len && len <= palette_len;
+		}
+
+		io->discard(static_cast<IOContext::size_type>(len) + 4);
+	}
+
+	// Palette images are expanded to RGB and tRNS to an alpha channel.
+	unsigned channels = (color_type & PNG_COLOR_MASK_COLOR ? 3 : 1) + (color_type & PNG_COLOR_MASK_ALPHA || trns ? 1 : 0);
+
+	*format = FileFormat{ ImageType::PNG, 1 };
+	format->plane_count = channels;
+	for (unsigned p = 0; p < channels; ++p) {
+		format->plane[p].width = w;
+		format->plane[p].height = h;
+		format->plane[p].bit_depth = std::max(depth, 8U);
+	}
+
+	if (channels == 1)
+		format->color_family = ColorFamily::GRAY;
+	else if (channels == 2)
+		format->color_family = ColorFamily::GRAYALPHA;
+	else if (channels == 3)
+		format->color_family = ColorFamily::RGB;
+	else
+		format->color_family = ColorFamily::RGBA;
+}
+
+bool is_little_endian()
+{
+	const uint16_t x = 1;
+	return *reinterpret_cast<const uint8_t *>(&x) == 1;
+}
+
 unpack_func select_unpack(const FrameFormat &format)
 {
 	bool high_depth = format.plane[0].bit_depth > 8;
@@ -87,12 +197,37 @@ unpack_func select_unpack(const FrameFormat &format)
 	}
 }
 
+// Sample positions of the planes within the pixels returned by libPNG.
+void packed_positions(const FrameFormat &format, unsigned src_pos[MAX_PLANE_COUNT])
+{
+	static const unsigned rgb[] = { 0, 1, 2 };
+	static const unsigned argb[] = { 1, 2, 3, 0 };
+
+	if (format.color_family == ColorFamily::GRAYALPHA) {
+		src_pos[0] = 1;
+		src_pos[1] = 0;
+	} else {
+		std::copy_n(format.color_family == ColorFamily::RGBA ? argb : rgb, format.plane_count, src_pos);
+	}
+}
+
+// Whether packed samples need conversion to native order.
+bool swap_packed(const FrameFormat &format)
+{
+	return format.plane[0].bit_depth > 8 && format.color_family != ColorFamily::GRAY && is_little_endian();
+}
+
 class PNGDecoder : public ImageDecoder {
 	png_structp m_png;
 	png_infop m_png_info;
 	unsigned m_png_passes;
+	unsigned m_png_row;
 
 	std::unique_ptr<IOContext> m_io;
+	ScratchVector<uint8_t> m_row;
+	ScratchVector<uint8_t *> m_row_index;
+	BoxFilter m_filter;
+	StripBuffer m_strip;
 	FileFormat m_format;
 	Jumpman m_jumpman;
 	bool m_alive;
@@ -147,6 +282,10 @@ class PNGDecoder : public ImageDecoder {
 		// Swap R-G-B-A to A-R-G-B so that p2p can unpack it.
 		png_set_swap_alpha(m_png);
 
+		// Gray rows are copied without p2p, which converts the other layouts to native order.
+		if (depth == 16 && color_type == PNG_COLOR_TYPE_GRAY && is_little_endian())
+			png_set_swap(m_png);
+
 		m_format.plane_count = png_get_channels(m_png, m_png_info);
 		for (unsigned p = 0; p < m_format.plane_count; ++p) {
 			m_format.plane[p].width = w;
@@ -157,75 +296,159 @@ class PNGDecoder : public ImageDecoder {
 		m_format.color_family = translate_png_color(color_type, m_format.plane_count);
 	}
 
-	void decode_one_pass(const OutputBuffer &buffer) try
+	// Unpack the columns of a row within the region.
+	void unpack_row(const uint8_t *row, void *dst_p[MAX_PLANE_COUNT], unpack_func unpack, const ImageRect &rect)
 	{
-		png_size_t rowsize = png_get_rowbytes(m_png, m_png_info);
-		std::vector<uint8_t> row(rowsize);
+		size_t pixel_size = png_get_rowbytes(m_png, m_png_info) / m_format.plane[0].width;
+		const uint8_t *src_p = row + rect.left * pixel_size;
 
-		if (SIZE_MAX / rowsize < m_format.plane[0].height)
-			throw error::OutOfMemory{};
+		if (m_format.color_family == ColorFamily::GRAYALPHA)
+			dst_p[3] = dst_p[1];
+		if (unpack)
+			unpack(src_p, dst_p, 0, rect.width);
+		else
+			std::copy_n(src_p, rect.width * pixel_size, static_cast<uint8_t *>(dst_p[0]));
+	}
 
+	// Write the columns of a row within the region to output row i.
+	void write_row(const uint8_t *row, unsigned i, unpack_func unpack, const ImageRect &rect)
+	{
+		size_t pixel_size = png_get_rowbytes(m_png, m_png_info) / m_format.plane[0].width;
+		unsigned src_pos[MAX_PLANE_COUNT];
 		void *dst_p[MAX_PLANE_COUNT] = {};
+
+		packed_positions(m_format, src_pos);
+		if (m_filter.pack(i, 0, rect.width, row + rect.left * pixel_size, m_format.plane_count, src_pos, swap_packed(m_format)))
+			return;
+
 		for (unsigned p = 0; p < m_format.plane_count; ++p) {
-			dst_p[p] = buffer.data[p];
+			dst_p[p] = m_filter.row(p, i);
 		}
 
+		unpack_row(row, dst_p, unpack, rect);
+
+		for (unsigned p = 0; p < m_format.plane_count; ++p) {
+			m_filter.commit(p, i);
+		}
+	}
+
+	// Whether rows from libPNG are already in the interleaved output order.
+	bool in_output_order() const
+	{
+		unsigned src_pos[MAX_PLANE_COUNT];
+		packed_positions(m_format, src_pos);
+
+		for (unsigned k = 0; k < m_format.plane_count; ++k) {
+			if (src_pos[m_layout.order[k]] != k)
+				return false;
+		}
+		return !swap_packed(m_format);
+	}
+
+	void decode_one_pass(const ImageRect &rect) try
+	{
+		png_size_t rowsize = png_get_rowbytes(m_png, m_png_info);
+
+		if (SIZE_MAX / rowsize < m_format.plane[0].height)
+			throw error::OutOfMemory{};
+
 		unpack_func unpack = select_unpack(m_format);
+		bool full_width = rect.left == 0 && rect.width == m_format.plane[0].width;
+		bool direct = full_width && (m_filter.packed() ? !m_filter.converting() && in_output_order() : !unpack);
 
-		for (unsigned i = 0; i < m_format.plane[0].height; ++i) {
-			m_jumpman.call(png_read_row, m_png, unpack ? row.data() : static_cast<uint8_t *>(dst_p[0]), nullptr);
+		im_assert_d(m_png_row <= rect.top, "rows already read");
 
-			if (m_format.color_family == ColorFamily::GRAYALPHA)
-				dst_p[3] = dst_p[1];
-			if (unpack)
-				unpack(row.data(), dst_p, 0, m_format.plane[0].width);
+		// Rows above the region are read into the scratch row even when direct.
+		if (!direct || m_png_row < rect.top)
+			m_row.resize(rowsize);
 
-			for (unsigned p = 0; p < m_format.plane_count; ++p) {
-				dst_p[p] = static_cast<uint8_t *>(dst_p[p]) + buffer.stride[p];
-			}
+		// Rows below the region are not read.
+		for (unsigned i = m_png_row; i < rect.top + rect.height; ++i) {
+			bool in_rect = i >= rect.top;
+			void *dst = m_row.data();
+
+			if (in_rect && direct)
+				dst = m_filter.packed() ? m_filter.packed_row(i - rect.top) : m_filter.row(0, i - rect.top);
+
+			m_jumpman.call(png_read_row, m_png, static_cast<uint8_t *>(dst), nullptr);
+			if (!in_rect)
+				continue;
+
+			if (!direct)
+				write_row(m_row.data(), i - rect.top, unpack, rect);
+			else if (!m_filter.packed())
+				m_filter.commit(0, i - rect.top);
 		}
+		m_png_row = rect.top + rect.height;
 	} catch (const std::bad_alloc &) {
 		throw error::OutOfMemory{};
 	}
 
-	void decode_interlaced(const OutputBuffer &buffer) try
+	void decode_interlaced(const ImageRect &rect) try
 	{
 		png_size_t rowsize = png_get_rowbytes(m_png, m_png_info);
 
 		if (SIZE_MAX / rowsize < m_format.plane[0].height)
 			throw error::OutOfMemory{};
 
-		std::vector<uint8_t> image(rowsize * m_format.plane[0].height);
-		std::vector<uint8_t *> row_index(m_format.plane[0].height);
+		// The image is read on the first call and kept for subsequent bands.
+		if (!m_png_row) {
+			m_row.resize(rowsize * m_format.plane[0].height);
+			m_row_index.resize(m_format.plane[0].height);
 
-		for (unsigned i = 0; i < m_format.plane[0].height; ++i) {
-			row_index[i] = image.data() + i * rowsize;
-		}
-		for (unsigned pass = 0; pass < m_png_passes; ++pass) {
-			m_jumpman.call(png_read_image, m_png, row_index.data());
-		}
-
-		void *dst_p[MAX_PLANE_COUNT] = {};
-		for (unsigned p = 0; p < m_format.plane_count; ++p) {
-			dst_p[p] = buffer.data[p];
+			for (unsigned i = 0; i < m_format.plane[0].height; ++i) {
+				m_row_index[i] = m_row.data() + i * rowsize;
+			}
+			// png_read_image performs all of the interlace passes.
+			m_jumpman.call(png_read_image, m_png, m_row_index.data());
+			m_png_row = m_format.plane[0].height;
 		}
 
 		unpack_func unpack = select_unpack(m_format);
 
-		for (unsigned i = 0; i < m_format.plane[0].height; ++i) {
-			if (m_format.color_family == ColorFamily::GRAYALPHA)
-				dst_p[3] = dst_p[1];
-			if (unpack)
-				unpack(image.data() + i * rowsize, dst_p, 0, m_format.plane[0].width);
-
-			for (unsigned p = 0; p < m_format.plane_count; ++p) {
-				dst_p[p] = static_cast<uint8_t *>(dst_p[p]) + buffer.stride[p];
-			}
+		for (unsigned i = 0; i < rect.height; ++i) {
+			write_row(m_row.data() + (rect.top + i) * rowsize, i, unpack, rect);
 		}
 	} catch (const std::bad_alloc &) {
 		throw error::OutOfMemory{};
 	}
 
+	// Decode a rectangle of the scaled frame.
+	void decode_rect(const OutputBuffer &buffer, const ImageRect &rect)
+	{
+		check_layout(next_frame_format());
+
+		ImageRect src = unscale_rect(rect, m_scale_denom, m_format.plane[0]);
+		FrameFormat region = m_format;
+
+		for (unsigned p = 0; p < region.plane_count; ++p) {
+			region.plane[p].width = src.width;
+			region.plane[p].height = src.height;
+		}
+		m_filter.reset(buffer, region, m_scale_denom, m_layout, m_sample);
+
+		if (m_png_passes == 1)
+			decode_one_pass(src);
+		else
+			decode_interlaced(src);
+	}
+
+	void init()
+	{
+		try {
+			m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+			m_png_info = png_create_info_struct(m_png);
+			png_set_read_fn(m_png, this, &PNGDecoder::read_fn);
+			png_set_error_fn(m_png, this, &PNGDecoder::error_fn, nullptr);
+		} catch (...) {
+			png_destroy_read_struct(&m_png, &m_png_info, nullptr);
+			throw;
+		}
+
+		m_png_row = 0;
+		m_alive = true;
+	}
+
 	void done()
 	{
 		png_destroy_read_struct(&m_png, &m_png_info, nullptr);
@@ -236,22 +459,17 @@ public:
 		m_png{},
 		m_png_info{},
 		m_png_passes{},
+		m_png_row{},
 		m_io{ std::move(io) },
+		m_row(m_allocator),
+		m_row_index(m_allocator),
+		m_filter{ m_allocator },
+		m_strip{ m_allocator },
 		m_format{ ImageType::PNG, 1 },
 		m_jumpman{ [](void *) { throw error::CannotDecodeImage{ "pnglib error" }; }, nullptr },
 		m_alive{}
 	{
-		try {
-			m_png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-			m_png_info = png_create_info_struct(m_png);
-			png_set_read_fn(m_png, this, &PNGDecoder::read_fn);
-			png_set_error_fn(m_png, this, &PNGDecoder::error_fn, nullptr);
-		} catch (...) {
-			png_destroy_read_struct(&m_png, &m_png_info, nullptr);
-			throw;
-		}
-
-		m_alive = true;
+		init();
 	}
 
 	~PNGDecoder()
@@ -274,7 +492,7 @@ public:
 
 	FrameFormat next_frame_format() override
 	{
-		return m_alive ? file_format() : FrameFormat{};
+		return m_alive ? convert_frame_format(scale_frame_format(file_format(), m_scale_denom), m_sample) : FrameFormat{};
 	}
 
 	void decode(const OutputBuffer &buffer) override
@@ -282,14 +500,90 @@ public:
 		if (!m_alive)
 			return;
 
-		if (m_png_passes == 1)
-			decode_one_pass(buffer);
-		else
-			decode_interlaced(buffer);
+		decode_rect(buffer, full_frame_rect(next_frame_format()));
+
+		m_jumpman.call(png_read_end, m_png, nullptr);
+		done();
+	}
+
+	void decode_region(const OutputBuffer &buffer, const ImageRect &rect) override
+	{
+		if (!m_alive)
+			return;
+
+		check_region(next_frame_format(), rect);
+		decode_rect(buffer, rect);
+
+		// The remaining rows are abandoned along with the read struct.
+		done();
+	}
+
+	void decode_rows(RowSink &sink) override
+	{
+		if (!m_alive)
+			return;
+
+		FrameFormat format = next_frame_format();
+		unsigned height = format.plane[0].height;
+
+		check_layout(format);
+		m_strip.reset(format, std::min(BAND_ROWS, height), m_layout);
+
+		for (unsigned top = 0; top < height; top += m_strip.rows()) {
+			unsigned rows = std::min(m_strip.rows(), height - top);
+
+			decode_rect(m_strip.buffer(), { 0, top, format.plane[0].width, rows });
+
+			// The remaining rows are abandoned along with the read struct.
+			if (!m_strip.flush(sink, top, rows)) {
+				done();
+				return;
+			}
+		}
 
 		m_jumpman.call(png_read_end, m_png, nullptr);
 		done();
 	}
+
+	size_t scratch_bytes() override
+	{
+		if (!is_constant_format(next_frame_format()))
+			return 0;
+
+		png_size_t rowsize = png_get_rowbytes(m_png, m_png_info);
+		size_t height = m_format.plane[0].height;
+		size_t filter_bytes = BoxFilter::scratch_bytes(m_format, m_scale_denom, m_layout, m_sample);
+
+		if (m_png_passes == 1)
+			return rowsize + filter_bytes;
+
+		// Interlaced images are buffered whole.
+		if ((SIZE_MAX - height * sizeof(uint8_t *) - filter_bytes) / rowsize < height)
+			return SIZE_MAX;
+
+		return rowsize * height + height * sizeof(uint8_t *) + filter_bytes;
+	}
+
+	void reset(std::unique_ptr<IOContext> io) override
+	{
+		// libpng has no public interface to rewind a read struct, so only the
+		// row buffers carry over.
+		done();
+
+		m_io = std::move(io);
+		m_format = FileFormat{ ImageType::PNG, 1 };
+		m_png_passes = 0;
+		init();
+	}
+
+	void set_allocator(Allocator *allocator) override
+	{
+		ImageDecoder::set_allocator(allocator);
+		m_row = ScratchVector<uint8_t>(m_allocator);
+		m_row_index = ScratchVector<uint8_t *>(m_allocator);
+		m_filter.set_allocator(m_allocator);
+		m_strip.set_allocator(m_allocator);
+	}
 };
 
 } // namespace
@@ -305,13 +599,34 @@ int PNGDecoderFactory::priority() const
 	return PRIORITY_HIGH;
 }
 
+ImageType PNGDecoderFactory::type() const
+{
+	return ImageType::PNG;
+}
+
+bool PNGDecoderFactory::probe(const void *buf, size_t size) const
+{
+	return probe_png(buf, size);
+}
+
+bool PNGDecoderFactory::matches_extension(const char *path) const
+{
+	return is_matching_extension(path, png_extensions.data(), png_extensions.size());
+}
+
+bool PNGDecoderFactory::probe_format(IOContext *io, FileFormat *format) const
+{
+	read_png_header(io, format);
+	return true;
+}
+
 std::unique_ptr<ImageDecoder> PNGDecoderFactory::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io)
 {
 	bool recognized;
 
 	if (format)
 		recognized = format->type == ImageType::PNG;
-	else if (io->seekable())
+	else if (io->rewindable())
 		recognized = recognize_png(io.get());
 	else
 		recognized = is_matching_extension(path, png_extensions.data(), png_extensions.size());
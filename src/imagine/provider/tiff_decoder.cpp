@@ -7,12 +7,16 @@
 #include <utility>
 #include <vector>
 #include <tiffio.h>
+#include "common/allocator.h"
+#include "common/box_filter.h"
 #include "common/buffer.h"
+#include "common/decoder.h"
 #include "common/except.h"
 #include "common/format.h"
 #include "common/im_assert.h"
 #include "common/io_context.h"
 #include "common/path.h"
+#include "common/strip_buffer.h"
 #include "tiff_decoder.h"
 
 namespace imagine {
@@ -21,21 +25,27 @@ namespace {
 const char TIFF_DECODER_NAME[] = "tiff";
 const std::array<const char *, 2> tiff_extensions{ "tiff", "tif" };
 
+// Compressed strips and tiles are fetched in batches of up to this many bytes or striles.
+const size_t STRILE_BATCH_BYTES = 4UL << 20;
+const size_t STRILE_BATCH_COUNT = 1024;
+
 const size_t TIFF_MAGIC_LEN = 4;
 const uint8_t tiff_be_magic[4] = { 0x4D, 0x4D, 0x00, 0x2A };
 const uint8_t tiff_le_magic[4] = { 0x49, 0x49, 0x2A, 0x00 };
 
+bool probe_tiff(const void *buf, size_t size)
+{
+	return size >= TIFF_MAGIC_LEN && (!memcmp(buf, tiff_be_magic, TIFF_MAGIC_LEN) || !memcmp(buf, tiff_le_magic, TIFF_MAGIC_LEN));
+}
+
 bool recognize_tiff(IOContext *io)
 {
 	uint8_t vec[TIFF_MAGIC_LEN];
 	IOContext::difference_type pos = io->tell();
-	bool ret = false;
+	size_t n = static_cast<size_t>(io->read(vec, sizeof(vec)));
 
-	io->read_all(vec, TIFF_MAGIC_LEN);
-	ret = !memcmp(vec, tiff_be_magic, sizeof(vec)) || !memcmp(vec, tiff_le_magic, sizeof(vec));
 	io->seek_set(pos);
-
-	return ret;
+	return probe_tiff(vec, n);
 }
 
 void depalettize(void * const dst[3], const void *src, unsigned n, const uint16 * const palette[3], unsigned palette_depth)
@@ -108,6 +118,254 @@ void unpack(void * const dst[4], const void *src, unsigned n, unsigned planes, u
 }
 
 
+struct tiff_fields {
+	uint32 width;
+	uint32 height;
+	uint16 bits_per_sample;
+	uint16 photometric;
+	uint16 samples_per_pixel;
+	uint16 extrasamples;
+	uint16 extrasample_type;
+	uint16 subsample_w;
+	uint16 subsample_h;
+};
+
+void translate_tiff_fields(const tiff_fields &fields, FrameFormat *format)
+{
+	uint16 depth = fields.bits_per_sample;
+	uint16 samplesperpel = fields.samples_per_pixel;
+	uint16 extrasamples = fields.extrasamples;
+
+	if (depth > 16)
+		throw error::CannotDecodeImage{ "bit depth too great" };
+
+	switch (fields.photometric) {
+	case PHOTOMETRIC_MINISWHITE:
+	case PHOTOMETRIC_MINISBLACK:
+		format->color_family = ColorFamily::GRAY;
+		break;
+	case PHOTOMETRIC_RGB:
+		format->color_family = ColorFamily::RGB;
+		break;
+	case PHOTOMETRIC_PALETTE:
+		format->color_family = ColorFamily::RGB;
+		depth = 16;
+		samplesperpel = 3;
+		break;
+	case PHOTOMETRIC_YCBCR:
+		format->color_family = ColorFamily::YUV;
+		break;
+	default:
+		throw error::CannotDecodeImage{ "unknown TIFF photometric intent" };
+	}
+
+	if (extrasamples) {
+		if (extrasamples > 1)
+			throw error::CannotDecodeImage{ "too many extrasamples in TIFF" };
+
+		if (fields.extrasample_type == EXTRASAMPLE_ASSOCALPHA) {
+			switch (format->color_family) {
+			case ColorFamily::GRAY:
+				format->color_family = ColorFamily::GRAYALPHA;
+				break;
+			case ColorFamily::RGB:
+				format->color_family = ColorFamily::RGBA;
+				break;
+			case ColorFamily::YUV:
+				format->color_family = ColorFamily::YUVA;
+				break;
+			default:
+				throw error::CannotDecodeImage{ "alpha channel not supported in color family" };
+			}
+		} else {
+			throw error::CannotDecodeImage{ "unsupported extrasamples type in TIFF" };
+		}
+	}
+
+	switch (fields.photometric) {
+	case PHOTOMETRIC_MINISWHITE:
+	case PHOTOMETRIC_MINISBLACK:
+		if (samplesperpel != 1 + extrasamples)
+			throw error::CannotDecodeImage{ "too many samples in greyscale TIFF" };
+		break;
+	case PHOTOMETRIC_PALETTE:
+		if (extrasamples)
+			throw error::CannotDecodeImage{ "extrasamples not supported in paletted TIFF" };
+		break;
+	case PHOTOMETRIC_RGB:
+	case PHOTOMETRIC_YCBCR:
+		if (samplesperpel != 3 + extrasamples)
+			throw error::CannotDecodeImage{ "too many samples in color TIFF" };
+		break;
+	default:
+		break;
+	}
+
+	for (unsigned p = 0; p < samplesperpel; ++p) {
+		uint16 sw = (p == 1 || p == 2) ? fields.subsample_w : 1;
+		uint16 sh = (p == 1 || p == 2) ? fields.subsample_h : 1;
+
+		format->plane[p].width = fields.width / sw;
+		format->plane[p].height = fields.height / sh;
+		format->plane[p].bit_depth = depth;
+		format->plane[p].floating_point = false;
+	}
+	format->plane_count = samplesperpel;
+}
+
+class TIFFHeaderReader {
+	static const size_t IFD_ENTRY_SIZE = 12;
+	static const unsigned MAX_VALUES = 8;
+
+	IOContext *m_io;
+	bool m_big_endian;
+
+	uint16 get16(const uint8 *p) const
+	{
+		return m_big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+	}
+
+	uint32 get32(const uint8 *p) const
+	{
+		return m_big_endian ? (static_cast<uint32>(get16(p)) << 16) | get16(p + 2) : (static_cast<uint32>(get16(p + 2)) << 16) | get16(p);
+	}
+
+	// Read up to MAX_VALUES integer values of an entry. Returns the number of values read.
+	unsigned read_values(const uint8 *entry, uint32 *values)
+	{
+		uint16 type = get16(entry + 2);
+		uint32 count = get32(entry + 4);
+		size_t size;
+
+		if (type == TIFF_SHORT)
+			size = 2;
+		else if (type == TIFF_LONG)
+			size = 4;
+		else
+			return 0;
+
+		unsigned n = static_cast<unsigned>(std::min(count, static_cast<uint32>(MAX_VALUES)));
+		uint8 buf[MAX_VALUES * 4];
+		const uint8 *data = entry + 8;
+
+		if (count * size > 4) {
+			m_io->seek_set(get32(entry + 8));
+			m_io->read_all(buf, n * size);
+			data = buf;
+		}
+
+		for (unsigned i = 0; i < n; ++i) {
+			values[i] = size == 2 ? get16(data + i * 2) : get32(data + i * 4);
+		}
+		return n;
+	}
+public:
+	explicit TIFFHeaderReader(IOContext *io) : m_io{ io }, m_big_endian{} {}
+
+	// Read the format from the first IFD. Returns false for files that need libtiff to interpret.
+	bool read(FileFormat *format) try
+	{
+		uint8 header[8];
+		m_io->read_all(header, sizeof(header));
+
+		if (!memcmp(header, tiff_be_magic, TIFF_MAGIC_LEN))
+			m_big_endian = true;
+		else if (memcmp(header, tiff_le_magic, TIFF_MAGIC_LEN))
+			return false;
+
+		m_io->seek_set(get32(header + 4));
+
+		uint8 count_buf[2];
+		m_io->read_all(count_buf, sizeof(count_buf));
+
+		std::vector<uint8> entries(get16(count_buf) * IFD_ENTRY_SIZE);
+		uint8 next_ifd[4];
+		m_io->read_all(entries.data(), entries.size());
+		m_io->read_all(next_ifd, sizeof(next_ifd));
+
+		// Multi-page files do not have a constant format.
+		if (get32(next_ifd)) {
+			*format = FileFormat{ ImageType::TIFF };
+			return true;
+		}
+
+		tiff_fields fields{};
+		bool have_width = false;
+		bool have_height = false;
+		bool have_depth = false;
+		bool have_photometric = false;
+		bool have_samples = false;
+		bool have_subsampling = false;
+
+		fields.subsample_w = 1;
+		fields.subsample_h = 1;
+
+		for (size_t i = 0; i < entries.size(); i += IFD_ENTRY_SIZE) {
+			const uint8 *entry = entries.data() + i;
+			uint32 values[MAX_VALUES];
+			unsigned n;
+
+			switch (get16(entry)) {
+			case TIFFTAG_IMAGEWIDTH:
+				if (!(have_width = read_values(entry, values) == 1))
+					return false;
+				fields.width = values[0];
+				break;
+			case TIFFTAG_IMAGELENGTH:
+				if (!(have_height = read_values(entry, values) == 1))
+					return false;
+				fields.height = values[0];
+				break;
+			case TIFFTAG_BITSPERSAMPLE:
+				if (!(n = read_values(entry, values)))
+					return false;
+				// Let libtiff diagnose differing sample sizes.
+				if (static_cast<unsigned>(std::count(values, values + n, values[0])) != n)
+					return false;
+				fields.bits_per_sample = values[0];
+				have_depth = true;
+				break;
+			case TIFFTAG_PHOTOMETRIC:
+				if (!(have_photometric = read_values(entry, values) == 1))
+					return false;
+				fields.photometric = values[0];
+				break;
+			case TIFFTAG_SAMPLESPERPIXEL:
+				if (!(have_samples = read_values(entry, values) == 1))
+					return false;
+				fields.samples_per_pixel = values[0];
+				break;
+			case TIFFTAG_EXTRASAMPLES:
+				if (!(n = read_values(entry, values)))
+					break;
+				fields.extrasamples = static_cast<uint16>(get32(entry + 4));
+				fields.extrasample_type = values[0];
+				break;
+			case TIFFTAG_YCBCRSUBSAMPLING:
+				if (!(have_subsampling = read_values(entry, values) == 2))
+					return false;
+				fields.subsample_w = values[0];
+				fields.subsample_h = values[1];
+				break;
+			default:
+				break;
+			}
+		}
+
+		// Missing tags are defaulted or reported by libtiff.
+		if (!have_width || !have_height || !have_depth || !have_photometric || !have_samples)
+			return false;
+		if (fields.photometric == PHOTOMETRIC_YCBCR && !have_subsampling)
+			return false;
+
+		*format = FileFormat{ ImageType::TIFF };
+		translate_tiff_fields(fields, format);
+		return true;
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+};
+
 class TIFFDecoder : public ImageDecoder {
 	struct decode_state {
 		uint32 image_width;
@@ -128,6 +386,11 @@ class TIFFDecoder : public ImageDecoder {
 	std::unique_ptr<TIFF, tiff_delete> m_tiff;
 	std::exception_ptr m_exception;
 	std::unique_ptr<IOContext> m_io;
+	ScratchVector<uint8> m_strile_data;
+	ScratchVector<uint8> m_raw_data;
+	ScratchVector<IOContext::ReadRange> m_ranges;
+	BoxFilter m_filter;
+	StripBuffer m_strip;
 	FileFormat m_file_format;
 	FrameFormat m_frame_format;
 	bool m_initial;
@@ -185,109 +448,34 @@ class TIFFDecoder : public ImageDecoder {
 	void current_directory_format(FrameFormat *format)
 	{
 		TIFF *tiff = m_tiff.get();
-		uint32_t w, h;
-		uint16 depth;
-		uint16 photometric;
-		uint16 samplesperpel;
+		tiff_fields fields{};
 
-		if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &w))
+		if (!TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &fields.width))
 			throw error::CannotDecodeImage{ "no IMAGEWIDTH tag in TIFF" };
-		if (!TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &h))
+		if (!TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &fields.height))
 			throw error::CannotDecodeImage{ "no IMAGEHEIGHT tag in TIFF" };
-		if (!TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &depth))
+		if (!TIFFGetField(tiff, TIFFTAG_BITSPERSAMPLE, &fields.bits_per_sample))
 			throw error::CannotDecodeImage{ "no BITSPERSAMPLE tag in TIFF" };
-		if (!TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &photometric))
+		if (!TIFFGetField(tiff, TIFFTAG_PHOTOMETRIC, &fields.photometric))
 			throw error::CannotDecodeImage{ "no PHOTOMETRIC tag in TIFF" };
-		if (!TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &samplesperpel))
+		if (!TIFFGetField(tiff, TIFFTAG_SAMPLESPERPIXEL, &fields.samples_per_pixel))
 			throw error::CannotDecodeImage{ "no SAMPLESPERPEL tag in TIFF" };
 
-		if (depth > 16)
-			throw error::CannotDecodeImage{ "bit depth too great" };
-
-		switch (photometric) {
-		case PHOTOMETRIC_MINISWHITE:
-		case PHOTOMETRIC_MINISBLACK:
-			format->color_family = ColorFamily::GRAY;
-			break;
-		case PHOTOMETRIC_RGB:
-			format->color_family = ColorFamily::RGB;
-			break;
-		case PHOTOMETRIC_PALETTE:
-			format->color_family = ColorFamily::RGB;
-			depth = 16;
-			samplesperpel = 3;
-			break;
-		case PHOTOMETRIC_YCBCR:
-			format->color_family = ColorFamily::YUV;
-			break;
-		default:
-			throw error::CannotDecodeImage{ "unknown TIFF photometric intent" };
-		}
-
-		uint16 extrasamples;
 		uint16 *extrasamples_type;
-		if (TIFFGetField(tiff, TIFFTAG_EXTRASAMPLES, &extrasamples, &extrasamples_type) && extrasamples) {
-			if (extrasamples > 1)
-				throw error::CannotDecodeImage{ "too many extrasamples in TIFF" };
-
-			if (extrasamples_type[0] == EXTRASAMPLE_ASSOCALPHA) {
-				switch (format->color_family) {
-				case ColorFamily::GRAY:
-					format->color_family = ColorFamily::GRAYALPHA;
-					break;
-				case ColorFamily::RGB:
-					format->color_family = ColorFamily::RGBA;
-					break;
-				case ColorFamily::YUV:
-					format->color_family = ColorFamily::YUVA;
-					break;
-				default:
-					throw error::CannotDecodeImage{ "alpha channel not supported in color family" };
-				}
-			} else {
-				throw error::CannotDecodeImage{ "unsupported extrasamples type in TIFF" };
-			}
-		} else {
-			extrasamples = 0;
-		}
-
-		switch (photometric) {
-		case PHOTOMETRIC_MINISWHITE:
-		case PHOTOMETRIC_MINISBLACK:
-			if (samplesperpel != 1 + extrasamples)
-				throw error::CannotDecodeImage{ "too many samples in greyscale TIFF" };
-			break;
-		case PHOTOMETRIC_PALETTE:
-			if (extrasamples)
-				throw error::CannotDecodeImage{ "extrasamples not supported in paletted TIFF" };
-			break;
-		case PHOTOMETRIC_RGB:
-		case PHOTOMETRIC_YCBCR:
-			if (samplesperpel != 3 + extrasamples)
-				throw error::CannotDecodeImage{ "too many samples in color TIFF" };
-			break;
-		default:
-			break;
-		}
-
-		uint16 subsample_w = 1;
-		uint16 subsample_h = 1;
-		if (photometric == PHOTOMETRIC_YCBCR &&
-			!TIFFGetField(tiff, TIFFTAG_YCBCRSUBSAMPLING, &subsample_w, &subsample_h))
+		if (TIFFGetField(tiff, TIFFTAG_EXTRASAMPLES, &fields.extrasamples, &extrasamples_type) && fields.extrasamples)
+			fields.extrasample_type = extrasamples_type[0];
+		else
+			fields.extrasamples = 0;
+
+		fields.subsample_w = 1;
+		fields.subsample_h = 1;
+		if (fields.photometric == PHOTOMETRIC_YCBCR &&
+			!TIFFGetField(tiff, TIFFTAG_YCBCRSUBSAMPLING, &fields.subsample_w, &fields.subsample_h))
 		{
 			throw error::CannotDecodeImage{ "missing YCBCRSUBSAMPLING tag in YUV TIFF" };
 		}
 
-		for (unsigned p = 0; p < samplesperpel; ++p) {
-			uint16 sw = (p == 1 || p == 2) ? subsample_w : 1;
-			uint16 sh = (p == 1 || p == 2) ? subsample_h : 1;
-
-			format->plane[p].width = w / sw;
-			format->plane[p].height = h / sh;
-			format->plane[p].bit_depth = depth;
-			format->plane[p].floating_point = false;
-		}
-		format->plane_count = samplesperpel;
+		translate_tiff_fields(fields, format);
 	}
 
 	void decode_header()
@@ -324,39 +512,193 @@ class TIFFDecoder : public ImageDecoder {
 		{
 			throw error::CannotDecodeImage{ "missing COLORMAP tag in TIFF" };
 		}
+
+		state.subsample_w = 1;
+		state.subsample_h = 1;
 		if (state.photometric == PHOTOMETRIC_YCBCR)
 			TIFFGetField(tiff, TIFFTAG_YCBCRSUBSAMPLING, &state.subsample_w, &state.subsample_h);
 
 		return state;
 	}
 
-	void decode_strips(const OutputBuffer &buffer)
+	// Rows in each strip, which is the whole image if the tag is absent.
+	uint32 get_rows_per_strip(uint32 image_height)
+	{
+		uint32 rows_per_strip;
+
+		if (!TIFFGetField(m_tiff.get(), TIFFTAG_ROWSPERSTRIP, &rows_per_strip) || rows_per_strip > image_height)
+			rows_per_strip = image_height;
+		if (!rows_per_strip)
+			throw error::CannotDecodeImage{ "bad RowsPerStrip in TIFF" };
+		return rows_per_strip;
+	}
+
+	// Decoded size of a strip or tile, accounting for the shorter final strip.
+	tmsize_t strile_decoded_size(uint32 strile)
+	{
+		TIFF *tiff = m_tiff.get();
+		uint32 image_height;
+
+		if (TIFFIsTiled(tiff))
+			return TIFFTileSize(tiff);
+
+		TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &image_height);
+
+		uint32 rows_per_strip = get_rows_per_strip(image_height);
+		uint32 strips_per_plane = (image_height + rows_per_strip - 1) / rows_per_strip;
+		uint32 row = strile % strips_per_plane * rows_per_strip;
+		return TIFFVStripSize(tiff, std::min(rows_per_strip, image_height - row));
+	}
+
+#if TIFFLIB_VERSION >= 20191103
+	// Read the compressed data of up to count consecutive strips or tiles in one request.
+	// Returns the number of striles fetched, which is zero if the first is left to libtiff.
+	uint32 fetch_striles(uint32 first, uint32 count)
+	{
+		if (!m_io->seekable())
+			return 0;
+
+		TIFF *tiff = m_tiff.get();
+		size_t raw_size = 0;
+
+		m_ranges.clear();
+
+		for (uint32 k = 0; k < count && m_ranges.size() < STRILE_BATCH_COUNT; ++k) {
+			uint64 off = TIFFGetStrileOffset(tiff, first + k);
+			uint64 bytes = TIFFGetStrileByteCount(tiff, first + k);
+
+			// Leave sparse and oversized striles to libtiff.
+			if (!off || !bytes || bytes > STRILE_BATCH_BYTES - raw_size)
+				break;
+
+			m_ranges.push_back({ static_cast<IOContext::difference_type>(off), bytes, nullptr });
+			raw_size += static_cast<size_t>(bytes);
+		}
+		if (m_ranges.empty())
+			return 0;
+
+		m_raw_data.resize(raw_size);
+
+		uint8 *raw_p = m_raw_data.data();
+		for (IOContext::ReadRange &range : m_ranges) {
+			range.buf = raw_p;
+			raw_p += range.count;
+		}
+		m_io->read_ranges(m_ranges.data(), m_ranges.size());
+
+		return static_cast<uint32>(m_ranges.size());
+	}
+#endif
+
+	// Decode a strip or tile into the strile buffer, from fetched data if given.
+	void decode_strile(uint32 strile, const IOContext::ReadRange *raw)
+	{
+		TIFF *tiff = m_tiff.get();
+		bool tiled = TIFFIsTiled(tiff);
+		tmsize_t strile_size = static_cast<tmsize_t>(m_strile_data.size());
+		bool ok = false;
+
+		if (raw) {
+#if TIFFLIB_VERSION >= 20191103
+			tmsize_t out_size = std::min(strile_decoded_size(strile), strile_size);
+			ok = !!TIFFReadFromUserBuffer(tiff, strile, raw->buf, static_cast<tmsize_t>(raw->count), m_strile_data.data(), out_size);
+#endif
+		} else {
+			tmsize_t ret = tiled ? TIFFReadEncodedTile(tiff, strile, m_strile_data.data(), strile_size)
+			                     : TIFFReadEncodedStrip(tiff, strile, m_strile_data.data(), strile_size);
+			ok = ret >= 0;
+		}
+
+		if (!ok) {
+			throw_saved_exception();
+			throw error::CannotDecodeImage{ tiled ? "error decoding TIFF tile" : "error decoding TIFF strip" };
+		}
+	}
+
+	// Decode count consecutive strips or tiles one at a time, passing each to func.
+	// The compressed data is fetched in batches.
+	template <class Func>
+	void for_each_strile(uint32 first, uint32 count, size_t strile_size, Func func)
+	{
+		m_strile_data.resize(strile_size);
+
+		for (uint32 k = 0; k < count;) {
+#if TIFFLIB_VERSION >= 20191103
+			uint32 n = fetch_striles(first + k, count - k);
+#else
+			uint32 n = 0;
+#endif
+
+			if (!n) {
+				decode_strile(first + k, nullptr);
+				func(first + k, m_strile_data.data());
+				++k;
+				continue;
+			}
+			for (uint32 kk = 0; kk < n; ++kk) {
+				decode_strile(first + k + kk, &m_ranges[kk]);
+				func(first + k + kk, m_strile_data.data());
+			}
+			k += n;
+		}
+	}
+
+	// Region of plane p covered by a rectangle in units of plane 0.
+	static ImageRect plane_region(const decode_state &state, const ImageRect &rect, unsigned p)
+	{
+		if (p != 1 && p != 2)
+			return rect;
+
+		PlaneFormat plane{ state.image_width / state.subsample_w, state.image_height / state.subsample_h, state.bits_per_sample };
+		return subsample_rect(rect, state.subsample_w, state.subsample_h, plane);
+	}
+
+	// Prepare to reduce a region of the current directory by a factor.
+	void begin_filter(const decode_state &state, const OutputBuffer &buffer, const ImageRect &rect, unsigned factor)
+	{
+		FrameFormat region;
+		region.plane_count = state.color_map[0] ? 3U : state.samples;
+
+		for (unsigned p = 0; p < region.plane_count; ++p) {
+			ImageRect plane_rect = plane_region(state, rect, state.planar_config == PLANARCONFIG_SEPARATE ? p : 0);
+			region.plane[p] = PlaneFormat{ plane_rect.width, plane_rect.height, state.color_map[0] ? 16U : state.bits_per_sample };
+		}
+		m_filter.reset(buffer, region, factor, m_layout, m_sample);
+	}
+
+	void decode_strips(const OutputBuffer &buffer, const ImageRect &rect, unsigned factor)
 	{
 		TIFF *tiff = m_tiff.get();
 		im_assert_d(!TIFFIsTiled(tiff), "image is tiled");
 
 		decode_state state = begin_decode_image();
-		uint32 rows_per_strip;
+		uint32 rows_per_strip = get_rows_per_strip(state.image_height);
 
-		if (!TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip))
-			rows_per_strip = state.image_height;
+		// Strips are read in order, so groups of rows may span strips.
+		begin_filter(state, buffer, rect, factor);
 
-		std::vector<uint8> strip_data(TIFFStripSize(tiff));
+		unsigned planes = state.planar_config == PLANARCONFIG_SEPARATE ? state.samples : 1U;
+		size_t strip_size = TIFFStripSize(tiff);
+		uint32 strips_per_plane = (state.image_height + rows_per_strip - 1) / rows_per_strip;
 		uint32 strip_count = TIFFNumberOfStrips(tiff);
-		uint32 strip_num = 0;
 
-		for (unsigned p = 0; p < (state.planar_config == PLANARCONFIG_SEPARATE ? state.samples : 1U); ++p) {
-			for (uint32 i = 0; i < state.image_height; i += rows_per_strip) {
-				if (TIFFReadEncodedStrip(tiff, strip_num++, strip_data.data(), strip_data.size()) < 0) {
-					throw_saved_exception();
-					throw error::CannotDecodeImage{ "error decoding TIFF strip" };
-				}
-				process_tile(state, buffer, strip_data.data(), p, i, 0, state.image_width, rows_per_strip);
-			}
+		// Only the strips intersecting the region are read.
+		uint32 first_strip = rect.top / rows_per_strip;
+		uint32 last_strip = (rect.top + rect.height - 1) / rows_per_strip;
+
+		for (unsigned p = 0; p < planes; ++p) {
+			uint32 first = p * strips_per_plane + first_strip;
+			uint32 count = std::min(last_strip - first_strip + 1, strip_count - std::min(first, strip_count));
+
+			for_each_strile(first, count, strip_size, [&](uint32 strip_num, const uint8 *data)
+			{
+				uint32 i = (strip_num % strips_per_plane) * rows_per_strip;
+				process_tile(state, rect, data, p, i, 0, state.image_width, rows_per_strip);
+			});
 		}
 	}
 
-	void decode_tiled(const OutputBuffer &buffer)
+	void decode_tiled(const OutputBuffer &buffer, const ImageRect &rect, unsigned factor)
 	{
 		TIFF *tiff = m_tiff.get();
 		im_assert_d(TIFFIsTiled(tiff), "image not tiled");
@@ -367,84 +709,128 @@ class TIFFDecoder : public ImageDecoder {
 		TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &tile_width);
 		TIFFGetField(tiff, TIFFTAG_TILELENGTH, &tile_height);
 
-		std::vector<uint8> tile_data(TIFFTileSize(tiff));
-		uint32 tile_count = TIFFNumberOfTiles(tiff);
-		uint32 tile_num = 0;
-
-		for (unsigned p = 0; p < (state.planar_config == PLANARCONFIG_SEPARATE ? state.samples : 1U); ++p) {
-			for (uint32 i = 0; i < state.image_height; i += tile_height) {
-				for (uint32 j = 0; j < state.image_width; j += tile_width) {
-					if (TIFFReadEncodedTile(tiff, tile_num++, tile_data.data(), tile_data.size()) < 0) {
-						throw_saved_exception();
-						throw error::CannotDecodeImage{ "error decoding TIFF tile" };
-					}
-					process_tile(state, buffer, tile_data.data(), p, i, j, tile_width, tile_height);
-				}
+		// Groups of rows and columns must not span tiles.
+		if ((tile_width / state.subsample_w) % factor || (tile_height / state.subsample_h) % factor)
+			throw error::UnsupportedOperation{ "TIFF tile size not divisible by scale" };
+		begin_filter(state, buffer, rect, factor);
+
+		unsigned planes = state.planar_config == PLANARCONFIG_SEPARATE ? state.samples : 1U;
+		size_t tile_size = TIFFTileSize(tiff);
+		uint32 tiles_across = (state.image_width + tile_width - 1) / tile_width;
+		uint32 tiles_down = (state.image_height + tile_height - 1) / tile_height;
+
+		im_assert_d(tiles_across * tiles_down * planes == TIFFNumberOfTiles(tiff), "did not read all tiles in image");
+
+		// Only the tiles intersecting the region are read. Full rows of tiles are contiguous.
+		uint32 first_col = rect.left / tile_width;
+		uint32 last_col = (rect.left + rect.width - 1) / tile_width;
+		uint32 first_row = rect.top / tile_height;
+		uint32 last_row = (rect.top + rect.height - 1) / tile_height;
+		bool full_rows = first_col == 0 && last_col == tiles_across - 1;
+
+		auto process = [&](uint32 tile_num, const uint8 *data)
+		{
+			unsigned p = tile_num / (tiles_across * tiles_down);
+			uint32 i = (tile_num % (tiles_across * tiles_down)) / tiles_across * tile_height;
+			uint32 j = tile_num % tiles_across * tile_width;
+
+			process_tile(state, rect, data, p, i, j, tile_width, tile_height);
+		};
+
+		for (unsigned p = 0; p < planes; ++p) {
+			uint32 plane_base = p * tiles_across * tiles_down;
+
+			if (full_rows) {
+				for_each_strile(plane_base + first_row * tiles_across, (last_row - first_row + 1) * tiles_across, tile_size, process);
+				continue;
+			}
+			for (uint32 row = first_row; row <= last_row; ++row) {
+				for_each_strile(plane_base + row * tiles_across + first_col, last_col - first_col + 1, tile_size, process);
 			}
 		}
-		im_assert_d(tile_num == tile_count, "did not read all tiles in image");
 	}
 
-	void process_tile(const decode_state &state, const OutputBuffer &buffer, const void *tile_data,
+	// Pass the part of a tile within the region to the box filter.
+	void process_tile(const decode_state &state, const ImageRect &rect, const void *tile_data,
 	                  unsigned p, uint32 i, uint32 j, uint32 tile_width, uint32 tile_height)
 	{
 		uint32 image_width = state.image_width;
 		uint32 image_height = state.image_height;
+		ImageRect plane_rect = plane_region(state, rect, p);
 
 		if (p == 1 || p == 2) {
-			i >>= state.subsample_w;
-			j >>= state.subsample_h;
-			image_width >>= state.subsample_w;
-			image_height >>= state.subsample_h;
-			tile_width >>= state.subsample_w;
-			tile_height >>= state.subsample_h;
+			i /= state.subsample_h;
+			j /= state.subsample_w;
+			image_width /= state.subsample_w;
+			image_height /= state.subsample_h;
+			tile_width /= state.subsample_w;
+			tile_height /= state.subsample_h;
 		}
 
+		unsigned samples = state.planar_config == PLANARCONFIG_CONTIG && !state.color_map[0] ? state.samples : 1U;
 		unsigned bytes_per_sample = state.bits_per_sample / 8;
-		ptrdiff_t tile_stride = static_cast<ptrdiff_t>(tile_width) * bytes_per_sample;
-		tile_width = std::min(image_width - i, tile_width);
-		tile_height = std::min(image_height - i, tile_height);
+		unsigned dst_bytes_per_sample = state.color_map[0] ? sizeof(uint16) : bytes_per_sample;
+		ptrdiff_t tile_stride = static_cast<ptrdiff_t>(tile_width) * bytes_per_sample * samples;
+
+		uint32 top = std::max(i, plane_rect.top);
+		uint32 bottom = std::min({ i + tile_height, plane_rect.top + plane_rect.height, image_height });
+		uint32 left = std::max(j, plane_rect.left);
+		uint32 right = std::min({ j + tile_width, plane_rect.left + plane_rect.width, image_width });
+
+		if (top >= bottom || left >= right)
+			return;
+
+		unsigned n = right - left;
+		unsigned x = left - plane_rect.left;
+		tile_data = static_cast<const uint8 *>(tile_data) + (top - i) * tile_stride + (left - j) * bytes_per_sample * samples;
+
+		auto dst_ptr = [&](unsigned pp, uint32 ti)
+		{
+			return static_cast<uint8 *>(m_filter.row(pp, ti - plane_rect.top)) + x * dst_bytes_per_sample;
+		};
 
 		if (state.color_map[0]) {
 			// Depalettize image.
-			void *dst_p[3];
-
-			for (unsigned pp = 0; pp < 3; ++pp) {
-				dst_p[pp] = static_cast<uint8 *>(buffer.data[pp]) + i * buffer.stride[pp] + j * bytes_per_sample;
-			}
-			for (unsigned ti = 0; ti < tile_height; ++ti) {
-				depalettize(dst_p, tile_data, tile_width, state.color_map, state.bits_per_sample);
+			for (uint32 ti = top; ti < bottom; ++ti) {
+				void *dst_p[3] = { dst_ptr(0, ti), dst_ptr(1, ti), dst_ptr(2, ti) };
+				depalettize(dst_p, tile_data, n, state.color_map, state.bits_per_sample);
 
 				for (unsigned pp = 0; pp < 3; ++pp) {
-					dst_p[pp] = static_cast<uint8 *>(dst_p[pp]) + buffer.stride[pp];
+					m_filter.commit(pp, ti - plane_rect.top, x, x + n);
 				}
 				tile_data = static_cast<const uint8 *>(tile_data) + tile_stride;
 			}
 		} else if (state.planar_config == PLANARCONFIG_SEPARATE) {
 			// Copy tile.
-			void *dst_p = static_cast<uint8 *>(buffer.data[p]) + i * buffer.stride[p] + j * bytes_per_sample;
+			for (uint32 ti = top; ti < bottom; ++ti) {
+				void *dst_p = dst_ptr(p, ti);
 
-			for (unsigned ti = 0; ti < tile_height; ++ti) {
-				std::copy_n(static_cast<const uint8 *>(tile_data), tile_width * bytes_per_sample, static_cast<uint8 *>(dst_p));
+				std::copy_n(static_cast<const uint8 *>(tile_data), n * bytes_per_sample, static_cast<uint8 *>(dst_p));
 				if (state.photometric == PHOTOMETRIC_MINISWHITE)
-					invert(dst_p, tile_width, state.bits_per_sample);
+					invert(dst_p, n, state.bits_per_sample);
 
-				dst_p = static_cast<uint8 *>(dst_p) + buffer.stride[p];
+				m_filter.commit(p, ti - plane_rect.top, x, x + n);
 				tile_data = static_cast<const uint8 *>(tile_data) + tile_stride;
 			}
 		} else if (state.planar_config == PLANARCONFIG_CONTIG) {
-			// Packed to planar conversion
-			void *dst_p[4];
-			tile_stride *= state.samples;
+			static const unsigned src_pos[MAX_PLANE_COUNT] = { 0, 1, 2, 3 };
 
-			for (unsigned pp = 0; pp < state.samples; ++pp) {
-				dst_p[pp] = static_cast<uint8 *>(buffer.data[pp]) + i * buffer.stride[pp] + j * bytes_per_sample;
-			}
-			for (unsigned ti = 0; ti < tile_height; ++ti) {
-				unpack(dst_p, tile_data, tile_width, state.samples, state.bits_per_sample);
+			// Packed to planar conversion, unless the output is also packed.
+			for (uint32 ti = top; ti < bottom; ++ti) {
+				void *dst_p[4] = {};
+
+				if (m_filter.pack(ti - plane_rect.top, x, x + n, tile_data, state.samples, src_pos)) {
+					tile_data = static_cast<const uint8 *>(tile_data) + tile_stride;
+					continue;
+				}
+
+				for (unsigned pp = 0; pp < state.samples; ++pp) {
+					dst_p[pp] = dst_ptr(pp, ti);
+				}
+				unpack(dst_p, tile_data, n, state.samples, state.bits_per_sample);
 
 				for (unsigned pp = 0; pp < state.samples; ++pp) {
-					dst_p[pp] = static_cast<uint8 *>(dst_p[pp]) + buffer.stride[pp];
+					m_filter.commit(pp, ti - plane_rect.top, x, x + n);
 				}
 				tile_data = static_cast<const uint8 *>(tile_data) + tile_stride;
 			}
@@ -453,6 +839,171 @@ class TIFFDecoder : public ImageDecoder {
 		}
 	}
 
+	// Switch to a reduced-resolution image of the current directory matching
+	// format, stored as a SubIFD or as a following reduced-image directory.
+	bool enter_reduced_directory(const FrameFormat &format)
+	{
+		TIFF *tiff = m_tiff.get();
+		tdir_t dir = TIFFCurrentDirectory(tiff);
+		std::vector<toff_t> sub_ifds;
+		uint16 sub_ifd_count;
+		toff_t *sub_ifd_offsets;
+
+		if (TIFFGetField(tiff, TIFFTAG_SUBIFD, &sub_ifd_count, &sub_ifd_offsets))
+			sub_ifds.assign(sub_ifd_offsets, sub_ifd_offsets + sub_ifd_count);
+
+		auto matches = [&]()
+		{
+			FrameFormat reduced;
+
+			try {
+				current_directory_format(&reduced);
+			} catch (const error::CannotDecodeImage &) {
+				return false;
+			}
+			if (reduced.plane_count != format.plane_count || reduced.color_family != format.color_family)
+				return false;
+
+			for (unsigned p = 0; p < format.plane_count; ++p) {
+				if (reduced.plane[p].width != format.plane[p].width || reduced.plane[p].height != format.plane[p].height ||
+				    reduced.plane[p].bit_depth != format.plane[p].bit_depth)
+					return false;
+			}
+			return true;
+		};
+
+		for (toff_t off : sub_ifds) {
+			if (TIFFSetSubDirectory(tiff, off) && matches())
+				return true;
+		}
+
+		if (!sub_ifds.empty() && !TIFFSetDirectory(tiff, dir))
+			throw error::CannotDecodeImage{ "error reading TIFF directory" };
+
+		while (!TIFFLastDirectory(tiff) && TIFFReadDirectory(tiff)) {
+			uint32 subfile_type;
+
+			if (!TIFFGetField(tiff, TIFFTAG_SUBFILETYPE, &subfile_type) || !(subfile_type & FILETYPE_REDUCEDIMAGE))
+				break;
+			if (matches())
+				return true;
+		}
+
+		if (!TIFFSetDirectory(tiff, dir)) {
+			throw_saved_exception();
+			throw error::CannotDecodeImage{ "error reading TIFF directory" };
+		}
+		return false;
+	}
+
+	// Decode a rectangle of the current directory reduced by a factor.
+	void decode_source(const OutputBuffer &buffer, const ImageRect &src, unsigned factor)
+	{
+		if (TIFFIsTiled(m_tiff.get()))
+			decode_tiled(buffer, src, factor);
+		else
+			decode_strips(buffer, src, factor);
+	}
+
+	// Decode the current directory reduced by a factor in bands of whole
+	// strips or rows of tiles, passing each to sink until it stops.
+	void decode_bands(RowSink &sink, const FrameFormat &format, unsigned factor)
+	{
+		TIFF *tiff = m_tiff.get();
+		uint32 strile_rows;
+
+		if (TIFFIsTiled(tiff))
+			TIFFGetField(tiff, TIFFTAG_TILELENGTH, &strile_rows);
+		else if (!TIFFGetField(tiff, TIFFTAG_ROWSPERSTRIP, &strile_rows) || strile_rows > format.plane[0].height)
+			strile_rows = format.plane[0].height;
+
+		// Groups of rows reduced together must not span bands.
+		uint64 band_rows = std::max(strile_rows, static_cast<uint32>(1));
+		while (band_rows % factor)
+			band_rows *= 2;
+
+		FrameFormat scaled = scale_frame_format(format, factor);
+		unsigned height = scaled.plane[0].height;
+
+		m_strip.reset(convert_frame_format(scaled, m_sample), static_cast<unsigned>(std::min(band_rows / factor, static_cast<uint64>(height))), m_layout);
+
+		for (unsigned top = 0; top < height; top += m_strip.rows()) {
+			unsigned rows = std::min(m_strip.rows(), height - top);
+
+			decode_source(m_strip.buffer(), unscale_rect({ 0, top, scaled.plane[0].width, rows }, factor, format.plane[0]), factor);
+			if (!m_strip.flush(sink, top, rows))
+				break;
+		}
+	}
+
+	// Decode a rectangle of the scaled frame, or the whole frame in bands if
+	// sink is given.
+	void decode_frame(const OutputBuffer &buffer, const ImageRect &rect, RowSink *sink = nullptr) try
+	{
+		check_layout(next_frame_format());
+
+		TIFF *tiff = m_tiff.get();
+		tdir_t dir = TIFFCurrentDirectory(tiff);
+		FrameFormat format = native_frame_format();
+		unsigned factor = m_scale_denom;
+		bool reduced = false;
+
+		// Prefer a stored reduced-resolution image to filtering the full one.
+		if (factor > 1 && enter_reduced_directory(scale_frame_format(format, factor))) {
+			reduced = true;
+			format = scale_frame_format(format, factor);
+			factor = 1;
+		}
+
+		// Do decoding.
+		if (sink)
+			decode_bands(*sink, format, factor);
+		else
+			decode_source(buffer, unscale_rect(rect, factor, format.plane[0]), factor);
+
+		if (reduced && !TIFFSetDirectory(tiff, dir)) {
+			throw_saved_exception();
+			throw error::CannotDecodeImage{ "error reading TIFF directory" };
+		}
+
+		m_frame_format = FrameFormat{};
+
+		if (TIFFLastDirectory(tiff))
+			done();
+	} catch (const std::bad_alloc &) {
+		throw error::OutOfMemory{};
+	}
+
+	void open()
+	{
+		m_tiff.reset(TIFFClientOpen(
+			m_io->path(), "r", this, &TIFFDecoder::read_proc, &TIFFDecoder::write_proc, &TIFFDecoder::seek_proc,
+			&TIFFDecoder::close_proc, &TIFFDecoder::size_proc, nullptr, nullptr));
+		if (!m_tiff) {
+			throw_saved_exception();
+			throw error::CannotCreateCodec{ "error creating TIFF context" };
+		}
+
+		m_initial = true;
+		m_alive = true;
+	}
+
+	// Full-resolution format of the next frame.
+	const FrameFormat &native_frame_format()
+	{
+		if (is_constant_format(file_format()))
+			return m_file_format;
+
+		if (!is_constant_format(m_frame_format)) {
+			if (!TIFFReadDirectory(m_tiff.get())) {
+				throw_saved_exception();
+				throw error::CannotDecodeImage{ "error reading TIFF directory" };
+			}
+			current_directory_format(&m_frame_format);
+		}
+		return m_frame_format;
+	}
+
 	void done()
 	{
 		m_tiff.reset();
@@ -471,20 +1022,16 @@ public:
 	explicit TIFFDecoder(std::unique_ptr<IOContext> io) :
 		m_tiff{},
 		m_io{ std::move(io) },
+		m_strile_data(m_allocator),
+		m_raw_data(m_allocator),
+		m_ranges(m_allocator),
+		m_filter{ m_allocator },
+		m_strip{ m_allocator },
 		m_file_format{ ImageType::TIFF },
 		m_initial{},
 		m_alive{}
 	{
-		m_tiff.reset(TIFFClientOpen(
-			m_io->path(), "r", this, &TIFFDecoder::read_proc, &TIFFDecoder::write_proc, &TIFFDecoder::seek_proc,
-			&TIFFDecoder::close_proc, &TIFFDecoder::size_proc, nullptr, nullptr));
-		if (!m_tiff) {
-			throw_saved_exception();
-			throw error::CannotCreateCodec{ "error creating TIFF context" };
-		}
-
-		m_initial = true;
-		m_alive = true;
+		open();
 	}
 
 	~TIFFDecoder()
@@ -509,38 +1056,85 @@ public:
 	{
 		if (!m_alive)
 			return{};
-		if (is_constant_format(file_format()))
-			return file_format();
 
-		if (!is_constant_format(m_frame_format)) {
-			if (!TIFFReadDirectory(m_tiff.get())) {
-				throw_saved_exception();
-				throw error::CannotDecodeImage{ "error reading TIFF directory" };
-			}
-			current_directory_format(&m_frame_format);
+		return convert_frame_format(scale_frame_format(native_frame_format(), m_scale_denom), m_sample);
+	}
+
+	void decode(const OutputBuffer &buffer) override
+	{
+		if (!m_alive)
+			return;
+
+		decode_frame(buffer, full_frame_rect(next_frame_format()));
+	}
+
+	void decode_region(const OutputBuffer &buffer, const ImageRect &rect) override
+	{
+		if (!m_alive)
+			return;
+
+		FrameFormat format = native_frame_format();
+		unsigned sw = 1;
+		unsigned sh = 1;
+
+		if (format.color_family == ColorFamily::YUV || format.color_family == ColorFamily::YUVA) {
+			sw = format.plane[0].width / std::max(format.plane[1].width, 1U);
+			sh = format.plane[0].height / std::max(format.plane[1].height, 1U);
 		}
-		return m_frame_format;
+		check_region(scale_frame_format(format, m_scale_denom), rect, sw, sh);
+		decode_frame(buffer, rect);
 	}
 
-	void decode(const OutputBuffer &buffer) override try
+	void decode_rows(RowSink &sink) override
 	{
 		if (!m_alive)
 			return;
 
+		decode_frame(OutputBuffer{}, ImageRect{}, &sink);
+	}
+
+	size_t scratch_bytes() override
+	{
+		if (!is_constant_format(next_frame_format()))
+			return 0;
+
 		TIFF *tiff = m_tiff.get();
+		bool tiled = TIFFIsTiled(tiff);
+		size_t strile_size = tiled ? TIFFTileSize(tiff) : TIFFStripSize(tiff);
+		size_t bytes = strile_size + BoxFilter::scratch_bytes(native_frame_format(), m_scale_denom, m_layout, m_sample);
+
+#if TIFFLIB_VERSION >= 20191103
+		// Compressed data for a batch is read in one request, never more than the file.
+		if (m_io->seekable()) {
+			size_t raw_size = static_cast<size_t>(std::min(static_cast<IOContext::size_type>(STRILE_BATCH_BYTES), m_io->size()));
+			uint32 strile_count = tiled ? TIFFNumberOfTiles(tiff) : TIFFNumberOfStrips(tiff);
+			size_t batch = std::min(static_cast<size_t>(strile_count), STRILE_BATCH_COUNT);
+			bytes += raw_size + batch * sizeof(IOContext::ReadRange);
+		}
+#endif
+		return bytes;
+	}
 
-		// Do decoding.
-		if (TIFFIsTiled(tiff))
-			decode_tiled(buffer);
-		else
-			decode_strips(buffer);
+	void reset(std::unique_ptr<IOContext> io) override
+	{
+		// A TIFF handle is bound to its file, so only the strip buffers carry over.
+		done();
 
+		m_exception = nullptr;
+		m_io = std::move(io);
+		m_file_format = FileFormat{ ImageType::TIFF };
 		m_frame_format = FrameFormat{};
+		open();
+	}
 
-		if (TIFFLastDirectory(tiff))
-			done();
-	} catch (const std::bad_alloc &) {
-		throw error::OutOfMemory{};
+	void set_allocator(Allocator *allocator) override
+	{
+		ImageDecoder::set_allocator(allocator);
+		m_strile_data = ScratchVector<uint8>(m_allocator);
+		m_raw_data = ScratchVector<uint8>(m_allocator);
+		m_ranges = ScratchVector<IOContext::ReadRange>(m_allocator);
+		m_filter.set_allocator(m_allocator);
+		m_strip.set_allocator(m_allocator);
 	}
 };
 
@@ -557,13 +1151,33 @@ int TIFFDecoderFactory::priority() const
 	return PRIORITY_NORMAL;
 }
 
+ImageType TIFFDecoderFactory::type() const
+{
+	return ImageType::TIFF;
+}
+
+bool TIFFDecoderFactory::probe(const void *buf, size_t size) const
+{
+	return probe_tiff(buf, size);
+}
+
+bool TIFFDecoderFactory::matches_extension(const char *path) const
+{
+	return is_matching_extension(path, tiff_extensions.data(), tiff_extensions.size());
+}
+
+bool TIFFDecoderFactory::probe_format(IOContext *io, FileFormat *format) const
+{
+	return TIFFHeaderReader{ io }.read(format);
+}
+
 std::unique_ptr<ImageDecoder> TIFFDecoderFactory::create_decoder(const char *path, const FileFormat *format, std::unique_ptr<IOContext> &&io) try
 {
 	bool recognized;
 
 	if (format)
 		recognized = format->type == ImageType::TIFF;
-	else if (io->seekable())
+	else if (io->rewindable())
 		recognized = recognize_tiff(io.get());
 	else
 		recognized = is_matching_extension(path, tiff_extensions.data(), tiff_extensions.size());
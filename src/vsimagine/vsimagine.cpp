@@ -3,6 +3,7 @@
 #include <cstring>
 #include <exception>
 #include <limits>
+#include <memory>
 #include <regex>
 #include <sstream>
 #include <stdexcept>
@@ -117,9 +118,9 @@ int get_sequence_length(const FormatString &fmt, int initial)
 	}
 }
 
-VSColorFamily match_color_family(const imaginexx::FileFormat &format)
+VSColorFamily match_color_family(const imaginexx::im_file_format_info &format)
 {
-	switch (format.color_family()) {
+	switch (format.color_family) {
 	case IMAGINE_COLOR_FAMILY_GRAY:
 	case IMAGINE_COLOR_FAMILY_GRAYALPHA:
 		return cmGray;
@@ -130,9 +131,9 @@ VSColorFamily match_color_family(const imaginexx::FileFormat &format)
 	case IMAGINE_COLOR_FAMILY_YUVA:
 		return cmYUV;
 	default:
-		if (format.plane_count() == 1)
+		if (format.plane_count == 1)
 			return cmGray;
-		else if (format.plane_count() == 3)
+		else if (format.plane_count == 3)
 			return cmYUV;
 		else
 			throw std::runtime_error{ "unable to map color family" };
@@ -146,13 +147,13 @@ bool has_alpha(imagine_color_family_e color_family)
 		color_family == IMAGINE_COLOR_FAMILY_YUVA;
 }
 
-std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::FileFormat &imformat, const VapourCore &core)
+std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::im_file_format_info &imformat, const VapourCore &core)
 {
-	unsigned w = imformat.width(0);
-	unsigned h = imformat.height(0);
-	unsigned depth = imformat.bit_depth(0);
-	VSSampleType st = imformat.is_floating_point(0) ? stFloat : stInteger;
-	unsigned plane_count = imformat.plane_count();
+	unsigned w = imformat.plane[0].width;
+	unsigned h = imformat.plane[0].height;
+	unsigned depth = imformat.plane[0].bit_depth;
+	VSSampleType st = imformat.plane[0].is_floating_point ? stFloat : stInteger;
+	unsigned plane_count = imformat.plane_count;
 	unsigned subsample_w = 0;
 	unsigned subsample_h = 0;
 
@@ -160,9 +161,9 @@ std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::FileForm
 		throw std::runtime_error{ "unsupported bit depth" };
 
 	if (plane_count >= 3 &&
-		((imformat.width(1) != imformat.width(2)) || (imformat.height(1) != imformat.height(2))))
+		((imformat.plane[1].width != imformat.plane[2].width) || (imformat.plane[1].height != imformat.plane[2].height)))
 		throw std::runtime_error{ "different U and V dimensions not supported" };
-	if (!has_alpha(imformat.color_family()) && imformat.plane_count() >= 4)
+	if (!has_alpha(imformat.color_family) && imformat.plane_count >= 4)
 		throw std::runtime_error{ "4-plane formats not supported" };
 
 	VSColorFamily cf = match_color_family(imformat);
@@ -170,9 +171,9 @@ std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::FileForm
 		return{ w, h, core.register_format(cf, st, depth, 0, 0) };
 
 	for (unsigned p = 1; p < plane_count; ++p) {
-		if (imformat.width(p) > w || imformat.height(p) > h)
+		if (imformat.plane[p].width > w || imformat.plane[p].height > h)
 			throw std::runtime_error{ "luma subsampling not allowed" };
-		if (imformat.bit_depth(p) != depth || imformat.is_floating_point(p) && st != stFloat)
+		if (imformat.plane[p].bit_depth != depth || imformat.plane[p].is_floating_point && st != stFloat)
 			throw std::runtime_error{ "per-plane bit depth not supported" };
 	}
 
@@ -184,17 +185,17 @@ std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::FileForm
 		unsigned h_ceil = h % ss_mod ? (h + ss_mod - h % ss_mod) : h;
 
 		// Fix bad YUV images with wrong luma modulo.
-		if (imformat.width(1) << ss == w_floor || imformat.width(1) << ss == w_ceil) {
+		if (imformat.plane[1].width << ss == w_floor || imformat.plane[1].width << ss == w_ceil) {
 			w = w_ceil;
 			subsample_w = ss;
 		}
-		if (imformat.height(1) << ss == h_floor || imformat.height(1) << ss == h_ceil) {
+		if (imformat.plane[1].height << ss == h_floor || imformat.plane[1].height << ss == h_ceil) {
 			h = h_ceil;
 			subsample_h = ss;
 		}
 	}
-	if ((w != imformat.width(1) << subsample_w && w != (imformat.width(1) + 1) << subsample_w) ||
-	    (h != imformat.height(1) << subsample_h && h != (imformat.height(1) + 1) << subsample_h))
+	if ((w != imformat.plane[1].width << subsample_w && w != (imformat.plane[1].width + 1) << subsample_w) ||
+	    (h != imformat.plane[1].height << subsample_h && h != (imformat.plane[1].height + 1) << subsample_h))
 		throw std::runtime_error{ "unsupported subsampling" };
 
 	if (cf == cmRGB && (subsample_w || subsample_h))
@@ -202,7 +203,7 @@ std::tuple<int, int, const VSFormat *> adjust_imformat(const imaginexx::FileForm
 	return{ w, h, core.register_format(cf, st, depth, subsample_w, subsample_h) };
 }
 
-void fix_bad_yuv_dimensions(const VideoFrame &vsframe, const imaginexx::FileFormat &imformat)
+void fix_bad_yuv_dimensions(const VideoFrame &vsframe, const imaginexx::im_file_format_info &imformat)
 {
 	const VSFormat &vsformat = vsframe.format();
 
@@ -210,21 +211,21 @@ void fix_bad_yuv_dimensions(const VideoFrame &vsframe, const imaginexx::FileForm
 		unsigned w = vsframe.width(p);
 		unsigned h = vsframe.height(p);
 
-		if (w != imformat.width(p) || h != imformat.height(p)) {
+		if (w != imformat.plane[p].width || h != imformat.plane[p].height) {
 			// Duplicate the last row.
 			uint8_t *base_ptr = static_cast<uint8_t *>(vsframe.write_ptr(p));
 			ptrdiff_t stride = vsframe.stride(p);
 
-			const uint8_t *last_row = base_ptr + static_cast<ptrdiff_t>(imformat.height(p) - 1) * stride;
-			for (unsigned i = imformat.height(p); i < h; ++i) {
+			const uint8_t *last_row = base_ptr + static_cast<ptrdiff_t>(imformat.plane[p].height - 1) * stride;
+			for (unsigned i = imformat.plane[p].height; i < h; ++i) {
 				memcpy(base_ptr + static_cast<ptrdiff_t>(i) * stride, last_row, w * vsformat.bytesPerSample);
 			}
 			// Duplicate the last column.
 			for (unsigned i = 0; i < h; ++i) {
 				uint8_t *row = base_ptr + static_cast<ptrdiff_t>(i) * stride;
-				const uint8_t *sample = row + (imformat.width(p) - 1) * vsformat.bytesPerSample;
+				const uint8_t *sample = row + (imformat.plane[p].width - 1) * vsformat.bytesPerSample;
 
-				for (unsigned j = imformat.width(p); j < w; ++j) {
+				for (unsigned j = imformat.plane[p].width; j < w; ++j) {
 					memcpy(row + j * vsformat.bytesPerSample, sample, vsformat.bytesPerSample);
 				}
 			}
@@ -237,37 +238,61 @@ void fix_bad_yuv_dimensions(const VideoFrame &vsframe, const imaginexx::FileForm
 
 class ImageView : public FilterBase {
 	imaginexx::DecoderRegistry m_registry;
+	std::unique_ptr<imaginexx::Decoder> m_decoder;
 	FormatString m_format_str;
 	VSVideoInfo m_vi;
 	int m_initial;
 
-	void probe_image(const std::string &path, imaginexx::FileFormat *format) try
+	void probe_image(const std::string &path, imaginexx::im_file_format_info *format) try
 	{
 		imaginexx::IOContext io{ imaginexx::IOContext::from_file_ro(path.c_str()) };
 		imaginexx::Decoder decoder{ m_registry.create_decoder(path.c_str(), nullptr, io.pass()) };
 		if (decoder.is_null())
 			throw std::runtime_error{ "no decoder for format" };
 
-		decoder.next_frame_format(*format);
+		decoder.next_frame_format(format);
 		if (!format->is_constant_format())
 			throw std::runtime_error{ "decoder did not return a frame" };
 	} catch (const imaginexx::im_error &e) {
 		translate_imerror(e);
 	}
 
+	imaginexx::Decoder &open_decoder(const std::string &path, imaginexx::im_file_format_info &imformat)
+	{
+		imagine_file_options file_options;
+		imagine_file_options_default(&file_options);
+		file_options.access_hint = IMAGINE_ACCESS_WILLNEED;
+
+		// Files in a sequence usually share a type, so try the previous decoder first.
+		if (m_decoder) {
+			try {
+				imaginexx::IOContext io{ imaginexx::IOContext::from_file_ro(path.c_str(), &file_options) };
+				m_decoder->reset(io.pass());
+				m_decoder->next_frame_format(&imformat);
+				return *m_decoder;
+			} catch (const imaginexx::im_error &) {
+				m_decoder.reset();
+			}
+		}
+
+		imaginexx::IOContext io{ imaginexx::IOContext::from_file_ro(path.c_str(), &file_options) };
+		std::unique_ptr<imaginexx::Decoder> decoder{ new imaginexx::Decoder{ m_registry.create_decoder(path.c_str(), nullptr, io.pass()) } };
+		if (decoder->is_null())
+			throw std::runtime_error{ "no decoder for format" };
+
+		decoder->next_frame_format(&imformat);
+		m_decoder = std::move(decoder);
+		return *m_decoder;
+	}
+
 	VideoFrame decode_image(int n, const VapourCore &core) try
 	{
 		VideoFrame ret_frame;
 		VideoFrame alpha_frame;
 
 		std::string path = m_format_str.format(m_initial + n);
-		imaginexx::IOContext io{ imaginexx::IOContext::from_file_ro(path.c_str()) };
-		imaginexx::Decoder decoder{ m_registry.create_decoder(path.c_str(), nullptr, io.pass()) };
-		if (decoder.is_null())
-			throw std::runtime_error{ "no decoder for format" };
-
-		imaginexx::FileFormat imformat{ imaginexx::FileFormat::create() };
-		decoder.next_frame_format(imformat);
+		imaginexx::im_file_format_info imformat;
+		imaginexx::Decoder &decoder = open_decoder(path, imformat);
 		if (!imformat.is_constant_format())
 			throw std::runtime_error{ "decoder did not return a frame" };
 
@@ -279,7 +304,7 @@ class ImageView : public FilterBase {
 		if ((m_vi.width && m_vi.height && m_vi.format) && (w != m_vi.width || h != m_vi.height || vsformat != m_vi.format))
 			throw std::runtime_error{ "image format changed" };
 
-		bool alpha = has_alpha(imformat.color_family());
+		bool alpha = has_alpha(imformat.color_family);
 		ret_frame = core.new_video_frame(*vsformat, w, h);
 		if (alpha) {
 			const VSFormat *alpha_vsformat = core.register_format(cmGray, static_cast<VSSampleType>(vsformat->sampleType), vsformat->bitsPerSample, 0, 0);
@@ -292,8 +317,8 @@ class ImageView : public FilterBase {
 			imbuffer.stride[p] = ret_frame.stride(p);
 		}
 		if (alpha) {
-			imbuffer.data[imformat.plane_count() - 1] = alpha_frame.write_ptr(0);
-			imbuffer.stride[imformat.plane_count() - 1] = alpha_frame.stride(0);
+			imbuffer.data[imformat.plane_count - 1] = alpha_frame.write_ptr(0);
+			imbuffer.stride[imformat.plane_count - 1] = alpha_frame.stride(0);
 		}
 		decoder.decode(imbuffer);
 		fix_bad_yuv_dimensions(ret_frame, imformat);
@@ -353,7 +378,7 @@ public:
 
 		m_vi.numFrames = frame_count;
 		if (constant) {
-			imaginexx::FileFormat imformat{ imaginexx::FileFormat::create() };
+			imaginexx::im_file_format_info imformat;
 			probe_image(m_format_str.format(initial), &imformat);
 			std::tie(m_vi.width, m_vi.height, m_vi.format) = adjust_imformat(imformat, core);
 		}